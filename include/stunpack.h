@@ -20,6 +20,7 @@
 #ifndef STPK_STUNPACK_H
 #define STPK_STUNPACK_H
 
+#include <stdarg.h>
 #include <stddef.h>
 
 #define STPK_VERSION "0.2.0"
@@ -30,6 +31,19 @@
 #define STPK_RET_ERR               1
 #define STPK_RET_ERR_UNKNOWN_FMT   3
 #define STPK_RET_ERR_DATA_LEFT    10
+#define STPK_RET_NEED_INPUT       11
+#define STPK_RET_MORE_OUTPUT      12
+
+// Bytes past the end of a destination buffer that decoders may overwrite, as
+// they store whole words instead of checking each write.
+#define STPK_DST_PADDING 0x10
+
+// Alignment of buffers unless the context asks for more.
+#define STPK_ALIGN_DEFAULT 0x10
+
+// Alignments worth asking for, of a cache line and of a huge page.
+#define STPK_ALIGN_CACHE_LINE 0x40
+#define STPK_ALIGN_HUGE_PAGE  0x200000
 
 typedef enum {
 	// Automatic format detection when decompressing.
@@ -44,8 +58,8 @@ typedef enum {
 } stpk_FmtType;
 
 typedef enum {
-	// Attempt automatic detection by first trying version 2 and falling back
-	// to version 1 if it fails.
+	// Attempt automatic detection by probing the beginning of each Huffman
+	// pass with both versions, preferring version 2 if both are plausible.
 	STPK_FMT_DSI_VER_AUTO,
 	// Big-endian Huffman codes. Used by BB/MS Stunts 1.1.
 	STPK_FMT_DSI_VER_1,
@@ -53,6 +67,24 @@ typedef enum {
 	STPK_FMT_DSI_VER_2
 } stpk_FmtDsiVer;
 
+typedef enum {
+	// Use multi-symbol Huffman lookup tables when the expected gain outweighs
+	// the cost of building them.
+	STPK_FMT_DSI_MULTI_AUTO,
+	// Decode one Huffman code per table lookup.
+	STPK_FMT_DSI_MULTI_OFF,
+	// Always decode with multi-symbol Huffman lookup tables.
+	STPK_FMT_DSI_MULTI_ON
+} stpk_FmtDsiMulti;
+
+typedef enum {
+	// Write blocks of up to 16 bytes with a single whole word store.
+	STPK_FMT_RPCK_STORE_SHORT,
+	// Copy or fill each block after branching on its type, which is slower
+	// for short blocks. Kept to compare throughput with.
+	STPK_FMT_RPCK_STORE_BLOCK
+} stpk_FmtRpckStore;
+
 //typedef enum {
 //	STPK_FMT_DSI_RLE  = 1,
 //	STPK_FMT_DSI_HUFF = 2
@@ -61,20 +93,29 @@ typedef enum {
 typedef struct {
 	stpk_FmtDsiVer version;
 	int maxPasses;
+	stpk_FmtDsiMulti multi;
+	// Decode all passes in a single buffer, each pass reading its source from
+	// the end of the buffer while writing from the start. The buffer is
+	// allocated unless the source is already placed at the end of a buffer of
+	// stpk_getInPlaceLen() bytes.
+	int inPlace;
+	// Version used by the last Huffman pass, set after decompression.
+	stpk_FmtDsiVer detected;
 } stpk_FmtDsi;
 
 //typedef struct {
 //} stpk_FmtEac;
 
-//typedef struct {
-//} stpk_FmtRpck;
+typedef struct {
+	stpk_FmtRpckStore store;
+} stpk_FmtRpck;
 
 typedef struct {
 	stpk_FmtType type;
 	union {
 		stpk_FmtDsi  dsi;
 		//stpk_FmtEac  eac;
-		//stpk_FmtRpck rpck;
+		stpk_FmtRpck rpck;
 	};
 } stpk_Format;
 
@@ -85,8 +126,22 @@ typedef enum {
 } stpk_LogType;
 
 typedef void (*stpk_LogCallback)(stpk_LogType type, const char *msg, ...);
+// Log callback that is passed user data, so the logs of contexts decoding at
+// the same time can be told apart. Used instead of logCallback when set.
+typedef void (*stpk_LogSinkCallback)(void *userData, stpk_LogType type, const char *msg, va_list args);
 typedef void* (*stpk_AllocCallback)(size_t size);
 typedef void (*stpk_DeallocCallback)(void *ptr);
+typedef void* (*stpk_AllocAlignedCallback)(void *userData, size_t size, size_t align);
+typedef void (*stpk_DeallocAlignedCallback)(void *userData, void *ptr);
+
+// Allocator that is passed user data and the alignment wanted, such as a
+// per-thread pool or an arena from stpk_arena_allocator(). Used instead of
+// allocCallback and deallocCallback when alloc is set.
+typedef struct {
+	stpk_AllocAlignedCallback   alloc;
+	stpk_DeallocAlignedCallback dealloc;
+	void                        *userData;
+} stpk_Allocator;
 
 typedef struct {
 	unsigned char *data;
@@ -94,24 +149,160 @@ typedef struct {
 	unsigned int  len;
 } stpk_Buffer;
 
+typedef enum {
+	// Huffman decoding steps of a single code.
+	STPK_TRACE_HUFF_REFILL,
+	STPK_TRACE_HUFF_ESCAPE,
+	STPK_TRACE_HUFF_SYMBOL,
+	STPK_TRACE_HUFF_MULTI,
+	// Run-length tokens.
+	STPK_TRACE_RLE_RUN,
+	STPK_TRACE_RLE_LITERAL,
+	// RPck blocks.
+	STPK_TRACE_RPCK_COPY,
+	STPK_TRACE_RPCK_FILL
+} stpk_TraceType;
+
+// Decoding step recorded by a trace. Fields not used by its type are 0.
+typedef struct {
+	unsigned int   srcOffset;
+	unsigned int   dstOffset;
+	unsigned short bits;    // Next 16 bits of the Huffman bit reservoir.
+	unsigned short len;     // Length of a run or block, or symbols written from the multi-symbol table.
+	unsigned char  type;    // stpk_TraceType.
+	unsigned char  count;   // Bits left in the Huffman bit reservoir.
+	unsigned char  width;   // Width of the Huffman code.
+	unsigned char  value;   // Symbol or byte written.
+} stpk_TraceEvent;
+
+// Length of an event packed by stpk_trace_pack().
+#define STPK_TRACE_EVENT_LEN 16
+
+// Called with all events of a trace when its buffer is full.
+typedef void (*stpk_TraceFlushCallback)(void *userData, const stpk_TraceEvent *events, unsigned int len);
+
+// Ring buffer of events recorded while decompressing. Once full, the events are
+// passed to flush and the buffer emptied, or without flush the oldest events
+// are overwritten. Events still in the buffer after decompression are the len
+// events before next, wrapping around. Streams do not record events.
+typedef struct {
+	stpk_TraceEvent         *events;
+	unsigned int            size;      // Events the buffer holds.
+	unsigned int            len;       // Events in the buffer.
+	unsigned int            next;      // Index of the next event recorded.
+	stpk_TraceFlushCallback flush;
+	void                    *userData;
+} stpk_Trace;
+
+// Entry of a resource container, the format most Stunts files unpack to.
+typedef struct {
+	char         id[5];   // 4-character ID, NUL-terminated.
+	unsigned int offset;  // Offset in the unpacked file.
+	unsigned int len;
+} stpk_Resource;
+
+// State of a decompression. Nothing is shared between contexts, so separate
+// contexts may be used from different threads at once.
 typedef struct {
 	stpk_Buffer          src;
 	stpk_Buffer          dst;
+	// Stop decompressing once this many bytes of the output are decoded, or 0
+	// to decode all of it. Passes before the last decode only as much as the
+	// next one needs, and dst.len is set to the length decoded.
+	unsigned int         limit;
+	// Caller's memory that stpk_decompressInto() takes working buffers from
+	// instead of allocating them, with offset as the length in use. Only set
+	// while it runs.
+	stpk_Buffer          scratch;
 	stpk_Format          format;
 	int                  verbosity;
 	stpk_LogCallback     logCallback;
+	stpk_LogSinkCallback logSink;
+	void                 *logData;
 	stpk_AllocCallback   allocCallback;
 	stpk_DeallocCallback deallocCallback;
+	stpk_Allocator       allocator;
+	// Alignment of the buffers allocated, a power of two, or 0 for
+	// STPK_ALIGN_DEFAULT. Only the allocator and the scratch region are told,
+	// allocCallback is expected to align for the largest type like malloc().
+	unsigned int         align;
+	// Record decoding steps in this trace, or NULL. Ignored if the library is
+	// built with STPK_TRACE defined as 0.
+	stpk_Trace           *trace;
 } stpk_Context;
 
+// Decompression of a source fed in chunks, with the output read back in chunks
+// as it is decoded.
+typedef struct stpk_Stream stpk_Stream;
+
+// Checkpoints recorded while decompressing a stream, for resuming near any
+// offset of the output without decoding all of it again.
+typedef struct stpk_Index stpk_Index;
+
+// Entries of a resource container, read without decoding more of the source
+// than the entries asked for.
+typedef struct stpk_Container stpk_Container;
+
+// On-disk cache of decompressed output, keyed by a hash of the source and the
+// options changing the output.
+typedef struct stpk_Cache stpk_Cache;
+
+// Bump allocator serving all buffers of a decode from one slab, which is reset
+// between files instead of freeing each buffer.
+typedef struct stpk_Arena stpk_Arena;
+
 stpk_Context stpk_init(stpk_Format format, int verbosity, stpk_LogCallback logCallback, stpk_AllocCallback allocCallback, stpk_DeallocCallback deallocCallback);
 void stpk_deinit(stpk_Context *ctx);
 
 unsigned int stpk_decompress(stpk_Context *ctx);
+// The dst buffer must hold stpk_getDecompressedSize() bytes and STPK_DST_PADDING
+// more, which decoders may overwrite past the output.
+unsigned int stpk_decompressInto(stpk_Context *ctx, unsigned char *dst, unsigned int dstLen, unsigned char *scratch, unsigned int scratchLen);
 
 stpk_FmtType stpk_getFmtType(stpk_Context *ctx);
+unsigned int stpk_getInPlaceLen(stpk_Context *ctx);
+unsigned int stpk_getDecompressedSize(stpk_Context *ctx);
+unsigned int stpk_getScratchLen(stpk_Context *ctx);
+
+stpk_Stream *stpk_stream_init(stpk_Context *ctx, unsigned int windowLen);
+void stpk_stream_deinit(stpk_Stream *stream);
+unsigned int stpk_stream_feed(stpk_Stream *stream, const unsigned char *src, unsigned int len);
+void stpk_stream_end(stpk_Stream *stream);
+unsigned int stpk_stream_read(stpk_Stream *stream, unsigned char *dst, unsigned int len, unsigned int *read);
+void stpk_stream_index(stpk_Stream *stream, stpk_Index *index);
+
+stpk_Index *stpk_index_init(stpk_Context *ctx, unsigned int interval);
+void stpk_index_deinit(stpk_Index *index);
+unsigned int stpk_index_save(const stpk_Index *index, unsigned char *dst);
+stpk_Index *stpk_index_load(stpk_Context *ctx, const unsigned char *src, unsigned int len);
+unsigned int stpk_decompressRange(stpk_Context *ctx, const stpk_Index *index, unsigned int offset, unsigned int len);
+
+stpk_Container *stpk_container_init(stpk_Context *ctx);
+void stpk_container_deinit(stpk_Container *container);
+unsigned int stpk_container_len(const stpk_Container *container);
+const stpk_Resource *stpk_container_get(const stpk_Container *container, unsigned int i);
+const stpk_Resource *stpk_container_find(const stpk_Container *container, const char *id);
+unsigned int stpk_container_read(stpk_Container *container, const stpk_Resource *resource, unsigned char *dst);
+
+stpk_Cache *stpk_cache_init(stpk_Context *ctx, const char *dir, unsigned long maxLen);
+void stpk_cache_deinit(stpk_Cache *cache);
+unsigned int stpk_cache_decompress(stpk_Cache *cache, stpk_Context *ctx);
+void stpk_cache_release(stpk_Cache *cache, stpk_Context *ctx);
+
+stpk_Arena *stpk_arena_init(stpk_Context *ctx, unsigned int len);
+void stpk_arena_deinit(stpk_Arena *arena);
+void stpk_arena_reset(stpk_Arena *arena);
+unsigned int stpk_arena_peak(const stpk_Arena *arena);
+stpk_Allocator stpk_arena_allocator(stpk_Arena *arena);
+
+unsigned int stpk_trace_format(const stpk_TraceEvent *event, char *str, unsigned int len);
+const char *stpk_trace_header(stpk_TraceType type);
+void stpk_trace_pack(const stpk_TraceEvent *events, unsigned int len, unsigned char *dst);
+void stpk_trace_unpack(const unsigned char *src, unsigned int len, stpk_TraceEvent *events);
 
 const char *stpk_fmtTypeStr(stpk_FmtType type);
 const char *stpk_fmtDsiVerStr(stpk_FmtDsiVer version);
+const char *stpk_fmtDsiMultiStr(stpk_FmtDsiMulti multi);
+const char *stpk_fmtRpckStoreStr(stpk_FmtRpckStore store);
 
 #endif
@@ -0,0 +1,643 @@
+/*
+ * stunpack - Stunts/4D [Sports] Driving game resource unpacker
+ * Copyright (C) 2008-2024 Daniel Stien <daniel@stien.org>
+ *  
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ * 
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ * 
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software 
+ * Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA 02111-1307, USA.
+ */
+
+#include <errno.h>
+#include <stdarg.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <time.h>
+
+// Files are decoded on a pool of threads where POSIX threads are available,
+// and one at a time elsewhere.
+#if defined(__WATCOMC__)
+#	include <direct.h>
+#	define BATCH_MKDIR(path) mkdir(path)
+#elif defined(_WIN32)
+#	include <direct.h>
+#	include <dirent.h>
+#	define BATCH_MKDIR(path) _mkdir(path)
+#else
+#	include <dirent.h>
+#	include <pthread.h>
+#	include <unistd.h>
+#	define BATCH_MKDIR(path) mkdir(path, 0777)
+#	define BATCH_LINKS
+#	define BATCH_THREADS
+#endif
+
+#include "batch.h"
+
+#define MSG(msg, ...) if (verbose) printf(msg, ## __VA_ARGS__)
+#define ERR(msg, ...) if (verbose) fprintf(stderr, "\n" STPK_NAME ": " msg, ## __VA_ARGS__)
+
+// Length of the first error message kept for each file.
+#define BATCH_MSG_LEN 0x100
+
+// Most threads used, whatever the number of CPUs.
+#define BATCH_THREADS_MAX 0x100
+
+// File of a batch, with the result of decompressing it.
+typedef struct {
+	char          *src;
+	char          *dst;
+	unsigned long srcLen;
+	unsigned long dstLen;
+	unsigned int  retval;
+	char          msg[BATCH_MSG_LEN];
+} batch_File;
+
+// Files left to a worker, as the range [head, tail) of the batch. The worker
+// takes files from the tail, while workers out of files steal half of the
+// range from the head.
+typedef struct {
+	unsigned int    head;
+	unsigned int    tail;
+#ifdef BATCH_THREADS
+	pthread_mutex_t lock;
+#endif
+} batch_Queue;
+
+typedef struct {
+	batch_File   *files;
+	unsigned int len;
+	unsigned int size;
+	batch_Queue  *queues;
+	unsigned int threads;
+	stpk_Format  format;
+} batch_Batch;
+
+typedef struct {
+	batch_Batch  *batch;
+	unsigned int id;
+	stpk_Cache   *cache;  // Cache of the worker, or NULL.
+} batch_Worker;
+
+static int batch_addInput(batch_Batch *batch, char *input, const char *outDir, int verbose);
+
+// Join two parts of a path. Returns NULL on allocation failure.
+static char *batch_join(const char *dir, const char *name)
+{
+	size_t len = strlen(dir);
+	char *path;
+
+	if ((path = (char*)malloc(len + strlen(name) + 2)) == NULL) {
+		return NULL;
+	}
+
+	strcpy(path, dir);
+	if (len && dir[len - 1] != '/' && dir[len - 1] != '\\') {
+		path[len++] = '/';
+	}
+	strcpy(path + len, name);
+
+	return path;
+}
+
+// Get the last part of a path, ignoring separators at the end.
+static const char *batch_baseName(char *path)
+{
+	size_t len = strlen(path);
+	char *name;
+
+	while (len > 1 && (path[len - 1] == '/' || path[len - 1] == '\\')) {
+		path[--len] = 0;
+	}
+
+	for (name = path + len; name > path && name[-1] != '/' && name[-1] != '\\'; name--);
+
+	return name;
+}
+
+// Create the directories leading up to a file, ignoring those that exist.
+// Failures show when the file is opened.
+static void batch_makeDirs(char *path)
+{
+	char *p, c;
+
+	for (p = path + 1; *p; p++) {
+		if (*p == '/' || *p == '\\') {
+			c = *p;
+			*p = 0;
+			BATCH_MKDIR(path);
+			*p = c;
+		}
+	}
+}
+
+// Add a file decompressed from src to dst, taking the paths.
+static int batch_add(batch_Batch *batch, char *src, char *dst)
+{
+	batch_File *files;
+
+	if (src == NULL || dst == NULL) {
+		free(src);
+		free(dst);
+		return 1;
+	}
+
+	if (batch->len == batch->size) {
+		batch->size = batch->size ? batch->size * 2 : 0x100;
+		if ((files = (batch_File*)realloc(batch->files, sizeof(batch_File) * batch->size)) == NULL) {
+			free(src);
+			free(dst);
+			return 1;
+		}
+		batch->files = files;
+	}
+
+	batch->files[batch->len].src = src;
+	batch->files[batch->len].dst = dst;
+	batch->files[batch->len].srcLen = batch->files[batch->len].dstLen = 0;
+	batch->files[batch->len].retval = 1;
+	batch->files[batch->len].msg[0] = 0;
+	batch->len++;
+
+	return 0;
+}
+
+// Check if a path is a symbolic link to a directory.
+static int batch_isDirLink(const char *path)
+{
+#ifdef BATCH_LINKS
+	struct stat st;
+
+	return lstat(path, &st) == 0 && S_ISLNK(st.st_mode) && stat(path, &st) == 0 && S_ISDIR(st.st_mode);
+#else
+	(void)path;
+	return 0;
+#endif
+}
+
+// Add a file, or all files below a directory, decompressed to the same path
+// under dst. Links to directories below it are skipped, as they may lead back
+// up the tree.
+static int batch_addPath(batch_Batch *batch, const char *path, const char *dst, int verbose)
+{
+	struct stat st;
+	struct dirent *entry;
+	DIR *dir;
+	char *child, *childDst;
+	int retval = 0;
+
+	if (stat(path, &st) != 0) {
+		ERR("Error reading \"%s\". (%s)\n", path, strerror(errno));
+		return 1;
+	}
+
+	if (!S_ISDIR(st.st_mode)) {
+		return batch_add(batch, batch_join("", path), batch_join("", dst));
+	}
+
+	if ((dir = opendir(path)) == NULL) {
+		ERR("Error opening directory \"%s\". (%s)\n", path, strerror(errno));
+		return 1;
+	}
+
+	while (!retval && (entry = readdir(dir)) != NULL) {
+		if (strcmp(entry->d_name, ".") == 0 || strcmp(entry->d_name, "..") == 0) {
+			continue;
+		}
+
+		child = batch_join(path, entry->d_name);
+		childDst = batch_join(dst, entry->d_name);
+		if (child != NULL && batch_isDirLink(child)) {
+			MSG("Skipping linked directory \"%s\".\n", child);
+		}
+		else {
+			retval = child == NULL || childDst == NULL || batch_addPath(batch, child, childDst, verbose);
+		}
+		free(child);
+		free(childDst);
+	}
+
+	closedir(dir);
+
+	return retval;
+}
+
+// Add the inputs listed one per line in a file.
+static int batch_addList(batch_Batch *batch, const char *fileName, const char *outDir, int verbose)
+{
+	char line[0x1000];
+	size_t len;
+	int retval = 0;
+	FILE *file;
+
+	if ((file = fopen(fileName, "r")) == NULL) {
+		ERR("Error opening list file \"%s\" for reading. (%s)\n", fileName, strerror(errno));
+		return 1;
+	}
+
+	while (!retval && fgets(line, sizeof(line), file) != NULL) {
+		len = strlen(line);
+		while (len && (line[len - 1] == '\n' || line[len - 1] == '\r')) {
+			line[--len] = 0;
+		}
+
+		if (len) {
+			retval = batch_addInput(batch, line, outDir, verbose);
+		}
+	}
+
+	fclose(file);
+
+	return retval;
+}
+
+// Add a file or directory given as input, which is decompressed to outDir
+// under its last name, or the inputs listed in a file if prefixed by '@'.
+static int batch_addInput(batch_Batch *batch, char *input, const char *outDir, int verbose)
+{
+	char *dst;
+	int retval;
+
+	if (input[0] == '@') {
+		return batch_addList(batch, input + 1, outDir, verbose);
+	}
+
+	if ((dst = batch_join(outDir, batch_baseName(input))) == NULL) {
+		return 1;
+	}
+
+	retval = batch_addPath(batch, input, dst, verbose);
+	free(dst);
+
+	return retval;
+}
+
+static int batch_compareDst(const void *a, const void *b)
+{
+	return strcmp((*(const batch_File**)a)->dst, (*(const batch_File**)b)->dst);
+}
+
+// Check that no two files of the batch are decompressed to the same path, as
+// the last one written would silently replace the others.
+static int batch_checkDuplicates(batch_Batch *batch, int verbose)
+{
+	unsigned int i;
+	int retval = 0;
+	batch_File **sorted;
+
+	if ((sorted = (batch_File**)malloc(sizeof(batch_File*) * batch->len)) == NULL) {
+		ERR("Error allocating memory for checking output paths. (%s)\n", strerror(errno));
+		return 1;
+	}
+
+	for (i = 0; i < batch->len; i++) {
+		sorted[i] = &batch->files[i];
+	}
+	qsort(sorted, batch->len, sizeof(batch_File*), batch_compareDst);
+
+	for (i = 1; i < batch->len; i++) {
+		if (strcmp(sorted[i - 1]->dst, sorted[i]->dst) == 0) {
+			ERR("Both \"%s\" and \"%s\" decompress to \"%s\".\n", sorted[i - 1]->src, sorted[i]->src, sorted[i]->dst);
+			retval = 1;
+		}
+	}
+
+	free(sorted);
+
+	return retval;
+}
+
+// Keep the first error or warning of a file as its status.
+static void batch_log(void *userData, stpk_LogType type, const char *msg, va_list args)
+{
+	batch_File *file = (batch_File*)userData;
+	size_t len;
+
+	if (type == STPK_LOG_INFO || file->msg[0]) {
+		return;
+	}
+
+	vsnprintf(file->msg, BATCH_MSG_LEN, msg, args);
+	len = strlen(file->msg);
+	while (len && file->msg[len - 1] == '\n') {
+		file->msg[--len] = 0;
+	}
+}
+
+// Print errors of the batch outside of any file.
+static void batch_print(void *userData, stpk_LogType type, const char *msg, va_list args)
+{
+	(void)userData;
+
+	if (type != STPK_LOG_INFO) {
+		fprintf(stderr, "\n" STPK_NAME ": ");
+		vfprintf(stderr, msg, args);
+	}
+}
+
+// Decompress a file of the batch, keeping the result in it.
+static void batch_decompress(batch_Batch *batch, batch_File *file, stpk_Cache *cache)
+{
+	long len;
+	FILE *srcFile, *dstFile;
+
+	stpk_Context ctx = stpk_init(batch->format, 1, NULL, malloc, free);
+	ctx.logSink = batch_log;
+	ctx.logData = file;
+
+	if ((srcFile = fopen(file->src, "rb")) == NULL) {
+		snprintf(file->msg, BATCH_MSG_LEN, "Error opening file for reading. (%s)", strerror(errno));
+		return;
+	}
+
+	if (fseek(srcFile, 0, SEEK_END) != 0 || (len = ftell(srcFile)) == -1 || fseek(srcFile, 0, SEEK_SET) != 0
+		|| (ctx.src.data = (unsigned char*)malloc(len ? len : 1)) == NULL
+		|| fread(ctx.src.data, 1, len, srcFile) != (size_t)len
+	) {
+		snprintf(file->msg, BATCH_MSG_LEN, "Error reading file. (%s)", strerror(errno));
+		fclose(srcFile);
+		stpk_deinit(&ctx);
+		return;
+	}
+
+	fclose(srcFile);
+	file->srcLen = ctx.src.len = len;
+
+	file->retval = cache != NULL ? stpk_cache_decompress(cache, &ctx) : stpk_decompress(&ctx);
+
+	if (file->retval == STPK_RET_OK) {
+		batch_makeDirs(file->dst);
+
+		if ((dstFile = fopen(file->dst, "wb")) == NULL) {
+			snprintf(file->msg, BATCH_MSG_LEN, "Error opening \"%s\" for writing. (%s)", file->dst, strerror(errno));
+			file->retval = 1;
+		}
+		else {
+			if ((fwrite(ctx.dst.data, 1, ctx.dst.len, dstFile) != ctx.dst.len) | (fclose(dstFile) != 0)) {
+				snprintf(file->msg, BATCH_MSG_LEN, "Error writing \"%s\". (%s)", file->dst, strerror(errno));
+				file->retval = 1;
+			}
+			file->dstLen = ctx.dst.len;
+		}
+	}
+	else if (file->retval == STPK_RET_ERR_UNKNOWN_FMT) {
+		snprintf(file->msg, BATCH_MSG_LEN, "Unknown compression format.");
+	}
+	else if (!file->msg[0]) {
+		snprintf(file->msg, BATCH_MSG_LEN, "Decompression failed with error code %d.", file->retval);
+	}
+
+	if (cache != NULL) {
+		stpk_cache_release(cache, &ctx);
+	}
+	stpk_deinit(&ctx);
+}
+
+// Take the next file of a queue from its tail. Returns 0 if it is empty.
+static int batch_take(batch_Queue *queue, unsigned int *index)
+{
+	int taken;
+
+#ifdef BATCH_THREADS
+	pthread_mutex_lock(&queue->lock);
+#endif
+	if ((taken = queue->head < queue->tail)) {
+		*index = --queue->tail;
+	}
+#ifdef BATCH_THREADS
+	pthread_mutex_unlock(&queue->lock);
+#endif
+
+	return taken;
+}
+
+// Move the first half of the files of another worker's queue, rounded up, to
+// an empty queue. Returns 0 if all other queues are empty.
+static int batch_steal(batch_Batch *batch, unsigned int id)
+{
+	unsigned int i, head = 0, tail = 0;
+	batch_Queue *victim;
+
+	for (i = 1; i < batch->threads && head == tail; i++) {
+		victim = &batch->queues[(id + i) % batch->threads];
+#ifdef BATCH_THREADS
+		pthread_mutex_lock(&victim->lock);
+#endif
+		head = victim->head;
+		tail = victim->head = head + (victim->tail - head + 1) / 2;
+#ifdef BATCH_THREADS
+		pthread_mutex_unlock(&victim->lock);
+#endif
+	}
+
+	if (head == tail) {
+		return 0;
+	}
+
+#ifdef BATCH_THREADS
+	pthread_mutex_lock(&batch->queues[id].lock);
+#endif
+	batch->queues[id].head = head;
+	batch->queues[id].tail = tail;
+#ifdef BATCH_THREADS
+	pthread_mutex_unlock(&batch->queues[id].lock);
+#endif
+
+	return 1;
+}
+
+// Decompress files from the worker's queue, then from the others until all
+// are done. Files are never added, so the batch is done once all queues are
+// found empty.
+static void *batch_work(void *arg)
+{
+	batch_Worker *worker = (batch_Worker*)arg;
+	batch_Batch *batch = worker->batch;
+	unsigned int index;
+
+	do {
+		while (batch_take(&batch->queues[worker->id], &index)) {
+			batch_decompress(batch, &batch->files[index], worker->cache);
+		}
+	} while (batch_steal(batch, worker->id));
+
+	return NULL;
+}
+
+static unsigned int batch_cpuCount(void)
+{
+#if defined(BATCH_THREADS) && defined(_SC_NPROCESSORS_ONLN)
+	long count = sysconf(_SC_NPROCESSORS_ONLN);
+
+	return count > 0 ? (unsigned int)count : 1;
+#else
+	return 1;
+#endif
+}
+
+// Get wall clock time in seconds, as the CPU time of clock() adds up across
+// threads.
+static double batch_now(void)
+{
+#if defined(BATCH_THREADS) && defined(CLOCK_MONOTONIC)
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+#else
+	return (double)clock() / CLOCKS_PER_SEC;
+#endif
+}
+
+// Decompress files, directories and the inputs of @list files into outDir on
+// a pool of threads, or one per CPU if 0. Directories are decompressed to the
+// same tree of files under outDir, skipping links to directories within them.
+// With cacheDir set, output is read from and stored in a cache there shared by
+// the workers, of at most cacheLen bytes if not 0. Nothing is decompressed if
+// two files share an output path. The result of each file is printed when all
+// are done, followed by the throughput.
+int batch_run(char **inputs, unsigned int len, char *outDir, stpk_Format format, unsigned int threads, char *cacheDir, unsigned long cacheLen, int verbose)
+{
+	unsigned int i, failed = 0, started = 0;
+	unsigned long srcLen = 0, dstLen = 0;
+	double start, seconds;
+	int retval = 1;
+	batch_Batch batch;
+	batch_Worker workers[BATCH_THREADS_MAX];
+#ifdef BATCH_THREADS
+	pthread_t handles[BATCH_THREADS_MAX];
+#endif
+
+	stpk_Context ctx = stpk_init(format, verbose, NULL, malloc, free);
+	ctx.logSink = batch_print;
+
+	memset(&batch, 0, sizeof(batch));
+	batch.format = format;
+
+	for (i = 0; i < len; i++) {
+		if (batch_addInput(&batch, inputs[i], outDir, verbose)) {
+			goto freeFiles;
+		}
+	}
+
+	if (!batch.len) {
+		ERR("No files to decompress.\n");
+		goto freeFiles;
+	}
+
+	if (batch_checkDuplicates(&batch, verbose)) {
+		goto freeFiles;
+	}
+
+#ifdef BATCH_THREADS
+	threads = threads ? threads : batch_cpuCount();
+#else
+	threads = 1;
+#endif
+	batch.threads = threads = threads < batch.len ? (threads < BATCH_THREADS_MAX ? threads : BATCH_THREADS_MAX) : batch.len;
+
+	if ((batch.queues = (batch_Queue*)malloc(sizeof(batch_Queue) * threads)) == NULL) {
+		ERR("Error allocating memory for work queues. (%s)\n", strerror(errno));
+		goto freeFiles;
+	}
+
+	// Deal each worker an even share of the files in order, so neighbouring
+	// files that are alike in size stay on the same worker until stolen.
+	for (i = 0; i < threads; i++) {
+		batch.queues[i].head = (unsigned int)((unsigned long long)batch.len * i / threads);
+		batch.queues[i].tail = (unsigned int)((unsigned long long)batch.len * (i + 1) / threads);
+#ifdef BATCH_THREADS
+		pthread_mutex_init(&batch.queues[i].lock, NULL);
+#endif
+		workers[i].batch = &batch;
+		workers[i].id = i;
+		workers[i].cache = NULL;
+	}
+
+	// Caches are used by one thread at a time, so each worker opens its own on
+	// the shared directory.
+	for (i = 0; i < threads && cacheDir != NULL; i++) {
+		if ((workers[i].cache = stpk_cache_init(&ctx, cacheDir, cacheLen)) == NULL) {
+			goto deinitCaches;
+		}
+	}
+
+	MSG("Decompressing %u file(s) to \"%s\" with %u thread(s)...\n", batch.len, outDir, threads);
+
+	start = batch_now();
+
+#ifdef BATCH_THREADS
+	// The first worker runs on this thread. Threads that fail to start leave
+	// their files to be stolen by the others.
+	for (started = 1; started < threads && pthread_create(&handles[started], NULL, batch_work, &workers[started]) == 0; started++);
+	batch_work(&workers[0]);
+	for (i = 1; i < started; i++) {
+		pthread_join(handles[i], NULL);
+	}
+#else
+	batch_work(&workers[0]);
+	started = 1;
+#endif
+
+	seconds = batch_now() - start;
+
+	for (i = 0; i < batch.len; i++) {
+		if (batch.files[i].retval) {
+			failed++;
+			if (verbose) {
+				fprintf(stderr, "FAIL %s: %s\n", batch.files[i].src, batch.files[i].msg);
+			}
+		}
+		else {
+			if (verbose > 1) {
+				printf("  OK %s -> %s (%lu -> %lu bytes)\n", batch.files[i].src, batch.files[i].dst, batch.files[i].srcLen, batch.files[i].dstLen);
+			}
+			srcLen += batch.files[i].srcLen;
+			dstLen += batch.files[i].dstLen;
+		}
+	}
+
+	MSG("Decompressed %u of %u file(s), %lu bytes to %lu bytes in %.3f s with %u thread(s)",
+		batch.len - failed, batch.len, srcLen, dstLen, seconds, started);
+	if (seconds > 0) {
+		MSG(", %.1f files/s, %.2f MB/s", (batch.len - failed) / seconds, dstLen / seconds / (1024 * 1024));
+	}
+	MSG("\n");
+
+	retval = failed != 0;
+
+deinitCaches:
+	for (i = 0; i < threads; i++) {
+		if (workers[i].cache != NULL) {
+			stpk_cache_deinit(workers[i].cache);
+		}
+	}
+
+#ifdef BATCH_THREADS
+	for (i = 0; i < threads; i++) {
+		pthread_mutex_destroy(&batch.queues[i].lock);
+	}
+#endif
+	free(batch.queues);
+
+freeFiles:
+	for (i = 0; i < batch.len; i++) {
+		free(batch.files[i].src);
+		free(batch.files[i].dst);
+	}
+	free(batch.files);
+
+	return retval;
+}
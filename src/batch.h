@@ -0,0 +1,27 @@
+/*
+ * stunpack - Stunts/4D [Sports] Driving game resource unpacker
+ * Copyright (C) 2008-2024 Daniel Stien <daniel@stien.org>
+ *  
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ * 
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ * 
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software 
+ * Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA 02111-1307, USA.
+ */
+
+#ifndef STPK_BATCH_H
+#define STPK_BATCH_H
+
+#include <stunpack.h>
+
+int batch_run(char **inputs, unsigned int len, char *outDir, stpk_Format format, unsigned int threads, char *cacheDir, unsigned long cacheLen, int verbose);
+
+#endif
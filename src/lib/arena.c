@@ -0,0 +1,118 @@
+/*
+ * stunpack - Stunts/4D [Sports] Driving game resource unpacker
+ * Copyright (C) 2008-2024 Daniel Stien <daniel@stien.org>
+ *  
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ * 
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ * 
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software 
+ * Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA 02111-1307, USA.
+ */
+
+#include <errno.h>
+#include <limits.h>
+#include <string.h>
+
+#include "util.h"
+
+#include "arena.h"
+
+// Take memory from the slab, or from the parent allocator once it is full.
+static void *arena_alloc(void *userData, size_t size, size_t align)
+{
+	stpk_Arena *arena = (stpk_Arena*)userData;
+	void *ptr;
+
+	if (size <= UINT_MAX && (ptr = util_bump(&arena->slab, (unsigned int)size, (unsigned int)align)) != NULL) {
+		arena->peak = UTIL_MAX(arena->peak, arena->slab.offset);
+		return ptr;
+	}
+
+	arena->parent.align = (unsigned int)align;
+
+	return util_alloc(&arena->parent, (unsigned int)size);
+}
+
+// Memory in the slab is only given back if it was the last taken, and the rest
+// when the arena is reset.
+static void arena_dealloc(void *userData, void *ptr)
+{
+	stpk_Arena *arena = (stpk_Arena*)userData;
+
+	if (!util_unbump(&arena->slab, ptr)) {
+		util_dealloc(&arena->parent, ptr);
+	}
+}
+
+// Set up an arena with a slab of len bytes from the context's allocator, which
+// also serves what does not fit in it. Set the context's allocator to
+// stpk_arena_allocator() to use it. Returns NULL on allocation failure.
+stpk_Arena *stpk_arena_init(stpk_Context *ctx, unsigned int len)
+{
+	stpk_Arena *arena;
+	stpk_Buffer empty = {
+		.data = NULL,
+		.offset = 0,
+		.len = 0
+	};
+
+	if ((arena = (stpk_Arena*)util_alloc(ctx, sizeof(stpk_Arena))) == NULL) {
+		UTIL_ERR("Error allocating memory for arena. (%s)\n", strerror(errno));
+		return NULL;
+	}
+
+	if ((arena->slab.data = (unsigned char*)util_alloc(ctx, sizeof(unsigned char) * len)) == NULL) {
+		UTIL_ERR("Error allocating memory for arena slab. (%s)\n", strerror(errno));
+		util_dealloc(ctx, arena);
+		return NULL;
+	}
+
+	arena->slab.offset = 0;
+	arena->slab.len = len;
+	arena->peak = 0;
+	arena->parent = *ctx;
+	arena->parent.src = arena->parent.dst = arena->parent.scratch = empty;
+
+	return arena;
+}
+
+void stpk_arena_deinit(stpk_Arena *arena)
+{
+	stpk_Context parent = arena->parent;
+
+	util_dealloc(&parent, arena->slab.data);
+	util_dealloc(&parent, arena);
+}
+
+// Make all of the slab available again. Nothing allocated from it may be in
+// use.
+void stpk_arena_reset(stpk_Arena *arena)
+{
+	arena->slab.offset = 0;
+}
+
+// Get the most of the slab in use at once since the arena was set up, for
+// sizing it.
+unsigned int stpk_arena_peak(const stpk_Arena *arena)
+{
+	return arena->peak;
+}
+
+stpk_Allocator stpk_arena_allocator(stpk_Arena *arena)
+{
+	stpk_Allocator allocator;
+
+	allocator.alloc = arena_alloc;
+	allocator.dealloc = arena_dealloc;
+	allocator.userData = arena;
+
+	return allocator;
+}
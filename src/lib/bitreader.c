@@ -0,0 +1,47 @@
+/*
+ * stunpack - Stunts/4D [Sports] Driving game resource unpacker
+ * Copyright (C) 2008-2024 Daniel Stien <daniel@stien.org>
+ *  
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ * 
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ * 
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software 
+ * Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA 02111-1307, USA.
+ */
+
+#include "bitreader.h"
+
+void bitreader_init(bitreader_Reader *br, const unsigned char *data, unsigned int offset, unsigned int len, int reverse)
+{
+	br->data = data;
+	br->offset = offset;
+	br->len = len;
+	br->bits = 0;
+	br->count = 0;
+	br->reverse = reverse;
+}
+
+// Refill byte by byte near the end of the data. Bytes beyond the end are read
+// as zero, since the last code may be peeked at with bits to spare.
+void bitreader_refillTail(bitreader_Reader *br)
+{
+	uint64_t byte;
+
+	while (br->count <= BITREADER_REFILL_MIN) {
+		byte = br->offset < br->len ? br->data[br->offset] : 0;
+		if (br->reverse) {
+			byte = bitreader_reverseBytes(byte);
+		}
+		br->bits |= byte << (BITREADER_REFILL_MIN - br->count);
+		br->offset++;
+		br->count += 8;
+	}
+}
@@ -0,0 +1,107 @@
+/*
+ * stunpack - Stunts/4D [Sports] Driving game resource unpacker
+ * Copyright (C) 2008-2024 Daniel Stien <daniel@stien.org>
+ *  
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ * 
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ * 
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software 
+ * Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA 02111-1307, USA.
+ */
+
+#ifndef STPK_LIB_BITREADER_H
+#define STPK_LIB_BITREADER_H
+
+#include <stdint.h>
+
+// Minimum number of bits buffered after a refill.
+#define BITREADER_REFILL_MIN 56
+
+typedef struct {
+	const unsigned char *data;
+	unsigned int offset;  // Next byte to load into the reservoir.
+	unsigned int len;
+	uint64_t     bits;    // Buffered bits, next bit in the stream is the MSB.
+	unsigned int count;   // Number of buffered bits.
+	int          reverse; // Reverse bit order of each byte.
+} bitreader_Reader;
+
+void bitreader_init(bitreader_Reader *br, const unsigned char *data, unsigned int offset, unsigned int len, int reverse);
+void bitreader_refillTail(bitreader_Reader *br);
+
+// Reverse the bit order of each byte in a 64-bit word.
+static inline uint64_t bitreader_reverseBytes(uint64_t word)
+{
+	word = ((word >> 1) & 0x5555555555555555ULL) | ((word & 0x5555555555555555ULL) << 1);
+	word = ((word >> 2) & 0x3333333333333333ULL) | ((word & 0x3333333333333333ULL) << 2);
+	word = ((word >> 4) & 0x0F0F0F0F0F0F0F0FULL) | ((word & 0x0F0F0F0F0F0F0F0FULL) << 4);
+	return word;
+}
+
+// Load 64 bits in big-endian byte order.
+static inline uint64_t bitreader_load(const unsigned char *data)
+{
+	return (uint64_t)data[0] << 56 | (uint64_t)data[1] << 48 | (uint64_t)data[2] << 40 | (uint64_t)data[3] << 32
+		| (uint64_t)data[4] << 24 | (uint64_t)data[5] << 16 | (uint64_t)data[6] << 8 | (uint64_t)data[7];
+}
+
+// Fill the reservoir with whole bytes until at least 56 bits are buffered.
+// Bits of a partially fitting byte are also loaded, but the byte is loaded
+// again by the next refill to the same bit positions, which is harmless.
+// At least 8 bytes must be left in the data. Decoders specialized for one bit
+// order pass it as a constant.
+static inline void bitreader_refillFast(bitreader_Reader *br, int reverse)
+{
+	uint64_t word = bitreader_load(br->data + br->offset);
+
+	if (reverse) {
+		word = bitreader_reverseBytes(word);
+	}
+	br->bits |= word >> br->count;
+	br->offset += (63 - br->count) >> 3;
+	br->count |= BITREADER_REFILL_MIN;
+}
+
+static inline void bitreader_refillOrder(bitreader_Reader *br, int reverse)
+{
+	if (br->offset + 8 <= br->len) {
+		bitreader_refillFast(br, reverse);
+	}
+	else {
+		bitreader_refillTail(br);
+	}
+}
+
+static inline void bitreader_refill(bitreader_Reader *br)
+{
+	bitreader_refillOrder(br, br->reverse);
+}
+
+// Get the next n bits (1-32) without consuming them.
+static inline unsigned int bitreader_peek(const bitreader_Reader *br, unsigned int n)
+{
+	return (unsigned int)(br->bits >> (64 - n));
+}
+
+// Consume n buffered bits.
+static inline void bitreader_consume(bitreader_Reader *br, unsigned int n)
+{
+	br->bits <<= n;
+	br->count -= n;
+}
+
+// Number of bits consumed from the start of the data.
+static inline unsigned int bitreader_tell(const bitreader_Reader *br)
+{
+	return br->offset * 8 - br->count;
+}
+
+#endif
@@ -0,0 +1,531 @@
+/*
+ * stunpack - Stunts/4D [Sports] Driving game resource unpacker
+ * Copyright (C) 2008-2024 Daniel Stien <daniel@stien.org>
+ *  
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ * 
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ * 
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software 
+ * Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA 02111-1307, USA.
+ */
+
+#include <errno.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <time.h>
+
+// Entries are mapped into memory where POSIX mmap() is available, and read
+// into an allocated buffer elsewhere.
+#if defined(__WATCOMC__)
+#	include <direct.h>
+#	include <process.h>
+#	include <sys/utime.h>
+#	define CACHE_MKDIR(path) mkdir(path)
+#	define CACHE_PID() getpid()
+#elif defined(_WIN32)
+#	include <direct.h>
+#	include <dirent.h>
+#	include <process.h>
+#	include <sys/utime.h>
+#	define CACHE_MKDIR(path) _mkdir(path)
+#	define CACHE_PID() _getpid()
+#else
+#	include <dirent.h>
+#	include <fcntl.h>
+#	include <sys/mman.h>
+#	include <unistd.h>
+#	include <utime.h>
+#	define CACHE_MKDIR(path) mkdir(path, 0777)
+#	define CACHE_PID() getpid()
+#	define CACHE_MAP
+#endif
+
+#include "util.h"
+
+#include "cache.h"
+
+#define CACHE_P1 0x9E3779B185EBCA87ULL
+#define CACHE_P2 0xC2B2AE3D27D4EB4FULL
+#define CACHE_P3 0x165667B19E3779F9ULL
+#define CACHE_P4 0x85EBCA77C2B2AE63ULL
+#define CACHE_P5 0x27D4EB2F165667C5ULL
+
+// File of the cache directory considered for eviction.
+typedef struct {
+	time_t        time;
+	unsigned long len;
+	char          name[CACHE_NAME_MAX];
+} cache_File;
+
+static void cache_put32(unsigned char *dst, uint32_t val)
+{
+	dst[0] = val & 0xFF;
+	dst[1] = (val >> 8) & 0xFF;
+	dst[2] = (val >> 16) & 0xFF;
+	dst[3] = (val >> 24) & 0xFF;
+}
+
+static uint32_t cache_get32(const unsigned char *src)
+{
+	return src[0] | src[1] << 8 | src[2] << 16 | (uint32_t)src[3] << 24;
+}
+
+static uint64_t cache_get64(const unsigned char *src)
+{
+	return cache_get32(src) | (uint64_t)cache_get32(src + 4) << 32;
+}
+
+static uint64_t cache_rotl(uint64_t val, unsigned int n)
+{
+	return (val << n) | (val >> (64 - n));
+}
+
+static uint64_t cache_round(uint64_t acc, uint64_t val)
+{
+	return cache_rotl(acc + val * CACHE_P2, 31) * CACHE_P1;
+}
+
+static uint64_t cache_merge(uint64_t acc, uint64_t val)
+{
+	return (acc ^ cache_round(0, val)) * CACHE_P1 + CACHE_P4;
+}
+
+// Hash data with XXH64, which runs four independent lanes over 32 bytes at a
+// time to hash at close to the speed memory is read.
+static uint64_t cache_hash(const unsigned char *data, unsigned int len, uint64_t seed)
+{
+	const unsigned char *end = data + len;
+	uint64_t v1, v2, v3, v4, hash;
+
+	if (len >= 32) {
+		v1 = seed + CACHE_P1 + CACHE_P2;
+		v2 = seed + CACHE_P2;
+		v3 = seed;
+		v4 = seed - CACHE_P1;
+
+		for (; end - data >= 32; data += 32) {
+			v1 = cache_round(v1, cache_get64(data));
+			v2 = cache_round(v2, cache_get64(data + 8));
+			v3 = cache_round(v3, cache_get64(data + 16));
+			v4 = cache_round(v4, cache_get64(data + 24));
+		}
+
+		hash = cache_rotl(v1, 1) + cache_rotl(v2, 7) + cache_rotl(v3, 12) + cache_rotl(v4, 18);
+		hash = cache_merge(hash, v1);
+		hash = cache_merge(hash, v2);
+		hash = cache_merge(hash, v3);
+		hash = cache_merge(hash, v4);
+	}
+	else {
+		hash = seed + CACHE_P5;
+	}
+
+	hash += len;
+
+	for (; end - data >= 8; data += 8) {
+		hash = cache_rotl(hash ^ cache_round(0, cache_get64(data)), 27) * CACHE_P1 + CACHE_P4;
+	}
+	if (end - data >= 4) {
+		hash = cache_rotl(hash ^ cache_get32(data) * CACHE_P1, 23) * CACHE_P2 + CACHE_P3;
+		data += 4;
+	}
+	for (; data < end; data++) {
+		hash = cache_rotl(hash ^ *data * CACHE_P5, 11) * CACHE_P1;
+	}
+
+	hash ^= hash >> 33;
+	hash *= CACHE_P2;
+	hash ^= hash >> 29;
+	hash *= CACHE_P3;
+	hash ^= hash >> 32;
+
+	return hash;
+}
+
+// Fill in the header of the entry for the source of a context, which is the
+// key of the entry except for the detected DSI version at offset 7 and the
+// output length in the last 4 bytes. Options not changing the output are left
+// out.
+static void cache_header(const stpk_Context *ctx, unsigned char *header)
+{
+	const unsigned char *src = ctx->src.data + ctx->src.offset;
+	unsigned int srcLen = ctx->src.len - ctx->src.offset;
+	uint64_t hash = cache_hash(src, srcLen, 0);
+	int dsi = ctx->format.type == STPK_FMT_DSI;
+
+	memset(header, 0, CACHE_HEADER_LEN);
+	memcpy(header, CACHE_MAGIC, 4);
+	header[4] = CACHE_VERSION;
+	header[5] = ctx->format.type;
+	header[6] = dsi ? ctx->format.dsi.version : 0;
+	cache_put32(header + 8, dsi ? ctx->format.dsi.maxPasses : 0);
+	cache_put32(header + 12, ctx->limit);
+	cache_put32(header + 16, srcLen);
+	cache_put32(header + 20, hash & 0xFFFFFFFF);
+	cache_put32(header + 24, hash >> 32);
+}
+
+// Check that an entry is the one for the header of a source, apart from the
+// detected DSI version, and get its output length.
+static int cache_match(const unsigned char *entry, const unsigned char *header, unsigned long len, unsigned int *dstLen)
+{
+	if (len < CACHE_HEADER_LEN || memcmp(entry, header, 7) != 0 || memcmp(entry + 8, header + 8, CACHE_HEADER_LEN - 12) != 0) {
+		return 0;
+	}
+
+	*dstLen = cache_get32(entry + CACHE_HEADER_LEN - 4);
+
+	return len - CACHE_HEADER_LEN == *dstLen;
+}
+
+// Open a cache of decompressed files in a directory, which is created if
+// missing, keeping up to maxLen bytes of entries, or any number if 0. Entries
+// are written whole under a temporary name before being renamed, and entries
+// mapped stay readable when evicted, so the directory can be shared by any
+// number of processes. A cache is used by one thread at a time, and the context
+// must outlive it. Returns NULL on failure.
+stpk_Cache *stpk_cache_init(stpk_Context *ctx, const char *dir, unsigned long maxLen)
+{
+	stpk_Cache *cache;
+	struct stat st;
+	unsigned int dirLen = strlen(dir), pathLen = dirLen + 1 + CACHE_NAME_MAX;
+
+	if (stat(dir, &st) != 0 && (CACHE_MKDIR(dir) != 0 || stat(dir, &st) != 0)) {
+		UTIL_ERR("Error creating cache directory \"%s\". (%s)\n", dir, strerror(errno));
+		return NULL;
+	}
+
+	if (!S_ISDIR(st.st_mode)) {
+		UTIL_ERR("Cache path \"%s\" is not a directory\n", dir);
+		return NULL;
+	}
+
+	if ((cache = (stpk_Cache*)util_alloc(ctx, sizeof(stpk_Cache))) == NULL) {
+		UTIL_ERR("Error allocating memory for cache. (%s)\n", strerror(errno));
+		return NULL;
+	}
+
+	if ((cache->path = (char*)util_alloc(ctx, sizeof(char) * pathLen * 2)) == NULL) {
+		UTIL_ERR("Error allocating memory for cache. (%s)\n", strerror(errno));
+		util_dealloc(ctx, cache);
+		return NULL;
+	}
+
+	cache->ctx = ctx;
+	cache->tmp = cache->path + pathLen;
+	memcpy(cache->path, dir, dirLen);
+	cache->path[dirLen] = '/';
+	cache->path[dirLen + 1] = '\0';
+	strcpy(cache->tmp, cache->path);
+	cache->dirLen = dirLen + 1;
+	cache->maxLen = maxLen;
+	cache->written = 0;
+	cache->map = NULL;
+	cache->mapLen = 0;
+
+	return cache;
+}
+
+void stpk_cache_deinit(stpk_Cache *cache)
+{
+	stpk_Context *ctx = cache->ctx;
+
+#ifdef CACHE_MAP
+	if (cache->map != NULL) {
+		munmap(cache->map, cache->mapLen);
+	}
+#endif
+
+	util_dealloc(ctx, cache->path);
+	util_dealloc(ctx, cache);
+}
+
+// Set the path of the cache to the entry for a header, named after the hash of
+// the whole key.
+static void cache_name(stpk_Cache *cache, const unsigned char *header)
+{
+	uint64_t key = cache_hash(header, CACHE_HEADER_LEN - 4, 0);
+
+	sprintf(cache->path + cache->dirLen, "%08lx%08lx" CACHE_SUFFIX, (unsigned long)(key >> 32), (unsigned long)(key & 0xFFFFFFFF));
+}
+
+// Read the output of the entry at the cache's path into the context if it is
+// the one for header. Returns 1 on a hit, 0 if there is no entry or -1 if the
+// entry is for another key or cut short.
+static int cache_load(stpk_Cache *cache, stpk_Context *ctx, const unsigned char *header)
+{
+	unsigned int dstLen;
+	unsigned char detected;
+#ifdef CACHE_MAP
+	struct stat st;
+	unsigned char *map;
+	int fd;
+
+	if ((fd = open(cache->path, O_RDONLY)) == -1) {
+		return 0;
+	}
+
+	if (fstat(fd, &st) != 0 || st.st_size < CACHE_HEADER_LEN
+		|| (map = (unsigned char*)mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0)) == MAP_FAILED
+	) {
+		close(fd);
+		return -1;
+	}
+
+	close(fd);
+
+	if (!cache_match(map, header, st.st_size, &dstLen)) {
+		munmap(map, st.st_size);
+		return -1;
+	}
+
+	cache->map = map;
+	cache->mapLen = st.st_size;
+	ctx->dst.data = map + CACHE_HEADER_LEN;
+	detected = map[7];
+#else
+	unsigned char entry[CACHE_HEADER_LEN];
+	long len;
+	FILE *file;
+
+	if ((file = fopen(cache->path, "rb")) == NULL) {
+		return 0;
+	}
+
+	if (fseek(file, 0, SEEK_END) != 0 || (len = ftell(file)) == -1 || fseek(file, 0, SEEK_SET) != 0
+		|| fread(entry, 1, CACHE_HEADER_LEN, file) != CACHE_HEADER_LEN || !cache_match(entry, header, len, &dstLen)
+	) {
+		fclose(file);
+		return -1;
+	}
+
+	if ((ctx->dst.data = (unsigned char*)util_alloc(ctx, sizeof(unsigned char) * (dstLen + UTIL_DST_PADDING))) == NULL) {
+		fclose(file);
+		return 0;
+	}
+
+	if (fread(ctx->dst.data, 1, dstLen, file) != dstLen) {
+		util_dealloc(ctx, ctx->dst.data);
+		ctx->dst.data = NULL;
+		fclose(file);
+		return -1;
+	}
+
+	fclose(file);
+	detected = entry[7];
+#endif
+
+	ctx->dst.offset = 0;
+	ctx->dst.len = dstLen;
+	if (ctx->format.type == STPK_FMT_DSI) {
+		ctx->format.dsi.detected = (stpk_FmtDsiVer)detected;
+	}
+
+	// Mark the entry as recently used for eviction.
+	utime(cache->path, NULL);
+
+	return 1;
+}
+
+// Write the output of the context to the entry at the cache's path, under a
+// name of its own until complete. Returns 0 on success.
+static int cache_store(stpk_Cache *cache, stpk_Context *ctx, unsigned char *header)
+{
+	FILE *file;
+	int failed;
+
+	if (ctx->format.type == STPK_FMT_DSI) {
+		header[7] = ctx->format.dsi.detected;
+	}
+	cache_put32(header + CACHE_HEADER_LEN - 4, ctx->dst.len);
+
+	// Name the file written after the entry, the process and the cache.
+	sprintf(cache->tmp + cache->dirLen, "%.16s.%lu.%lx.%u" CACHE_TMP_SUFFIX, cache->path + cache->dirLen,
+		(unsigned long)CACHE_PID(), (unsigned long)((uintptr_t)cache & 0xFFFFFFFF), cache->written++);
+
+	if ((file = fopen(cache->tmp, "wb")) == NULL) {
+		UTIL_WARN("Error opening cache entry \"%s\" for writing. (%s)\n", cache->tmp, strerror(errno));
+		return 1;
+	}
+
+	failed = fwrite(header, 1, CACHE_HEADER_LEN, file) != CACHE_HEADER_LEN;
+	failed |= fwrite(ctx->dst.data, 1, ctx->dst.len, file) != ctx->dst.len;
+	failed |= fclose(file) != 0;
+
+	if (failed) {
+		UTIL_WARN("Error writing cache entry \"%s\". (%s)\n", cache->tmp, strerror(errno));
+		remove(cache->tmp);
+		return 1;
+	}
+
+	// Another process may have stored the same entry first, which is replaced
+	// on POSIX and kept elsewhere, where renaming onto it fails.
+	if (rename(cache->tmp, cache->path) != 0) {
+		remove(cache->tmp);
+	}
+
+	return 0;
+}
+
+static int cache_compare(const void *a, const void *b)
+{
+	const cache_File *x = (const cache_File*)a, *y = (const cache_File*)b;
+
+	return (x->time > y->time) - (x->time < y->time);
+}
+
+// Remove the least recently used entries until the rest fit in the cache's
+// maximum length, along with files left behind by writers that died. Entries
+// are removed by name, so processes evicting at once at worst remove a few
+// more than needed.
+static void cache_evict(stpk_Cache *cache)
+{
+	stpk_Context *ctx = cache->ctx;
+	DIR *dir;
+	struct dirent *ent;
+	struct stat st;
+	cache_File *files = NULL, *newFiles;
+	unsigned int len = 0, size = 0, nameLen, i;
+	unsigned long total = 0;
+	time_t now = time(NULL);
+
+	cache->tmp[cache->dirLen - 1] = '\0';
+	dir = opendir(cache->tmp);
+	cache->tmp[cache->dirLen - 1] = '/';
+
+	if (dir == NULL) {
+		return;
+	}
+
+	while ((ent = readdir(dir)) != NULL) {
+		nameLen = strlen(ent->d_name);
+		if (nameLen >= CACHE_NAME_MAX) {
+			continue;
+		}
+
+		strcpy(cache->tmp + cache->dirLen, ent->d_name);
+		if (stat(cache->tmp, &st) != 0 || !S_ISREG(st.st_mode)) {
+			continue;
+		}
+
+		if (nameLen > strlen(CACHE_TMP_SUFFIX) && strcmp(ent->d_name + nameLen - strlen(CACHE_TMP_SUFFIX), CACHE_TMP_SUFFIX) == 0) {
+			if (now - st.st_mtime > CACHE_TMP_STALE) {
+				UTIL_VERBOSE1("Removing stale cache file \"%s\"\n", cache->tmp);
+				remove(cache->tmp);
+			}
+			continue;
+		}
+
+		if (nameLen <= strlen(CACHE_SUFFIX) || strcmp(ent->d_name + nameLen - strlen(CACHE_SUFFIX), CACHE_SUFFIX) != 0) {
+			continue;
+		}
+
+		if (len == size) {
+			size = size ? size * 2 : 0x40;
+			if ((newFiles = (cache_File*)util_alloc(ctx, sizeof(cache_File) * size)) == NULL) {
+				UTIL_WARN("Error allocating memory for cache eviction. (%s)\n", strerror(errno));
+				goto closeDir;
+			}
+			if (len) {
+				memcpy(newFiles, files, sizeof(cache_File) * len);
+				util_dealloc(ctx, files);
+			}
+			files = newFiles;
+		}
+
+		files[len].time = st.st_mtime;
+		files[len].len = st.st_size;
+		strcpy(files[len].name, ent->d_name);
+		total += st.st_size;
+		len++;
+	}
+
+	if (total > cache->maxLen) {
+		qsort(files, len, sizeof(cache_File), cache_compare);
+
+		for (i = 0; i < len && total > cache->maxLen; i++) {
+			strcpy(cache->tmp + cache->dirLen, files[i].name);
+			UTIL_VERBOSE1("Evicting cache entry \"%s\", %lu bytes\n", cache->tmp, files[i].len);
+			remove(cache->tmp);
+			total -= files[i].len;
+		}
+	}
+
+closeDir:
+	closedir(dir);
+	if (files != NULL) {
+		util_dealloc(ctx, files);
+	}
+}
+
+// Decompress like stpk_decompress(), unless the cache holds the output for the
+// source and options of the context, which is then read from the cache instead.
+// The output is stored in the cache after decompressing. Where files can be
+// mapped into memory, the output of a hit is the mapped entry, which the
+// context does not own, so stpk_cache_release() must be called before the
+// context is deinitialized or decompresses again.
+unsigned int stpk_cache_decompress(stpk_Cache *cache, stpk_Context *ctx)
+{
+	unsigned char header[CACHE_HEADER_LEN];
+	unsigned int retval;
+	int found;
+
+	stpk_cache_release(cache, ctx);
+
+	cache_header(ctx, header);
+	cache_name(cache, header);
+
+	if ((found = cache_load(cache, ctx, header)) > 0) {
+		UTIL_MSG("Cache hit \"%s\", %d bytes\n", cache->path, ctx->dst.len);
+		return STPK_RET_OK;
+	}
+
+	// Entries of another key under the same name, or cut short by running out
+	// of space, are replaced.
+	if (found < 0) {
+		UTIL_VERBOSE1("Removing mismatched cache entry \"%s\"\n", cache->path);
+		remove(cache->path);
+	}
+
+	if ((retval = stpk_decompress(ctx)) == STPK_RET_OK && !cache_store(cache, ctx, header) && cache->maxLen) {
+		cache_evict(cache);
+	}
+
+	return retval;
+}
+
+// Give back the output of a cache hit mapped into the context by the last call
+// to stpk_cache_decompress(), clearing the context's destination. Does nothing
+// otherwise.
+void stpk_cache_release(stpk_Cache *cache, stpk_Context *ctx)
+{
+#ifdef CACHE_MAP
+	if (cache->map == NULL) {
+		return;
+	}
+
+	if (ctx->dst.data == cache->map + CACHE_HEADER_LEN) {
+		ctx->dst.data = NULL;
+		ctx->dst.offset = 0;
+		ctx->dst.len = 0;
+	}
+
+	munmap(cache->map, cache->mapLen);
+	cache->map = NULL;
+	cache->mapLen = 0;
+#else
+	(void)cache;
+	(void)ctx;
+#endif
+}
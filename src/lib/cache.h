@@ -0,0 +1,54 @@
+/*
+ * stunpack - Stunts/4D [Sports] Driving game resource unpacker
+ * Copyright (C) 2008-2024 Daniel Stien <daniel@stien.org>
+ *  
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ * 
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ * 
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software 
+ * Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA 02111-1307, USA.
+ */
+
+#ifndef STPK_LIB_CACHE_H
+#define STPK_LIB_CACHE_H
+
+#include <stddef.h>
+#include <stunpack.h>
+
+#define CACHE_MAGIC   "STPC"
+#define CACHE_VERSION 1
+
+// Length of the header in front of the output of each entry.
+#define CACHE_HEADER_LEN 32
+
+// File name extension of entries, and of entries being written.
+#define CACHE_SUFFIX     ".stc"
+#define CACHE_TMP_SUFFIX ".tmp"
+
+// Longest file name of an entry or of one being written.
+#define CACHE_NAME_MAX 0x40
+
+// Entries being written for longer than this many seconds were left by a
+// process that died, and are removed on eviction.
+#define CACHE_TMP_STALE 3600
+
+struct stpk_Cache {
+	stpk_Context  *ctx;
+	char          *path;     // Entry in the directory, set by cache_name().
+	char          *tmp;      // File an entry is written to before renaming it.
+	unsigned int  dirLen;    // Length of the directory and separator at the start of both.
+	unsigned long maxLen;    // Total length of the entries kept, or 0 for no limit.
+	unsigned int  written;   // Entries written, to name those being written apart.
+	unsigned char *map;      // Entry mapped for the last hit, or NULL.
+	size_t        mapLen;
+};
+
+#endif
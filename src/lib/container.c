@@ -0,0 +1,254 @@
+/*
+ * stunpack - Stunts/4D [Sports] Driving game resource unpacker
+ * Copyright (C) 2008-2024 Daniel Stien <daniel@stien.org>
+ *  
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ * 
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ * 
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software 
+ * Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA 02111-1307, USA.
+ */
+
+#include <errno.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "util.h"
+
+#include "container.h"
+
+static uint32_t container_get32(const unsigned char *src)
+{
+	return src[0] | src[1] << 8 | src[2] << 16 | (uint32_t)src[3] << 24;
+}
+
+static int container_compare(const void *a, const void *b)
+{
+	uint32_t x = *(const uint32_t*)a, y = *(const uint32_t*)b;
+
+	return (x > y) - (x < y);
+}
+
+// Start decoding the source from the beginning again.
+static int container_rewind(stpk_Container *container)
+{
+	stpk_Context *ctx = container->ctx;
+
+	if (container->stream != NULL) {
+		UTIL_VERBOSE1("Rewinding container from output offset %d\n", container->pos);
+		stpk_stream_deinit(container->stream);
+	}
+
+	container->fed = container->pos = 0;
+
+	return (container->stream = stpk_stream_init(ctx, 0)) == NULL;
+}
+
+// Read the next len bytes of output into dst, or skip them if dst is NULL,
+// decoding only as much of the source as needed.
+static unsigned int container_next(stpk_Container *container, unsigned char *dst, unsigned int len)
+{
+	stpk_Context *ctx = container->ctx;
+	const unsigned char *src = ctx->src.data + ctx->src.offset;
+	unsigned char skip[CONTAINER_SKIP_LEN];
+	unsigned int srcLen = ctx->src.len - ctx->src.offset, read, retval;
+
+	while (len) {
+		if (dst == NULL) {
+			retval = stpk_stream_read(container->stream, skip, UTIL_MIN(CONTAINER_SKIP_LEN, len), &read);
+		}
+		else {
+			retval = stpk_stream_read(container->stream, dst, len, &read);
+			dst += read;
+		}
+		container->pos += read;
+		len -= read;
+
+		if (retval == STPK_RET_NEED_INPUT) {
+			container->fed += stpk_stream_feed(container->stream, src + container->fed, srcLen - container->fed);
+			if (container->fed == srcLen) {
+				stpk_stream_end(container->stream);
+			}
+		}
+		else if (retval == STPK_RET_OK && len) {
+			UTIL_ERR("Unexpected end of output at offset %d, expected %d more byte(s)\n", container->pos, len);
+			return STPK_RET_ERR;
+		}
+		else if (retval != STPK_RET_OK && retval != STPK_RET_MORE_OUTPUT) {
+			return retval;
+		}
+	}
+
+	return STPK_RET_OK;
+}
+
+// Decode the header of the resource container the source unpacks to:
+//
+//   unpacked length (32-bit), number of entries (16-bit), 4-character ID of
+//   each entry, then the offset (32-bit) of each entry counted from the end of
+//   the IDs and offsets, all little endian
+//
+// The length of each entry runs up to the next offset or the end of the file.
+// Returns NULL if the output is not a container, or on allocation failure.
+stpk_Container *stpk_container_init(stpk_Context *ctx)
+{
+	stpk_Container *container;
+	stpk_Resource *resource;
+	unsigned char header[CONTAINER_HEADER_LEN], *table = NULL;
+	uint32_t *offsets = NULL, fileLen, dataLen, next;
+	unsigned int tableLen, decompressedLen, lo, hi, mid, i;
+
+	if ((container = (stpk_Container*)util_alloc(ctx, sizeof(stpk_Container))) == NULL) {
+		UTIL_ERR("Error allocating memory for container. (%s)\n", strerror(errno));
+		return NULL;
+	}
+
+	container->ctx = ctx;
+	container->stream = NULL;
+	container->len = 0;
+	container->resources = NULL;
+
+	if (container_rewind(container) || container_next(container, header, CONTAINER_HEADER_LEN) != STPK_RET_OK) {
+		goto deinitContainer;
+	}
+
+	fileLen = container_get32(header);
+	container->len = header[4] | header[5] << 8;
+	tableLen = container->len * CONTAINER_ENTRY_LEN;
+	decompressedLen = stpk_getDecompressedSize(ctx);
+
+	if (!container->len || fileLen < CONTAINER_HEADER_LEN + tableLen || (decompressedLen && fileLen != decompressedLen)) {
+		UTIL_ERR("Not a resource container. Got %d entries in %d bytes, expected %d bytes\n", container->len, fileLen, decompressedLen);
+		goto deinitContainer;
+	}
+
+	dataLen = fileLen - CONTAINER_HEADER_LEN - tableLen;
+
+	if ((table = (unsigned char*)util_alloc(ctx, sizeof(unsigned char) * tableLen)) == NULL
+		|| (offsets = (uint32_t*)util_alloc(ctx, sizeof(uint32_t) * container->len)) == NULL
+		|| (container->resources = (stpk_Resource*)util_alloc(ctx, sizeof(stpk_Resource) * container->len)) == NULL
+	) {
+		UTIL_ERR("Error allocating memory for container entries. (%s)\n", strerror(errno));
+		goto deinitContainer;
+	}
+
+	if (container_next(container, table, tableLen) != STPK_RET_OK) {
+		goto deinitContainer;
+	}
+
+	for (i = 0; i < container->len; i++) {
+		offsets[i] = container_get32(table + container->len * CONTAINER_ID_LEN + i * 4);
+
+		if (offsets[i] > dataLen) {
+			UTIL_ERR("Not a resource container. Entry %d/%d at offset %d is past the end of the data at %d\n", i + 1, container->len, offsets[i], dataLen);
+			goto deinitContainer;
+		}
+	}
+
+	qsort(offsets, container->len, sizeof(uint32_t), container_compare);
+
+	for (i = 0; i < container->len; i++) {
+		resource = &container->resources[i];
+		memcpy(resource->id, table + i * CONTAINER_ID_LEN, CONTAINER_ID_LEN);
+		resource->id[CONTAINER_ID_LEN] = '\0';
+		next = container_get32(table + container->len * CONTAINER_ID_LEN + i * 4);
+		resource->offset = CONTAINER_HEADER_LEN + tableLen + next;
+
+		// Find the first offset past the entry's.
+		for (lo = 0, hi = container->len; lo < hi;) {
+			mid = lo + (hi - lo) / 2;
+			if (offsets[mid] <= next) {
+				lo = mid + 1;
+			}
+			else {
+				hi = mid;
+			}
+		}
+		resource->len = (lo < container->len ? offsets[lo] : dataLen) - next;
+
+		UTIL_VERBOSE1("Entry %d/%d \"%s\" at offset %d, %d bytes\n", i + 1, container->len, resource->id, resource->offset, resource->len);
+	}
+
+	util_dealloc(ctx, offsets);
+	util_dealloc(ctx, table);
+
+	return container;
+
+deinitContainer:
+	if (offsets != NULL) {
+		util_dealloc(ctx, offsets);
+	}
+	if (table != NULL) {
+		util_dealloc(ctx, table);
+	}
+	stpk_container_deinit(container);
+	return NULL;
+}
+
+void stpk_container_deinit(stpk_Container *container)
+{
+	stpk_Context *ctx = container->ctx;
+
+	if (container->stream != NULL) {
+		stpk_stream_deinit(container->stream);
+	}
+	if (container->resources != NULL) {
+		util_dealloc(ctx, container->resources);
+	}
+
+	util_dealloc(ctx, container);
+}
+
+// Get the number of entries.
+unsigned int stpk_container_len(const stpk_Container *container)
+{
+	return container->len;
+}
+
+// Get entry i, in the order of the container's table.
+const stpk_Resource *stpk_container_get(const stpk_Container *container, unsigned int i)
+{
+	return i < container->len ? &container->resources[i] : NULL;
+}
+
+// Get the first entry with an ID matching id, or NULL if there is none.
+const stpk_Resource *stpk_container_find(const stpk_Container *container, const char *id)
+{
+	unsigned int i;
+
+	for (i = 0; i < container->len; i++) {
+		if (strncmp(container->resources[i].id, id, CONTAINER_ID_LEN + 1) == 0) {
+			return &container->resources[i];
+		}
+	}
+
+	return NULL;
+}
+
+// Read the data of an entry into dst, which holds resource->len bytes. The
+// source is decoded up to the end of the entry and no further, continuing from
+// the last entry read if it ended before this one, so reading the entries
+// wanted by ascending offset decodes the source once.
+unsigned int stpk_container_read(stpk_Container *container, const stpk_Resource *resource, unsigned char *dst)
+{
+	unsigned int retval;
+
+	if (resource->offset < container->pos && container_rewind(container)) {
+		return STPK_RET_ERR;
+	}
+
+	if ((retval = container_next(container, NULL, resource->offset - container->pos)) != STPK_RET_OK) {
+		return retval;
+	}
+
+	return container_next(container, dst, resource->len);
+}
@@ -0,0 +1,47 @@
+/*
+ * stunpack - Stunts/4D [Sports] Driving game resource unpacker
+ * Copyright (C) 2008-2024 Daniel Stien <daniel@stien.org>
+ *  
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ * 
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ * 
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software 
+ * Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA 02111-1307, USA.
+ */
+
+#ifndef STPK_LIB_CONTAINER_H
+#define STPK_LIB_CONTAINER_H
+
+#include <stunpack.h>
+
+// Length of the container header before the table of entries: the unpacked
+// length (32-bit) and the number of entries (16-bit).
+#define CONTAINER_HEADER_LEN 6
+
+// Length of each entry in the table, an ID and an offset (32-bit) counted from
+// the end of the table.
+#define CONTAINER_ENTRY_LEN 8
+
+#define CONTAINER_ID_LEN 4
+
+// Output decoded before an entry is read through a buffer of this many bytes.
+#define CONTAINER_SKIP_LEN 0x1000
+
+struct stpk_Container {
+	stpk_Context  *ctx;
+	stpk_Stream   *stream;
+	unsigned int  fed;        // Source bytes fed to the stream.
+	unsigned int  pos;        // Output bytes read from the stream.
+	unsigned int  len;        // Number of entries.
+	stpk_Resource *resources;
+};
+
+#endif
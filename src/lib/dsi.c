@@ -17,8 +17,12 @@
  * Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA 02111-1307, USA.
  */
 
+#include <errno.h>
+#include <string.h>
+
 #include "dsi_huff.h"
 #include "dsi_rle.h"
+#include "trace.h"
 #include "util.h"
 
 #include "dsi.h"
@@ -63,11 +67,439 @@ int dsi_isValid(stpk_Context *ctx)
 	}
 }
 
-// Decompress sub-files in source buffer.
-unsigned int dsi_decompress(stpk_Context *ctx)
+// Decode the first len bytes, up to DSI_PROBE_LEN, of a Huffman pass with the
+// given bit stream format and rank how plausible the result is. The probe
+// decodes quietly into a buffer of its own.
+int dsi_probeHuff(stpk_Context *ctx, stpk_FmtDsiVer version, int lastPass, unsigned int len)
+{
+	unsigned int retval;
+	unsigned char data[DSI_PROBE_LEN + UTIL_DST_PADDING];
+	stpk_Context probe = *ctx;
+
+	probe.verbosity = 0;
+	probe.trace = NULL;
+	probe.limit = 0;
+	probe.format.dsi.version = version;
+	probe.format.dsi.multi = STPK_FMT_DSI_MULTI_OFF;
+	probe.dst.data = data;
+	probe.dst.offset = 0;
+	probe.dst.len = UTIL_MIN(UTIL_MIN(ctx->dst.len, DSI_PROBE_LEN), len);
+
+	retval = dsi_huff_decompress(&probe);
+
+	// Invalid codes or reading past the source buffer.
+	if (retval == STPK_RET_ERR) {
+		return DSI_PROBE_ERR;
+	}
+
+	// Source data left is only known if the whole pass was decoded.
+	if (lastPass) {
+		return retval == STPK_RET_ERR_DATA_LEFT && probe.dst.len == ctx->dst.len ? DSI_PROBE_DATA_LEFT : DSI_PROBE_OK;
+	}
+
+	// Next pass must start with a valid RLE header.
+	return dsi_rle_isValid(&probe.dst, 0) ? DSI_PROBE_OK : DSI_PROBE_ERR;
+}
+
+// Pick the version of a Huffman pass ranked more plausible. Ties go to DSI2,
+// unless both leave source data after the last pass, which DSI1 files are
+// known to have.
+stpk_FmtDsiVer dsi_pickHuff(int valid1, int valid2)
+{
+	if (valid1 > valid2 || (valid1 == valid2 && valid1 == DSI_PROBE_DATA_LEFT)) {
+		return STPK_FMT_DSI_VER_1;
+	}
+
+	return STPK_FMT_DSI_VER_2;
+}
+
+// Decode all of a Huffman pass with the given bit stream format a chunk at a
+// time into a buffer that is discarded, and rank it like dsi_probeHuff() by
+// whether it decodes without errors, and without source data left if it is the
+// last pass. Like the probe, it decodes quietly.
+int dsi_checkHuff(stpk_Context *ctx, stpk_FmtDsiVer version, int lastPass)
+{
+	unsigned char chunk[DSI_PROBE_LEN + UTIL_DST_PADDING];
+	unsigned int retval = STPK_RET_OK;
+	stpk_Context probe = *ctx;
+	dsi_huff_Stream hs;
+
+	probe.verbosity = 0;
+	probe.trace = NULL;
+	probe.limit = 0;
+	probe.format.dsi.version = version;
+	probe.format.dsi.multi = STPK_FMT_DSI_MULTI_OFF;
+
+	if (dsi_huff_open(&probe, &hs)) {
+		return DSI_PROBE_ERR;
+	}
+
+	while (retval != STPK_RET_ERR && hs.offset < hs.len) {
+		retval = dsi_huff_read(&probe, &hs, chunk, DSI_PROBE_LEN);
+	}
+
+	if (retval != STPK_RET_ERR) {
+		retval = dsi_huff_end(&probe, &hs);
+	}
+
+	dsi_huff_close(&probe, &hs);
+
+	if (retval == STPK_RET_ERR) {
+		return DSI_PROBE_ERR;
+	}
+
+	return retval == STPK_RET_ERR_DATA_LEFT && lastPass ? DSI_PROBE_DATA_LEFT : DSI_PROBE_OK;
+}
+
+// Decode the next chunk of a Huffman pass streamed into a window.
+static unsigned int dsi_fillHuff(stpk_Context *ctx, void *source, unsigned char *dst, unsigned int len)
+{
+	return dsi_huff_read(ctx, (dsi_huff_Stream*)source, dst, len);
+}
+
+// Decode a Huffman pass and the run-length pass following it together. The
+// Huffman output is decoded in chunks into a window that the run-length decoder
+// reads from, so it is never held in memory all at once. If the Huffman output
+// is not a run-length pass, all of it is decoded into the destination buffer
+// like dsi_huff_decompress() does. Otherwise, *pass is advanced to the
+// run-length pass, which is limited by ctx->limit, and the Huffman pass is only
+// decoded as far as it reads.
+unsigned int dsi_decompressStream(stpk_Context *ctx, unsigned char *pass, unsigned char passes)
+{
+	unsigned int retval, len;
+	unsigned char *data;
+	int limited;
+	dsi_huff_Stream hs;
+	dsi_rle_Window window;
+
+	if (dsi_huff_open(ctx, &hs)) {
+		return 1;
+	}
+
+	// Run-length passes rarely read much more than they write, so a window
+	// about as long as the limited output saves decoding most of a chunk.
+	len = ctx->limit ? UTIL_MAX(ctx->limit, DSI_WINDOW_MIN) : DSI_WINDOW_LEN;
+	window.size = UTIL_MIN(hs.len, UTIL_MIN(len, DSI_WINDOW_LEN));
+	window.total = hs.len;
+	window.fill = dsi_fillHuff;
+	window.source = &hs;
+
+	if ((window.data = (unsigned char*)util_alloc(ctx, sizeof(unsigned char) * (window.size + UTIL_DST_PADDING))) == NULL) {
+		UTIL_ERR("Error allocating memory for destination buffer window. (%s)\n", strerror(errno));
+		dsi_huff_close(ctx, &hs);
+		return 1;
+	}
+
+	UTIL_NOVERBOSE("Huffman    [streamed]\n");
+
+	ctx->dst.data = window.data;
+	ctx->dst.offset = window.size;
+
+	if (dsi_huff_read(ctx, &hs, window.data, window.size)) {
+		dsi_huff_close(ctx, &hs);
+		return 1;
+	}
+
+	// Decode the rest of the Huffman output into a buffer of its own if it is
+	// not a run-length pass.
+	if (!dsi_rle_isValid(&ctx->dst, 0)) {
+		if (window.size < hs.len) {
+			if ((data = (unsigned char*)util_alloc(ctx, sizeof(unsigned char) * (hs.len + UTIL_DST_PADDING))) == NULL) {
+				UTIL_ERR("Error allocating memory for destination buffer. (%s)\n", strerror(errno));
+				dsi_huff_close(ctx, &hs);
+				return 1;
+			}
+
+			memcpy(data, window.data, window.size);
+			util_dealloc(ctx, window.data);
+			ctx->dst.data = data;
+			ctx->dst.offset = hs.len;
+
+			if (dsi_huff_read(ctx, &hs, data + window.size, hs.len - window.size)) {
+				dsi_huff_close(ctx, &hs);
+				return 1;
+			}
+		}
+
+		retval = dsi_huff_end(ctx, &hs);
+		ctx->src.offset = hs.src.offset;
+		dsi_huff_close(ctx, &hs);
+
+		return retval;
+	}
+
+	(*pass)++;
+	UTIL_NOVERBOSE("Pass %d/%d: ", *pass + 1, passes);
+	UTIL_VERBOSE1("\nPass %d/%d\n", *pass + 1, passes);
+
+	// The run-length pass reads its header from the window, and the window
+	// takes the place of its source buffer.
+	ctx->src.data = window.data;
+	ctx->src.offset = 1;
+	ctx->src.len = window.size;
+	ctx->dst.data = NULL;
+	ctx->dst.offset = 0;
+	ctx->dst.len = dsi_readLength(&ctx->src);
+	UTIL_VERBOSE1("  %-10s %d\n", "dstLen", ctx->dst.len);
+	limited = util_limitLen(ctx) < ctx->dst.len;
+
+	if (util_allocDst(ctx)) {
+		retval = 1;
+	}
+	else {
+		UTIL_VERBOSE1("  %-10s Run-length encoding\n", "type");
+		retval = dsi_rle_decompress(ctx, &window, 0);
+	}
+
+	// The run-length decoder reads all of the window's source when it succeeds,
+	// unless its output is limited. Data left after the Huffman pass is not an
+	// error.
+	if (!retval && !limited) {
+		dsi_huff_end(ctx, &hs);
+	}
+
+	// The window may have been reallocated while decoding.
+	util_dealloc(ctx, window.data);
+	ctx->src = hs.src;
+	dsi_huff_close(ctx, &hs);
+
+	return retval;
+}
+
+// Get the length of a buffer for decompressing in place. The first of several
+// passes is decoded in front of its source, and the last pass from the start of
+// the buffer while its source is read from the end. Returns 0 if the headers
+// are incomplete.
+unsigned int dsi_inPlaceLen(stpk_Context *ctx)
+{
+	unsigned char *data = ctx->src.data + ctx->src.offset, passes = 1;
+	unsigned int srcLen = ctx->src.len - ctx->src.offset, finalLen, passLen, len;
+
+	if (ctx->src.offset > ctx->src.len || srcLen < DSI_SIZE_MIN || srcLen > DSI_SIZE_MAX) {
+		return 0;
+	}
+
+	if (UTIL_GET_FLAG(data[0], DSI_PASSES_RECUR)) {
+		passes = data[0] & DSI_PASSES_MASK;
+		finalLen = dsi_peekLength(data, 1);
+		passLen = dsi_peekLength(data, 5);
+	}
+	else {
+		finalLen = passLen = dsi_peekLength(data, 1);
+	}
+
+	len = UTIL_MAX(finalLen + DSI_INPLACE_MARGIN(finalLen), srcLen + UTIL_DST_PADDING);
+
+	if (passes > 1) {
+		len = UTIL_MAX(len, srcLen + passLen + UTIL_DST_PADDING);
+	}
+
+	return len;
+}
+
+// Stop decompressing in place by moving the source to the start of the buffer,
+// which is then freed like any other source buffer.
+static void dsi_leavePlace(stpk_Context *ctx, unsigned char **place)
+{
+	memmove(*place, ctx->src.data, ctx->src.len);
+	ctx->src.data = *place;
+	*place = NULL;
+}
+
+// Allocate the destination buffer of a pass. When decompressing in place, the
+// output is written to the start of the buffer instead, either in front of the
+// source or, for the final output, over the part of it that has been read.
+static int dsi_allocPass(stpk_Context *ctx, unsigned char **place, int final)
+{
+	if (*place != NULL) {
+		if (ctx->dst.len + UTIL_DST_PADDING <= (unsigned int)((final ? ctx->src.data + ctx->src.len : ctx->src.data) - *place)) {
+			ctx->dst.data = *place;
+			return 0;
+		}
+
+		dsi_leavePlace(ctx, place);
+	}
+
+	return util_allocDst(ctx);
+}
+
+// Set the destination as source for the next pass. When decompressing in
+// place, it is moved to the end of the buffer.
+static void dsi_nextPass(stpk_Context *ctx, unsigned char *place)
+{
+	if (place == NULL) {
+		util_dst2src(ctx);
+		return;
+	}
+
+	ctx->src.data = ctx->src.data + ctx->src.len - ctx->dst.len;
+	memmove(ctx->src.data, ctx->dst.data, ctx->dst.len);
+	ctx->src.len = ctx->dst.len;
+	ctx->dst.data = NULL;
+	ctx->src.offset = ctx->dst.offset = 0;
+}
+
+// Decode the final Huffman pass in place, in chunks ending before the part of
+// its source that is still to be read. The output is moved to a buffer of its
+// own if the two get too close.
+static unsigned int dsi_decompressHuffInPlace(stpk_Context *ctx)
+{
+	unsigned int retval, len;
+	long room;
+	int inPlace = 1;
+	unsigned char *data;
+	dsi_huff_Stream hs;
+
+	if (dsi_huff_open(ctx, &hs)) {
+		return 1;
+	}
+
+	UTIL_NOVERBOSE("Huffman    [in place]\n");
+
+	while (hs.offset < hs.len) {
+		len = hs.len - hs.offset;
+
+		if (inPlace) {
+			room = (hs.src.data + hs.br.offset) - (ctx->dst.data + hs.offset) - UTIL_DST_PADDING;
+
+			if (room < (long)UTIL_MIN(len, DSI_INPLACE_CHUNK_MIN)) {
+				if ((data = (unsigned char*)util_alloc(ctx, sizeof(unsigned char) * (hs.len + UTIL_DST_PADDING))) == NULL) {
+					UTIL_ERR("Error allocating memory for destination buffer. (%s)\n", strerror(errno));
+					dsi_huff_close(ctx, &hs);
+					return 1;
+				}
+
+				memcpy(data, ctx->dst.data, hs.offset);
+				ctx->dst.data = data;
+				inPlace = 0;
+			}
+			else {
+				len = UTIL_MIN(len, (unsigned int)room);
+			}
+		}
+
+		if (dsi_huff_read(ctx, &hs, ctx->dst.data + hs.offset, len)) {
+			dsi_huff_close(ctx, &hs);
+			return 1;
+		}
+	}
+
+	ctx->dst.offset = hs.len;
+	retval = dsi_huff_end(ctx, &hs);
+	ctx->src.offset = hs.src.offset;
+	dsi_huff_close(ctx, &hs);
+
+	return retval;
+}
+
+// Decode all of a Huffman pass with limited output, keeping only the output up
+// to the limit, so the data left after it tells if the bit stream format is
+// right. The rest is decoded a chunk at a time into a buffer that is discarded.
+static unsigned int dsi_decompressHuffDiscard(stpk_Context *ctx)
+{
+	unsigned char chunk[DSI_PROBE_LEN + UTIL_DST_PADDING];
+	unsigned int retval, len = util_limitLen(ctx);
+	dsi_huff_Stream hs;
+
+	if (dsi_huff_open(ctx, &hs)) {
+		return 1;
+	}
+
+	UTIL_NOVERBOSE("Huffman    [limited]\n");
+
+	retval = dsi_huff_read(ctx, &hs, ctx->dst.data, len);
+
+	while (retval != STPK_RET_ERR && hs.offset < hs.len) {
+		retval = dsi_huff_read(ctx, &hs, chunk, DSI_PROBE_LEN);
+	}
+
+	if (retval != STPK_RET_ERR) {
+		retval = dsi_huff_end(ctx, &hs);
+	}
+
+	ctx->dst.offset = len;
+	ctx->src.offset = hs.src.offset;
+	dsi_huff_close(ctx, &hs);
+
+	return retval;
+}
+
+// Probe the beginning of a Huffman pass with both bit stream formats before
+// decoding all of it, and pick the one to decode with by dsi_pickHuff().
+// Returns whether decoding with DSI2 should be retried with DSI1 if it fails,
+// which is only when the probe could not tell them apart. Data left is only
+// found once the whole pass is probed, so it ranks both versions for good.
+static int dsi_detectHuff(stpk_Context *ctx, int lastPass)
+{
+	int valid1, valid2;
+
+	valid1 = dsi_probeHuff(ctx, STPK_FMT_DSI_VER_1, lastPass, DSI_PROBE_LEN);
+	valid2 = dsi_probeHuff(ctx, STPK_FMT_DSI_VER_2, lastPass, DSI_PROBE_LEN);
+
+	ctx->format.dsi.version = dsi_pickHuff(valid1, valid2);
+
+	UTIL_VERBOSE1("  %-10s %s (plausible %s: %d, %s: %d)\n", "detected",
+		stpk_fmtDsiVerStr(ctx->format.dsi.version),
+		stpk_fmtDsiVerStr(STPK_FMT_DSI_VER_1), valid1,
+		stpk_fmtDsiVerStr(STPK_FMT_DSI_VER_2), valid2
+	);
+
+	return ctx->format.dsi.version == STPK_FMT_DSI_VER_2 && valid1 == valid2;
+}
+
+// Decode a Huffman pass again with DSI1 into the same destination buffer if
+// decoding it with DSI2 failed or gave an implausible result.
+static unsigned int dsi_retryHuff(stpk_Context *ctx, unsigned int retval, int lastPass, unsigned int srcOffset, unsigned char pass, unsigned char passes)
+{
+	if (
+		// Decompression failed.
+		retval == STPK_RET_ERR
+		// Decompression had source data left, but it is the last pass.
+		|| (retval == STPK_RET_ERR_DATA_LEFT && lastPass)
+		// There are more passes, but the next is not valid RLE.
+		|| (!lastPass && !dsi_rle_isValid(&ctx->dst, 0))
+	) {
+		UTIL_WARN("Huffman decompression with %s bit stream format failed, retrying with %s format.\n",
+			stpk_fmtDsiVerStr(STPK_FMT_DSI_VER_2),
+			stpk_fmtDsiVerStr(STPK_FMT_DSI_VER_1)
+		);
+		ctx->format.dsi.version = STPK_FMT_DSI_VER_1;
+		ctx->src.offset = srcOffset;
+		ctx->dst.offset = 0;
+		UTIL_NOVERBOSE("Pass %d/%d: ", pass + 1, passes);
+		retval = dsi_huff_decompress(ctx);
+	}
+
+	return retval;
+}
+
+// Report the version a Huffman pass was decoded with, and reset to automatic
+// version in case there are more passes.
+static unsigned int dsi_endHuff(stpk_Context *ctx, unsigned int retval, int detect)
+{
+	ctx->format.dsi.detected = ctx->format.dsi.version;
+	if (detect) {
+		ctx->format.dsi.version = STPK_FMT_DSI_VER_AUTO;
+	}
+
+	// Data left must be checked for BB Stunts 1.0 bit stream detection
+	// heuristics, but it is not an error. SDTITL.PVS in BB Stunts 1.1 has 95
+	// bytes extra, which is random data that is ignored.
+	return retval == STPK_RET_ERR_DATA_LEFT ? STPK_RET_OK : retval;
+}
+
+// Decompress sub-files in source buffer, in place if the source is placed at
+// the end of a buffer that the output is written to the start of. The output
+// limit applies to the pass producing the final output, and to a run-length
+// pass streamed from the Huffman pass before it. Other passes are decoded
+// whole.
+static unsigned int dsi_decompressPasses(stpk_Context *ctx, unsigned char **place, unsigned int limit)
 {
 	unsigned char passes, type, i;
 	unsigned int retval = 1, finalLen, srcOffset;
+	int detect = ctx->format.dsi.version == STPK_FMT_DSI_VER_AUTO, lastPass, final, retry = 0;
+
+	ctx->format.dsi.detected = STPK_FMT_DSI_VER_AUTO;
 
 	UTIL_NOVERBOSE("Format: DSI (version: %s)\n", stpk_fmtDsiVerStr(ctx->format.dsi.version));
 	UTIL_VERBOSE1("  %-10s %s\n", "format", stpk_fmtTypeStr(ctx->format.type));
@@ -102,49 +534,316 @@ unsigned int dsi_decompress(stpk_Context *ctx)
 		ctx->dst.len = dsi_readLength(&ctx->src);
 		UTIL_VERBOSE1("  %-10s %d\n", "dstLen", ctx->dst.len);
 
-		if (util_allocDst(ctx)) {
+		// The pass producing the final output may overwrite its source in place.
+		final = i == (passes - 1) || i + 1 == ctx->format.dsi.maxPasses;
+		ctx->limit = final ? limit : 0;
+
+		switch (type) {
+			case DSI_TYPE_RLE:
+				if (dsi_allocPass(ctx, place, final)) {
+					return 1;
+				}
+
+				UTIL_VERBOSE1("  %-10s Run-length encoding\n", "type");
+				retval = dsi_rle_decompress(ctx, NULL, *place != NULL && final);
+				break;
+			case DSI_TYPE_HUFF:
+				UTIL_VERBOSE1("  %-10s Huffman coding\n", "type");
+				srcOffset = ctx->src.offset;
+				lastPass = i == (passes - 1);
+				retry = detect && dsi_detectHuff(ctx, lastPass);
+
+				// Stream the Huffman output into the next pass if it is allowed to
+				// run, unless it is traced or the pass may need to be decoded again
+				// with the other bit stream format.
+				if (!final && ctx->verbosity < 2 && !TRACE_ON(ctx) && !retry && *place == NULL) {
+					ctx->limit = i + 1 == (passes - 1) || i + 2 == ctx->format.dsi.maxPasses ? limit : 0;
+					retval = dsi_decompressStream(ctx, &i, passes);
+				}
+				else {
+					// Decoding over the source in place is neither traced nor
+					// retried.
+					if (*place != NULL && final && (ctx->verbosity >= 2 || TRACE_ON(ctx) || retry)) {
+						dsi_leavePlace(ctx, place);
+					}
+
+					// The bit stream format is confirmed by data left after the
+					// whole pass or by the header of the next, so a pass that may
+					// be retried is not limited until it has been decoded.
+					if (retry) {
+						ctx->limit = 0;
+					}
+
+					if (dsi_allocPass(ctx, place, final)) {
+						return 1;
+					}
+
+					retval = *place != NULL && final ? dsi_decompressHuffInPlace(ctx) : dsi_huff_decompress(ctx);
+				}
+
+				if (retry) {
+					retval = dsi_retryHuff(ctx, retval, lastPass, srcOffset, i, passes);
+				}
+
+				if (final && limit && ctx->dst.len > limit) {
+					ctx->dst.len = limit;
+				}
+
+				retval = dsi_endHuff(ctx, retval, detect);
+				break;
+			default:
+				UTIL_ERR("Error parsing source file. Expected type 1 (run-length) or 2 (Huffman), got %02X\n", type);
+				return 1;
+		}
+
+		if (retval) {
+			return retval;
+		}
+
+		if (i + 1 == ctx->format.dsi.maxPasses && passes != ctx->format.dsi.maxPasses) {
+			UTIL_MSG("Parsing limited to %d decompression pass(es), aborting.\n", ctx->format.dsi.maxPasses);
+			return 0;
+		}
+
+		// Destination buffer is source for next pass.
+		if (i < (passes - 1)) {
+			dsi_nextPass(ctx, *place);
+		}
+	}
+
+	return 0;
+}
+
+// Decompress sub-files in source buffer. In place mode moves the source to the
+// end of a single buffer, unless it already is at the end of one long enough,
+// and the buffer holds the output when done. Limited output is not decoded in
+// place, as the buffer would be sized for all of it.
+unsigned int dsi_decompress(stpk_Context *ctx)
+{
+	unsigned int retval, len, srcLen = ctx->src.len - ctx->src.offset, limit = ctx->limit;
+	unsigned char *place = NULL;
+
+	if (ctx->format.dsi.inPlace && !limit && (len = dsi_inPlaceLen(ctx))) {
+		if (ctx->src.len >= len) {
+			place = ctx->src.data;
+		}
+		else {
+			if ((place = (unsigned char*)util_alloc(ctx, sizeof(unsigned char) * len)) == NULL) {
+				UTIL_ERR("Error allocating memory for in place buffer. (%s)\n", strerror(errno));
+				return 1;
+			}
+
+			memcpy(place + len - srcLen, ctx->src.data + ctx->src.offset, srcLen);
+			util_dealloc(ctx, ctx->src.data);
+			ctx->src.len = len;
+		}
+
+		ctx->src.data = place + ctx->src.len - srcLen;
+		ctx->src.offset = 0;
+		ctx->src.len = srcLen;
+	}
+
+	retval = dsi_decompressPasses(ctx, &place, limit);
+	ctx->limit = limit;
+
+	// The source is within the buffer, which is freed unless it holds the
+	// output.
+	if (place != NULL) {
+		if (!retval) {
+			UTIL_VERBOSE1("\n  %-10s %s\n", "inPlace", ctx->dst.data == place ? "yes" : "no, output moved to a buffer of its own");
+		}
+
+		if (ctx->dst.data != place) {
+			util_dealloc(ctx, place);
+		}
+
+		ctx->src.data = NULL;
+		ctx->src.offset = ctx->src.len = 0;
+	}
+
+	return retval;
+}
+
+// Get the length of the output from the file header without decoding, limited
+// by the number of passes and the output limit. Returns 0 if the headers are
+// incomplete, or if a pass between the first and the last is the final one.
+unsigned int dsi_decompressedLen(stpk_Context *ctx)
+{
+	unsigned char *data = ctx->src.data + ctx->src.offset, passes = 1;
+	unsigned int srcLen = ctx->src.len - ctx->src.offset, len;
+
+	if (ctx->src.offset >= ctx->src.len || srcLen < DSI_HEADER_LEN(data)) {
+		return 0;
+	}
+
+	len = dsi_peekLength(data, 1);
+
+	if (UTIL_GET_FLAG(data[0], DSI_PASSES_RECUR)) {
+		passes = data[0] & DSI_PASSES_MASK;
+
+		if (ctx->format.dsi.maxPasses && ctx->format.dsi.maxPasses < passes) {
+			if (ctx->format.dsi.maxPasses > 1) {
+				return 0;
+			}
+
+			len = dsi_peekLength(data, 5);
+		}
+	}
+
+	return ctx->limit && ctx->limit < len ? ctx->limit : len;
+}
+
+// Get the length of the buffers dsi_decompressInto() decodes the passes before
+// the final one into, and their number in count. Two buffers take turns when
+// there is more than one such pass. Only the length of the first of them is in
+// the file header, and the others are taken to be no longer than it or the
+// final pass, as passes usually expand the one before.
+static unsigned int dsi_betweenLen(stpk_Context *ctx, unsigned int *count)
+{
+	unsigned char *data = ctx->src.data + ctx->src.offset;
+	unsigned int passes;
+
+	*count = 0;
+
+	if (ctx->src.offset >= ctx->src.len || ctx->src.len - ctx->src.offset < DSI_HEADER_LEN(data)) {
+		return 0;
+	}
+
+	passes = UTIL_GET_FLAG(data[0], DSI_PASSES_RECUR) ? data[0] & DSI_PASSES_MASK : 1;
+
+	if (ctx->format.dsi.maxPasses && ctx->format.dsi.maxPasses < passes) {
+		passes = ctx->format.dsi.maxPasses;
+	}
+
+	*count = passes > 2 ? 2 : passes ? passes - 1 : 0;
+
+	if (!*count) {
+		return 0;
+	}
+
+	return *count > 1 ? UTIL_MAX(dsi_peekLength(data, 5), dsi_peekLength(data, 1)) : dsi_peekLength(data, 5);
+}
+
+// Get the length of the scratch region dsi_decompressInto() needs for the
+// Huffman lookup tables and the output of the passes before the final one.
+unsigned int dsi_scratchLen(stpk_Context *ctx)
+{
+	unsigned char *data = ctx->src.data + ctx->src.offset;
+	unsigned int len, betweenLen, count;
+
+	if (ctx->src.offset >= ctx->src.len || ctx->src.len - ctx->src.offset < DSI_HEADER_LEN(data)) {
+		return 0;
+	}
+
+	len = util_scratchLen(ctx, sizeof(dsi_huff_Entry) * DSI_HUFF_TABLE_LEN)
+		+ util_scratchLen(ctx, sizeof(dsi_huff_Entry) * DSI_HUFF_MULTI_LEN);
+
+	betweenLen = dsi_betweenLen(ctx, &count);
+
+	return len + count * util_scratchLen(ctx, betweenLen + UTIL_DST_PADDING);
+}
+
+// Decompress sub-files in source buffer into dst of dstLen bytes and
+// UTIL_DST_PADDING more. Passes before the final one are decoded into buffers
+// in the scratch region, taking turns as source and destination, and the
+// Huffman lookup tables are taken from it too. The source is left as it is, so
+// nothing is allocated or freed.
+unsigned int dsi_decompressInto(stpk_Context *ctx, unsigned char *dst, unsigned int dstLen)
+{
+	unsigned char *between[2], passes, type, i;
+	unsigned int retval, srcOffset, limit = ctx->limit, betweenLen, count, j;
+	int detect = ctx->format.dsi.version == STPK_FMT_DSI_VER_AUTO, lastPass, final, retry;
+
+	ctx->format.dsi.detected = STPK_FMT_DSI_VER_AUTO;
+
+	betweenLen = dsi_betweenLen(ctx, &count);
+	for (j = 0; j < count; j++) {
+		if ((between[j] = (unsigned char*)util_alloc(ctx, sizeof(unsigned char) * (betweenLen + UTIL_DST_PADDING))) == NULL) {
+			return 1;
+		}
+	}
+
+	UTIL_NOVERBOSE("Format: DSI (version: %s)\n", stpk_fmtDsiVerStr(ctx->format.dsi.version));
+	UTIL_VERBOSE1("  %-10s %s\n", "format", stpk_fmtTypeStr(ctx->format.type));
+	UTIL_VERBOSE1("  %-10s %s\n", "version", stpk_fmtDsiVerStr(ctx->format.dsi.version));
+
+	passes = ctx->src.data[ctx->src.offset];
+	if (UTIL_GET_FLAG(passes, DSI_PASSES_RECUR)) {
+		passes &= DSI_PASSES_MASK;
+		UTIL_VERBOSE1("  %-10s %d\n", "passes", passes);
+		ctx->src.offset += 4;
+	}
+	else {
+		passes = 1;
+	}
+
+	for (i = 0; i < passes; i++) {
+		UTIL_NOVERBOSE("Pass %d/%d: ", i + 1, passes);
+		UTIL_VERBOSE1("\nPass %d/%d\n", i + 1, passes);
+
+		if (ctx->src.offset + 4 > ctx->src.len) {
+			UTIL_ERR("Reached EOF while parsing pass header\n");
+			return 1;
+		}
+
+		type = ctx->src.data[ctx->src.offset++];
+		ctx->dst.len = dsi_readLength(&ctx->src);
+		ctx->dst.offset = 0;
+		UTIL_VERBOSE1("  %-10s %d\n", "dstLen", ctx->dst.len);
+
+		final = i == (passes - 1) || i + 1 == ctx->format.dsi.maxPasses;
+		ctx->limit = final ? limit : 0;
+
+		if (final) {
+			if (util_limitLen(ctx) > dstLen) {
+				UTIL_ERR("Destination buffer of %d bytes is too short, expected %d\n", dstLen, util_limitLen(ctx));
+				return 1;
+			}
+
+			ctx->dst.data = dst;
+		}
+		else if (ctx->dst.len > betweenLen) {
+			UTIL_ERR("Pass of %d bytes is longer than the %d bytes reserved for passes before the final one\n", ctx->dst.len, betweenLen);
 			return 1;
 		}
+		else {
+			ctx->dst.data = between[i % 2];
+		}
 
 		switch (type) {
 			case DSI_TYPE_RLE:
 				UTIL_VERBOSE1("  %-10s Run-length encoding\n", "type");
-				retval = dsi_rle_decompress(ctx);
+				retval = dsi_rle_decompress(ctx, NULL, 0);
 				break;
 			case DSI_TYPE_HUFF:
 				UTIL_VERBOSE1("  %-10s Huffman coding\n", "type");
 				srcOffset = ctx->src.offset;
-				retval = dsi_huff_decompress(ctx);
-				// If selected version is "auto", check if we should retry with DSI1.
-				if (ctx->format.dsi.version == STPK_FMT_DSI_VER_AUTO
-					&& (
-						// Decompression failed.
-						retval == STPK_RET_ERR
-						// Decompression had source data left, but it is the last pass.
-						|| (retval == STPK_RET_ERR_DATA_LEFT && (i == (passes - 1)))
-						// There are more passes, but the next is not valid RLE.
-						|| ((i < (passes - 1)) && !dsi_rle_isValid(&ctx->dst, 0))
-					)
-				) {
-					UTIL_WARN("Huffman decompression with %s bit stream format failed, retrying with %s format.\n", 
-						stpk_fmtTypeStr(STPK_FMT_DSI_VER_2),
-						stpk_fmtTypeStr(STPK_FMT_DSI_VER_1)
-					);
-					ctx->format.dsi.version = STPK_FMT_DSI_VER_1;
-					ctx->src.offset = srcOffset;
-					ctx->dst.offset = 0;
-					UTIL_NOVERBOSE("Pass %d/%d: ", i + 1, passes);
+				lastPass = i == (passes - 1);
+				retry = detect && dsi_detectHuff(ctx, lastPass);
+
+				// The bit stream format is confirmed by data left after the whole
+				// pass, so a pass that may be retried is decoded whole, and only
+				// kept up to the limit if dst is too short for all of it.
+				if (retry && ctx->dst.len > dstLen) {
+					retval = dsi_decompressHuffDiscard(ctx);
+				}
+				else {
+					if (retry) {
+						ctx->limit = 0;
+					}
+
 					retval = dsi_huff_decompress(ctx);
-					// Reset to automatic version in case there are more passes.
-					ctx->format.dsi.version = STPK_FMT_DSI_VER_AUTO;
 				}
 
-				// Data left must be checked for BB Stunts 1.0 bit stream detection
-				// heuristics, but it is not an error. SDTITL.PVS in BB Stunts 1.1
-				// has 95 bytes extra, which is random data that is ignored.
-				if (retval == STPK_RET_ERR_DATA_LEFT) {
-					retval = STPK_RET_OK;
+				if (retry) {
+					retval = dsi_retryHuff(ctx, retval, lastPass, srcOffset, i, passes);
 				}
+
+				if (final && limit && ctx->dst.len > limit) {
+					ctx->dst.len = limit;
+				}
+
+				retval = dsi_endHuff(ctx, retval, detect);
 				break;
 			default:
 				UTIL_ERR("Error parsing source file. Expected type 1 (run-length) or 2 (Huffman), got %02X\n", type);
@@ -160,9 +859,13 @@ unsigned int dsi_decompress(stpk_Context *ctx)
 			return 0;
 		}
 
-		// Destination buffer is source for next pass.
+		// Destination buffer in the scratch region is source for next pass, and
+		// the source of this one is the destination of the next.
 		if (i < (passes - 1)) {
-			util_dst2src(ctx);
+			ctx->src.data = ctx->dst.data;
+			ctx->src.len = ctx->dst.len;
+			ctx->src.offset = 0;
+			ctx->dst.data = NULL;
 		}
 	}
 
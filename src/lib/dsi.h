@@ -30,8 +30,43 @@
 #define DSI_TYPE_RLE          0x01
 #define DSI_TYPE_HUFF         0x02
 
+// Length of the file header and the first pass header, which holds the length
+// of the first pass' output.
+#define DSI_HEADER_LEN(data)  (UTIL_GET_FLAG((data)[0], DSI_PASSES_RECUR) ? 8 : 4)
+
+#define DSI_PROBE_LEN         0x1000
+
+// Plausibility of a Huffman bit stream format found by dsi_probeHuff() and
+// dsi_checkHuff(), ranked from least to most plausible.
+#define DSI_PROBE_ERR         0  // Invalid codes, or not followed by a valid pass.
+#define DSI_PROBE_DATA_LEFT   1  // Whole last pass decoded with source data left.
+#define DSI_PROBE_OK          2
+
+// Length of the window a Huffman pass is decoded into when it is streamed into
+// the next pass.
+#define DSI_WINDOW_LEN        0x8000
+
+// Shortest window for a run-length pass with limited output.
+#define DSI_WINDOW_MIN        0x400
+
+// Room left after the final output when decompressing in place, for the part
+// of the last pass' source that is still to be read as it is overwritten.
+#define DSI_INPLACE_MARGIN(len) (0x100 + (len) / 0x40)
+
+// Shortest chunk a Huffman pass decoded in place is read in before its output
+// is moved to a buffer of its own.
+#define DSI_INPLACE_CHUNK_MIN 0x1000
+
 int dsi_isValid(stpk_Context *ctx);
 unsigned int dsi_decompress(stpk_Context *ctx);
+int dsi_probeHuff(stpk_Context *ctx, stpk_FmtDsiVer version, int lastPass, unsigned int len);
+int dsi_checkHuff(stpk_Context *ctx, stpk_FmtDsiVer version, int lastPass);
+stpk_FmtDsiVer dsi_pickHuff(int valid1, int valid2);
+unsigned int dsi_decompressStream(stpk_Context *ctx, unsigned char *pass, unsigned char passes);
+unsigned int dsi_inPlaceLen(stpk_Context *ctx);
+unsigned int dsi_decompressedLen(stpk_Context *ctx);
+unsigned int dsi_scratchLen(stpk_Context *ctx);
+unsigned int dsi_decompressInto(stpk_Context *ctx, unsigned char *dst, unsigned int dstLen);
 
 // Peek at 24-bit data length.
 inline unsigned int dsi_peekLength(unsigned char *data, unsigned int offset)
@@ -17,13 +17,16 @@
  * Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA 02111-1307, USA.
  */
 
+#include <errno.h>
+#include <string.h>
+
+#include "bitreader.h"
 #include "dsi.h"
+#include "trace.h"
 #include "util.h"
 
 #include "dsi_huff.h"
 
-inline unsigned char stpk_getHuffByte(stpk_Context *ctx);
-
 // Check if data at given offset is a likely Huffman header:
 // - Type is Huffman
 // - Tree levels between 2 and 16
@@ -36,21 +39,68 @@ int dsi_huff_isValid(stpk_Buffer *buf, unsigned int offset)
 		&& buf->data[offset + 5] == 0; // Leaves at root
 }
 
-// Decompress Huffman coded sub-file.
+// Get the length of the Huffman header at the start of data, or as much of it
+// as can be told from the first len bytes.
+unsigned int dsi_huff_headerLen(const unsigned char *data, unsigned int len)
+{
+	unsigned int levels, alphLen = 0, i;
+
+	if (len < 1) {
+		return 1;
+	}
+
+	levels = UTIL_MIN(data[0] & DSI_HUFF_LEVELS_MASK, DSI_HUFF_LEVELS_MAX);
+	if (len < 1 + levels) {
+		return 1 + levels;
+	}
+
+	for (i = 0; i < levels; i++) alphLen += data[1 + i];
+
+	return 1 + levels + UTIL_MIN(alphLen, DSI_HUFF_ALPH_LEN);
+}
+
+// Decompress Huffman coded sub-file, or as much of it as the output limit
+// allows.
 unsigned int dsi_huff_decompress(stpk_Context *ctx)
 {
-	unsigned char levels, leafNodesPerLevel[DSI_HUFF_LEVELS_MAX], alphabet[DSI_HUFF_ALPH_LEN], symbols[DSI_HUFF_PREFIX_LEN], widths[DSI_HUFF_PREFIX_LEN];
-	short codeOffsets[DSI_HUFF_LEVELS_MAX];
-	unsigned short totalCodes[DSI_HUFF_LEVELS_MAX];
+	unsigned int retval, len = ctx->dst.len;
+	dsi_huff_Stream hs;
+
+	ctx->dst.len = util_limitLen(ctx);
+
+	if (dsi_huff_open(ctx, &hs)) {
+		return 1;
+	}
+
+	retval = dsi_huff_decode(ctx, hs.table, hs.multi, ctx->dst.len == len);
+
+	// Delta coded symbols are decoded as is and summed up in a separate pass,
+	// which keeps the dependency on the previous output out of the decoder.
+	if (hs.delta && retval != STPK_RET_ERR) {
+		UTIL_VERBOSE1("Summing up delta coded output...\n\n");
+		util_prefixSum(ctx->dst.data, ctx->dst.offset, 0);
+	}
+
+	dsi_huff_close(ctx, &hs);
+
+	return retval;
+}
+
+// Parse Huffman header and generate lookup tables for decoding a pass of
+// ctx->dst.len bytes, either all at once or a chunk at a time.
+unsigned int dsi_huff_open(stpk_Context *ctx, dsi_huff_Stream *hs)
+{
+	unsigned char levels, leafNodesPerLevel[DSI_HUFF_LEVELS_MAX], alphabet[DSI_HUFF_ALPH_LEN];
+	int codeOffsets[DSI_HUFF_LEVELS_MAX];
+	unsigned int totalCodes[DSI_HUFF_LEVELS_MAX];
 	unsigned int i, alphLen;
-	int delta;
 
 	levels = ctx->src.data[ctx->src.offset++];
-	delta = UTIL_GET_FLAG(levels, DSI_HUFF_LEVELS_DELTA);
+	hs->delta = UTIL_GET_FLAG(levels, DSI_HUFF_LEVELS_DELTA);
 	levels &= DSI_HUFF_LEVELS_MASK;
 
 	UTIL_VERBOSE1("  %-10s %d\n", "levels", levels);
-	UTIL_VERBOSE1("  %-10s %d\n\n", "delta", delta);
+	UTIL_VERBOSE1("  %-10s %d\n\n", "delta", hs->delta);
 
 	if (levels > DSI_HUFF_LEVELS_MAX) {
 		UTIL_ERR("Huffman tree levels greater than %d, got %d\n", DSI_HUFF_LEVELS_MAX, levels);
@@ -77,13 +127,45 @@ unsigned int dsi_huff_decompress(stpk_Context *ctx)
 		return 1;
 	}
 
-	dsi_huff_genPrefix(ctx, levels, leafNodesPerLevel, alphabet, symbols, widths);
+	if ((hs->table = (dsi_huff_Entry*)util_alloc(ctx, sizeof(dsi_huff_Entry) * DSI_HUFF_TABLE_LEN)) == NULL) {
+		UTIL_ERR("Error allocating memory for Huffman lookup table. (%s)\n", strerror(errno));
+		return 1;
+	}
+
+	dsi_huff_genPrefix(ctx, levels, alphabet, codeOffsets, totalCodes, hs->table);
 
-	return dsi_huff_decode(ctx, alphabet, symbols, widths, codeOffsets, totalCodes, delta);
+	hs->multi = NULL;
+	if (dsi_huff_useMulti(ctx, levels, leafNodesPerLevel)) {
+		if ((hs->multi = (dsi_huff_Entry*)util_alloc(ctx, sizeof(dsi_huff_Entry) * DSI_HUFF_MULTI_LEN)) == NULL) {
+			UTIL_ERR("Error allocating memory for multi-symbol Huffman lookup table. (%s)\n", strerror(errno));
+			util_dealloc(ctx, hs->table);
+			return 1;
+		}
+
+		dsi_huff_genMulti(ctx, hs->table, hs->multi);
+	}
+
+	hs->src = ctx->src;
+	hs->len = ctx->dst.len;
+	hs->offset = 0;
+	hs->sum = 0;
+	hs->retval = STPK_RET_OK;
+	bitreader_init(&hs->br, ctx->src.data, ctx->src.offset, ctx->src.len, ctx->format.dsi.version == STPK_FMT_DSI_VER_1);
+
+	return 0;
+}
+
+// Free lookup tables.
+void dsi_huff_close(stpk_Context *ctx, dsi_huff_Stream *hs)
+{
+	if (hs->multi != NULL) {
+		util_dealloc(ctx, hs->multi);
+	}
+	util_dealloc(ctx, hs->table);
 }
 
-// Generate offset table for translating Huffman codes wider than 8 bits to alphabet indices.
-unsigned int dsi_huff_genOffsets(stpk_Context *ctx, unsigned int levels, const unsigned char *leafNodesPerLevel, short *codeOffsets, unsigned short *totalCodes)
+// Generate offset table for translating Huffman codes to alphabet indices.
+unsigned int dsi_huff_genOffsets(stpk_Context *ctx, unsigned int levels, const unsigned char *leafNodesPerLevel, int *codeOffsets, unsigned int *totalCodes)
 {
 	unsigned int level, codes = 0, alphLen = 0;
 
@@ -103,149 +185,307 @@ unsigned int dsi_huff_genOffsets(stpk_Context *ctx, unsigned int levels, const u
 	return alphLen;
 }
 
-// Generate prefix table for direct lookup of Huffman codes up to 8 bits wide.
-void dsi_huff_genPrefix(stpk_Context *ctx, unsigned int levels, const unsigned char *leafNodesPerLevel, const unsigned char *alphabet, unsigned char *symbols, unsigned char *widths)
+// Generate two-level lookup table. Codes up to 8 bits wide are resolved
+// directly by the prefix table, wider codes escape to a second level table
+// sized by the widest code sharing the same 8 bit prefix.
+void dsi_huff_genPrefix(stpk_Context *ctx, unsigned int levels, const unsigned char *alphabet, const int *codeOffsets, const unsigned int *totalCodes, dsi_huff_Entry *table)
 {
-	unsigned int prefix, alphabetIndex, width = 1, maxWidth = UTIL_MIN(levels, DSI_HUFF_PREFIX_WIDTH);
-	unsigned char leafNodes, totalNodes = DSI_HUFF_PREFIX_MSB, remainingNodes;
-
-	// Fill all prefixes with data from last leaf node.
-	for (prefix = 0, alphabetIndex = 0; width <= maxWidth; width++, totalNodes >>= 1) {
-		for (leafNodes = leafNodesPerLevel[width - 1]; leafNodes > 0; leafNodes--, alphabetIndex++) {
-			for (remainingNodes = totalNodes; remainingNodes; remainingNodes--, prefix++) {
-				symbols[prefix] = alphabet[alphabetIndex];
-				widths[prefix] = width;
+	unsigned int level, width, code, prefix, start, fill, i, tableLen = DSI_HUFF_PREFIX_LEN;
+	unsigned char subWidths[DSI_HUFF_PREFIX_LEN];
+
+	for (prefix = 0; prefix < DSI_HUFF_PREFIX_LEN; prefix++) {
+		table[prefix] = 0;
+		subWidths[prefix] = 0;
+	}
+
+	// Leaf codes at each level range from twice the previous level's total
+	// codes up to this level's total codes. Codes that do not fit in the level's
+	// width are unreachable and ignored.
+#	define DSI_HUFF_FOR_EACH_CODE(level, code) \
+		for (code = level ? totalCodes[level - 1] * 2 : 0; code < totalCodes[level] && code < (1u << (level + 1)); code++)
+
+	// Find the widest code for each escaped prefix. Levels are ascending, so the
+	// last write is the widest.
+	for (level = DSI_HUFF_PREFIX_WIDTH; level < levels; level++) {
+		width = level + 1 - DSI_HUFF_PREFIX_WIDTH;
+		DSI_HUFF_FOR_EACH_CODE(level, code) {
+			subWidths[code >> width] = width;
+		}
+	}
+
+	// Allocate second level tables.
+	for (prefix = 0; prefix < DSI_HUFF_PREFIX_LEN; prefix++) {
+		if (subWidths[prefix]) {
+			table[prefix] = DSI_HUFF_ENTRY_ESC(tableLen, subWidths[prefix]);
+			for (i = 0; i < (1u << subWidths[prefix]); i++) table[tableLen++] = 0;
+		}
+	}
+
+	// Fill all table entries starting with each code with its symbol and width.
+	for (level = 0; level < levels; level++) {
+		width = level + 1;
+		DSI_HUFF_FOR_EACH_CODE(level, code) {
+			if (width <= DSI_HUFF_PREFIX_WIDTH) {
+				fill = 1 << (DSI_HUFF_PREFIX_WIDTH - width);
+				start = code << (DSI_HUFF_PREFIX_WIDTH - width);
+			}
+			else {
+				prefix = code >> (width - DSI_HUFF_PREFIX_WIDTH);
+				fill = 1 << (DSI_HUFF_PREFIX_WIDTH + subWidths[prefix] - width);
+				start = DSI_HUFF_ENTRY_OFFSET(table[prefix])
+					+ (code & ((1 << (width - DSI_HUFF_PREFIX_WIDTH)) - 1)) * fill;
+			}
+
+			for (i = 0; i < fill; i++) {
+				table[start + i] = DSI_HUFF_ENTRY(alphabet[code + codeOffsets[level]], width);
 			}
 		}
 	}
-	UTIL_VERBOSE_ARR(symbols, prefix, "symbols");
 
-	// Pad with escape value for codes wider than 8 bits.
-	for (; prefix < DSI_HUFF_ALPH_LEN; prefix++) widths[prefix] = DSI_HUFF_WIDTH_ESC;
-	UTIL_VERBOSE_ARR(widths, prefix, "widths");
+#	undef DSI_HUFF_FOR_EACH_CODE
+
+	UTIL_VERBOSE1("  %-10s %d\n\n", "tableLen", tableLen);
 }
 
-// Decode Huffman codes.
-unsigned int dsi_huff_decode(stpk_Context *ctx, const unsigned char *alphabet, const unsigned char *symbols, const unsigned char *widths, const short *codeOffsets, const unsigned short *totalCodes, int delta)
+// Decide whether multi-symbol lookup pays off. Assuming each code's probability
+// is 2^-width, the expected code width must leave room for about two codes per
+// lookup, and the output must be long enough to amortize building the table.
+int dsi_huff_useMulti(stpk_Context *ctx, unsigned int levels, const unsigned char *leafNodesPerLevel)
 {
-	unsigned char readWidth = 8, curWidth = 0, curByte, code, level, curOut = 0;
-	unsigned short curWord = 0;
-	unsigned int progress = 0;
+	unsigned int level, use;
+	uint32_t weight = 0, weightedWidth = 0;
+
+	switch (ctx->format.dsi.multi) {
+		case STPK_FMT_DSI_MULTI_OFF:
+			use = 0;
+			break;
+		case STPK_FMT_DSI_MULTI_ON:
+			use = 1;
+			break;
+		default:
+			// Code probabilities in units of 2^-16.
+			for (level = 0; level < levels; level++) {
+				weight += leafNodesPerLevel[level] << (DSI_HUFF_LEVELS_MAX - 1 - level);
+				weightedWidth += (leafNodesPerLevel[level] << (DSI_HUFF_LEVELS_MAX - 1 - level)) * (level + 1);
+			}
 
-	curWord = (stpk_getHuffByte(ctx) << 8) | stpk_getHuffByte(ctx);
+			use = util_limitLen(ctx) >= DSI_HUFF_MULTI_MIN_LEN
+				&& weight
+				&& weightedWidth <= weight * DSI_HUFF_MULTI_MAX_AVG;
 
-	UTIL_NOVERBOSE("Huffman    [");
+			UTIL_VERBOSE1("  %-10s %.2f\n", "avgWidth", weight ? (float)weightedWidth / weight : 0);
+	}
 
-	UTIL_VERBOSE1("Decoding Huffman codes... \n");
-	UTIL_VERBOSE2("\nsrcOff dstOff rW cW curWord               cd    Description\n");
+	UTIL_VERBOSE1("  %-10s %s\n\n", "multi", use ? "on" : "off");
 
-	while (ctx->dst.offset < ctx->dst.len) {
-		UTIL_VERBOSE2("~~~~~~ ~~~~~~ ~~ ~~ ~~~~~~~~~~~~~~~~~~~~~ ~~    ~~~~~~~~~~~~~~~~~~\n");
+	return use;
+}
 
-		code = (curWord & 0xFF00) >> 8;
-		UTIL_VERBOSE_HUFF("Shifted %d bits", curWidth);
+// Generate multi-symbol lookup table by decoding each index with the two-level
+// table for as long as whole codes fit.
+void dsi_huff_genMulti(stpk_Context *ctx, const dsi_huff_Entry *table, dsi_huff_Entry *multi)
+{
+	unsigned int index, width, count, curWidth;
+	dsi_huff_Entry entry, packed;
 
-		curWidth = widths[code];
+	for (index = 0; index < DSI_HUFF_MULTI_LEN; index++) {
+		packed = 0;
+		width = 0;
 
-		// If code is wider than 8 bits, read more bits and decode with offset table.
-		if (curWidth > DSI_HUFF_PREFIX_WIDTH) {
-			if (curWidth != DSI_HUFF_WIDTH_ESC) {
-				UTIL_ERR("Invalid escape value. curWidth != %02X, got %02X\n", DSI_HUFF_WIDTH_ESC, curWidth);
-				return STPK_RET_ERR;
-			}
+		// Stop once all index bits are used, the shift below would overflow.
+		for (count = 0; count < DSI_HUFF_MULTI_MAX && width < DSI_HUFF_MULTI_WIDTH; count++) {
+			entry = dsi_huff_lookup(table, (uint32_t)index << (32 - DSI_HUFF_MULTI_WIDTH + width));
+			curWidth = DSI_HUFF_ENTRY_WIDTH(entry);
 
-			curByte = (curWord & 0x00FF);
-			curWord >>= DSI_HUFF_PREFIX_WIDTH;
-			UTIL_VERBOSE_HUFF("Escaping to offset table");
-
-			// Read bit by bit until a level is found, starting at the max width of the prefix table.
-			for (level = DSI_HUFF_PREFIX_WIDTH; 1; level++) {
-				if (!readWidth) {
-					curByte = stpk_getHuffByte(ctx);
-					readWidth = 8;
-					UTIL_VERBOSE_HUFF("Read %02X", ctx->src.data[ctx->src.offset - 1]);
-				}
-
-				curWord = (curWord << 1) + UTIL_GET_FLAG(curByte, DSI_HUFF_PREFIX_MSB);
-				curByte <<= 1;
-				readWidth--;
-				UTIL_VERBOSE_HUFF("level = %d", level);
-
-				if (level >= DSI_HUFF_LEVELS_MAX) {
-					UTIL_ERR("Offset table out of bounds (%d >= %d)\n", level, DSI_HUFF_LEVELS_MAX);
-					return STPK_RET_ERR;
-				}
-
-				if (curWord < totalCodes[level]) {
-					curWord += codeOffsets[level];
-
-					if (curWord > 0xFF) {
-						UTIL_ERR("Alphabet index out of bounds (%04X > %04X)\n", curWord, DSI_HUFF_ALPH_LEN);
-						return STPK_RET_ERR;
-					}
-
-					if (delta) {
-						UTIL_VERBOSE_HUFF("Using symbol %02X as delta to previous output %02X", alphabet[curWord], curOut);
-						curOut += alphabet[curWord];
-					}
-					else {
-						curOut = alphabet[curWord];
-					}
-
-					ctx->dst.data[ctx->dst.offset++] = curOut;
-					UTIL_VERBOSE_HUFF("Wrote %02X using offset table", curOut);
-
-					break;
-				}
+			// Stop at invalid codes and codes that do not fit in the remaining bits.
+			if (!curWidth || width + curWidth > DSI_HUFF_MULTI_WIDTH) {
+				break;
 			}
 
-			// Read another byte since the processed code was wider than a byte.
-			curWord = (curByte << readWidth) | stpk_getHuffByte(ctx);
-			curWidth = 8 - readWidth;
-			readWidth = 8;
-			UTIL_VERBOSE_HUFF("Read %02X", ctx->src.data[ctx->src.offset - 1]);
+			packed |= (dsi_huff_Entry)DSI_HUFF_ENTRY_SYMBOL(entry) << (8 * (count + 1));
+			width += curWidth;
 		}
-		// Code is 8 bits wide or less, do direct prefix lookup.
-		else {
-			if (delta) {
-				UTIL_VERBOSE_HUFF("Using symbol %02X as delta to previous output %02X", symbols[code], curOut);
-				curOut += symbols[code];
-			}
-			else {
-				curOut = symbols[code];
-			}
-			ctx->dst.data[ctx->dst.offset++] = curOut;
-			UTIL_VERBOSE_HUFF("Wrote %02X from prefix table", curOut);
 
-			if (readWidth < curWidth) {
-				curWord <<= readWidth;
-				UTIL_VERBOSE_HUFF("Shifted %d bits", readWidth);
+		multi[index] = packed | count << DSI_HUFF_MULTI_COUNT_SHIFT | width;
+	}
+}
 
-				curWidth -= readWidth;
-				readWidth = 8;
+// Number of codes that can be decoded without bounds checks. Each code consumes
+// at most 16 bits and writes at most step bytes, and the reservoir is refilled
+// with whole words while at least 8 bytes of source data are left.
+static inline unsigned int dsi_huff_safeCodes(const bitreader_Reader *br, unsigned int dstLeft, unsigned int step)
+{
+	unsigned int srcBits = bitreader_tell(br) + DSI_HUFF_LEVELS_MAX + 64;
 
-				curWord |= stpk_getHuffByte(ctx);
-				UTIL_VERBOSE_HUFF("Read %02X", ctx->src.data[ctx->src.offset - 1]);
-			}
-		}
+	if (br->offset > br->len || srcBits > br->len * 8) {
+		return 0;
+	}
 
-		curWord <<= curWidth;
-		readWidth -= curWidth;
+	return UTIL_MIN((br->len * 8 - srcBits) / DSI_HUFF_LEVELS_MAX + 1, dstLeft / step);
+}
 
-		if ((ctx->src.offset - 1) > ctx->src.len && ctx->dst.offset < ctx->dst.len) {
-			UTIL_ERR("Reached unexpected end of source buffer while decoding Huffman codes\n");
-			return STPK_RET_ERR;
-		}
+// Decode kernels specialized for bit order, multi-symbol lookup and tracing,
+// indexed by the same options.
+
+#define DSI_HUFF_KERNEL_NAME    dsi_huff_decode000
+#define DSI_HUFF_KERNEL_REVERSE 0
+#define DSI_HUFF_KERNEL_MULTI   0
+#define DSI_HUFF_KERNEL_TRACE   0
+#include "dsi_huff_kernel.h"
+#undef DSI_HUFF_KERNEL_NAME
+#undef DSI_HUFF_KERNEL_REVERSE
+#undef DSI_HUFF_KERNEL_MULTI
+#undef DSI_HUFF_KERNEL_TRACE
+
+#define DSI_HUFF_KERNEL_NAME    dsi_huff_decode001
+#define DSI_HUFF_KERNEL_REVERSE 0
+#define DSI_HUFF_KERNEL_MULTI   0
+#define DSI_HUFF_KERNEL_TRACE   1
+#include "dsi_huff_kernel.h"
+#undef DSI_HUFF_KERNEL_NAME
+#undef DSI_HUFF_KERNEL_REVERSE
+#undef DSI_HUFF_KERNEL_MULTI
+#undef DSI_HUFF_KERNEL_TRACE
+
+#define DSI_HUFF_KERNEL_NAME    dsi_huff_decode010
+#define DSI_HUFF_KERNEL_REVERSE 0
+#define DSI_HUFF_KERNEL_MULTI   1
+#define DSI_HUFF_KERNEL_TRACE   0
+#include "dsi_huff_kernel.h"
+#undef DSI_HUFF_KERNEL_NAME
+#undef DSI_HUFF_KERNEL_REVERSE
+#undef DSI_HUFF_KERNEL_MULTI
+#undef DSI_HUFF_KERNEL_TRACE
+
+#define DSI_HUFF_KERNEL_NAME    dsi_huff_decode011
+#define DSI_HUFF_KERNEL_REVERSE 0
+#define DSI_HUFF_KERNEL_MULTI   1
+#define DSI_HUFF_KERNEL_TRACE   1
+#include "dsi_huff_kernel.h"
+#undef DSI_HUFF_KERNEL_NAME
+#undef DSI_HUFF_KERNEL_REVERSE
+#undef DSI_HUFF_KERNEL_MULTI
+#undef DSI_HUFF_KERNEL_TRACE
+
+#define DSI_HUFF_KERNEL_NAME    dsi_huff_decode100
+#define DSI_HUFF_KERNEL_REVERSE 1
+#define DSI_HUFF_KERNEL_MULTI   0
+#define DSI_HUFF_KERNEL_TRACE   0
+#include "dsi_huff_kernel.h"
+#undef DSI_HUFF_KERNEL_NAME
+#undef DSI_HUFF_KERNEL_REVERSE
+#undef DSI_HUFF_KERNEL_MULTI
+#undef DSI_HUFF_KERNEL_TRACE
+
+#define DSI_HUFF_KERNEL_NAME    dsi_huff_decode101
+#define DSI_HUFF_KERNEL_REVERSE 1
+#define DSI_HUFF_KERNEL_MULTI   0
+#define DSI_HUFF_KERNEL_TRACE   1
+#include "dsi_huff_kernel.h"
+#undef DSI_HUFF_KERNEL_NAME
+#undef DSI_HUFF_KERNEL_REVERSE
+#undef DSI_HUFF_KERNEL_MULTI
+#undef DSI_HUFF_KERNEL_TRACE
+
+#define DSI_HUFF_KERNEL_NAME    dsi_huff_decode110
+#define DSI_HUFF_KERNEL_REVERSE 1
+#define DSI_HUFF_KERNEL_MULTI   1
+#define DSI_HUFF_KERNEL_TRACE   0
+#include "dsi_huff_kernel.h"
+#undef DSI_HUFF_KERNEL_NAME
+#undef DSI_HUFF_KERNEL_REVERSE
+#undef DSI_HUFF_KERNEL_MULTI
+#undef DSI_HUFF_KERNEL_TRACE
+
+#define DSI_HUFF_KERNEL_NAME    dsi_huff_decode111
+#define DSI_HUFF_KERNEL_REVERSE 1
+#define DSI_HUFF_KERNEL_MULTI   1
+#define DSI_HUFF_KERNEL_TRACE   1
+#include "dsi_huff_kernel.h"
+#undef DSI_HUFF_KERNEL_NAME
+#undef DSI_HUFF_KERNEL_REVERSE
+#undef DSI_HUFF_KERNEL_MULTI
+#undef DSI_HUFF_KERNEL_TRACE
+
+typedef unsigned int (*dsi_huff_Kernel)(stpk_Context *ctx, const dsi_huff_Entry *table, const dsi_huff_Entry *multi, bitreader_Reader *reader);
+
+static const dsi_huff_Kernel dsi_huff_kernels[2][2][2] = {
+	{ { dsi_huff_decode000, dsi_huff_decode001 }, { dsi_huff_decode010, dsi_huff_decode011 } },
+	{ { dsi_huff_decode100, dsi_huff_decode101 }, { dsi_huff_decode110, dsi_huff_decode111 } }
+};
+
+// Decode Huffman codes with the kernel matching the format version, lookup
+// tables and verbosity. Tracing is only compiled into the verbose kernels,
+// which also run when a trace is recorded. Data
+// left is only checked if the whole pass is decoded.
+unsigned int dsi_huff_decode(stpk_Context *ctx, const dsi_huff_Entry *table, const dsi_huff_Entry *multi, int whole)
+{
+	unsigned int retval, srcOffset = ctx->src.offset;
+	int reverse = ctx->format.dsi.version == STPK_FMT_DSI_VER_1;
+	bitreader_Reader br;
 
-		// Progress bar.
-		if (ctx->verbosity && (ctx->verbosity < 3) && ((ctx->dst.offset * 100) / ctx->dst.len) >= (progress * 10)) {
-			ctx->logCallback(STPK_LOG_INFO, "%4d%%", progress++ * 10);
-		}
+	bitreader_init(&br, ctx->src.data, ctx->src.offset, ctx->src.len, reverse);
+
+	UTIL_NOVERBOSE("Huffman    [");
+
+	UTIL_VERBOSE1("Decoding Huffman codes... \n");
+
+	retval = dsi_huff_kernels[reverse][multi != NULL][ctx->verbosity > 0 || TRACE_ON(ctx)](ctx, table, multi, &br);
+
+	if (retval) {
+		return retval;
 	}
 
 	UTIL_NOVERBOSE("]\n");
 	UTIL_VERBOSE1("\n");
 
+	return whole ? dsi_huff_finish(ctx, &br, srcOffset) : STPK_RET_OK;
+}
+
+// Decode the next len bytes of a pass opened by dsi_huff_open() into dst, which
+// must have room for DSI_HUFF_MULTI_MAX - 1 bytes more. Chunks are decoded
+// without tracing.
+unsigned int dsi_huff_read(stpk_Context *ctx, dsi_huff_Stream *hs, unsigned char *dst, unsigned int len)
+{
+	stpk_Context chunk = *ctx;
+
+	len = UTIL_MIN(len, hs->len - hs->offset);
+
+	chunk.src = hs->src;
+	chunk.dst.data = dst;
+	chunk.dst.offset = 0;
+	chunk.dst.len = len;
+
+	hs->retval = dsi_huff_kernels[hs->br.reverse][hs->multi != NULL][0](&chunk, hs->table, hs->multi, &hs->br);
+
+	if (hs->delta && hs->retval != STPK_RET_ERR) {
+		hs->sum = util_prefixSum(dst, len, hs->sum);
+	}
+
+	hs->offset += len;
+
+	return hs->retval;
+}
+
+// Finish a pass decoded by dsi_huff_read() and check for data left.
+unsigned int dsi_huff_end(stpk_Context *ctx, dsi_huff_Stream *hs)
+{
+	stpk_Context pass = *ctx;
+
+	pass.src = hs->src;
+
+	hs->retval = dsi_huff_finish(&pass, &hs->br, hs->src.offset);
+	hs->src.offset = pass.src.offset;
+
+	return hs->retval;
+}
+
+// Report source offset as if the bit stream was consumed with one byte of
+// look-ahead, and warn about data left after it.
+unsigned int dsi_huff_finish(stpk_Context *ctx, const bitreader_Reader *br, unsigned int srcOffset)
+{
+	ctx->src.offset = srcOffset + UTIL_MAX(2, (bitreader_tell(br) - srcOffset * 8 + 7) / 8 + 1);
+
 	if (ctx->src.offset < ctx->src.len) {
 		UTIL_WARN("Huffman decoding finished with unprocessed data left in source buffer (%d bytes left)\n", ctx->src.len - ctx->src.offset);
 		return STPK_RET_ERR_DATA_LEFT;
@@ -254,20 +494,67 @@ unsigned int dsi_huff_decode(stpk_Context *ctx, const unsigned char *alphabet, c
 	return STPK_RET_OK;
 }
 
-// Read a byte from the Huffman code bit stream, reverse bits if game version is Brøderbund Stunts 1.0.
-inline unsigned char stpk_getHuffByte(stpk_Context *ctx)
+// Open a Huffman pass of len bytes at the read offset of a stream, where its
+// whole header is buffered.
+unsigned int dsi_huff_streamOpen(stpk_Context *ctx, dsi_huff_Stream *hs, stream_Buffer *in, unsigned int len)
 {
-	// https://graphics.stanford.edu/~seander/bithacks.html#BitReverseTable
-	static const unsigned char reverseBits[] = {
-#		define R2(n)   (n),   (n + 2 * 64),   (n + 1 * 64),   (n + 3 * 64)
-#		define R4(n) R2(n), R2(n + 2 * 16), R2(n + 1 * 16), R2(n + 3 * 16)
-#		define R6(n) R4(n), R4(n + 2 *  4), R4(n + 1 *  4), R4(n + 3 *  4)
-		R6(0), R6(2), R6(1), R6(3)
-	};
-
-	unsigned char byte = ctx->src.data[ctx->src.offset++];
-	if (ctx->format.dsi.version == STPK_FMT_DSI_VER_1) {
-		byte = reverseBits[byte];
+	stpk_Context pass = *ctx;
+
+	pass.src.data = in->data;
+	pass.src.offset = in->offset;
+	pass.src.len = in->len;
+	pass.dst.len = len;
+
+	if (dsi_huff_open(&pass, hs)) {
+		return 1;
 	}
-	return byte;
+
+	in->offset = hs->src.offset;
+	hs->start = stream_tell(in, in->offset);
+
+	return 0;
+}
+
+// Decode the next chunk of a Huffman pass from a stream into the free part of
+// out. Until the end of the stream, only as many codes are decoded as can be
+// read without refilling the bit reservoir past the buffered source, which
+// would read the missing bytes as zero. Bytes loaded into the reservoir are
+// consumed from the source.
+unsigned int dsi_huff_streamRead(stpk_Context *ctx, dsi_huff_Stream *hs, stream_Buffer *in, stream_Buffer *out)
+{
+	unsigned int len = UTIL_MIN(out->size - out->len, hs->len - hs->offset), bits, used;
+
+	// The source may have been compacted since the last read.
+	hs->br.offset -= hs->src.offset - in->offset;
+	hs->br.data = hs->src.data = in->data;
+	hs->br.len = hs->src.len = in->len;
+
+	// Each code takes at most 16 bits, and the last refill loads a whole word.
+	if (!in->end) {
+		bits = (in->len - hs->br.offset) * 8 + hs->br.count;
+		len = bits > 64 ? UTIL_MIN(len, (bits - 64) / DSI_HUFF_LEVELS_MAX) : 0;
+	}
+
+	if (len) {
+		if (dsi_huff_read(ctx, hs, out->data + out->len, len) == STPK_RET_ERR) {
+			return 1;
+		}
+
+		out->len += len;
+		out->total += len;
+	}
+
+	in->offset = hs->src.offset = UTIL_MIN(hs->br.offset, in->len);
+
+	// Check for data left like dsi_huff_finish(), as far as it is buffered.
+	if (hs->offset == hs->len) {
+		out->end = 1;
+
+		used = hs->start + UTIL_MAX(2, ((stream_tell(in, hs->br.offset) - hs->start) * 8 - hs->br.count + 7) / 8 + 1);
+		if (used < in->total) {
+			UTIL_WARN("Huffman decoding finished with unprocessed data left in source buffer (%d bytes left)\n", in->total - used);
+		}
+	}
+
+	return 0;
 }
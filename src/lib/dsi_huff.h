@@ -20,8 +20,12 @@
 #ifndef STPK_LIB_DSI_HUFF_H
 #define STPK_LIB_DSI_HUFF_H
 
+#include <stdint.h>
 #include <stunpack.h>
 
+#include "bitreader.h"
+#include "stream.h"
+
 #define DSI_HUFF_LEVELS_MASK  0x7F
 #define DSI_HUFF_LEVELS_MAX   0x10
 #define DSI_HUFF_LEVELS_DELTA 0x80
@@ -32,10 +36,84 @@
 #define DSI_HUFF_PREFIX_MSB   (1 << (DSI_HUFF_PREFIX_WIDTH - 1))
 #define DSI_HUFF_WIDTH_ESC    0x40
 
+// Codes wider than the prefix table escape to a second level table indexed by
+// the remaining bits. Leaves at each level use the lowest codes, so the second
+// level tables for all prefixes never exceed alphabet length + 2^2 + ... + 2^9.
+#define DSI_HUFF_TABLE_LEN    (DSI_HUFF_PREFIX_LEN + DSI_HUFF_ALPH_LEN + 0x3FC)
+
+// Lookup table entry with symbol and code width packed together:
+//   bits  0-7   code width, DSI_HUFF_WIDTH_ESC for escapes or 0 for invalid codes
+//   bits  8-15  symbol, or second level table index width for escapes
+//   bits 16-31  second level table offset for escapes
+typedef uint32_t dsi_huff_Entry;
+
+#define DSI_HUFF_ENTRY(symbol, width)        ((dsi_huff_Entry)(symbol) << 8 | (width))
+#define DSI_HUFF_ENTRY_ESC(offset, subWidth) ((dsi_huff_Entry)(offset) << 16 | (subWidth) << 8 | DSI_HUFF_WIDTH_ESC)
+#define DSI_HUFF_ENTRY_WIDTH(entry)          ((entry) & 0xFF)
+#define DSI_HUFF_ENTRY_SYMBOL(entry)         (((entry) >> 8) & 0xFF)
+#define DSI_HUFF_ENTRY_OFFSET(entry)         ((entry) >> 16)
+
+// Multi-symbol lookup table indexed by the next 11 bits, where each entry
+// holds as many whole codes as fit, up to three:
+//   bits  0-4   total width of the codes
+//   bits  5-6   number of symbols, 0 if the first code is wider than the index
+//   bits  8-31  symbols in stream order
+#define DSI_HUFF_MULTI_WIDTH  0x0B
+#define DSI_HUFF_MULTI_LEN    (1 << DSI_HUFF_MULTI_WIDTH)
+#define DSI_HUFF_MULTI_MAX    3
+
+#define DSI_HUFF_MULTI_WIDTH_MASK         0x1F
+#define DSI_HUFF_MULTI_COUNT_SHIFT        5
+#define DSI_HUFF_MULTI_ENTRY_COUNT(entry) (((entry) >> DSI_HUFF_MULTI_COUNT_SHIFT) & 0x03)
+#define DSI_HUFF_MULTI_ENTRY_SYMBOL(entry, i) (((entry) >> (8 * ((i) + 1))) & 0xFF)
+
+// Minimum output length and maximum expected code width for automatically
+// choosing multi-symbol decoding. Break-even is between 6 and 7 bits.
+#define DSI_HUFF_MULTI_MIN_LEN    (DSI_HUFF_MULTI_LEN * 4)
+#define DSI_HUFF_MULTI_MAX_AVG    6
+
+// Huffman pass decoded a chunk at a time, for streaming its output into the
+// next pass without holding all of it in memory. When read from a stream, the
+// source buffer is updated to the stream buffer by each read.
+typedef struct {
+	stpk_Buffer      src;      // Source buffer, offset at the start of the bit stream.
+	dsi_huff_Entry   *table;
+	dsi_huff_Entry   *multi;
+	bitreader_Reader br;
+	unsigned int     len;      // Decoded length of the pass.
+	unsigned int     offset;   // Bytes decoded so far.
+	int              delta;
+	unsigned char    sum;      // Running sum of delta coded output.
+	unsigned int     retval;   // Result of the last chunk.
+	unsigned int     start;    // Stream position of the bit stream.
+} dsi_huff_Stream;
+
 int dsi_huff_isValid(stpk_Buffer *buf, unsigned int offset);
+unsigned int dsi_huff_headerLen(const unsigned char *data, unsigned int len);
 unsigned int dsi_huff_decompress(stpk_Context *ctx);
-unsigned int dsi_huff_genOffsets(stpk_Context *ctx, unsigned int levels, const unsigned char *leafNodesPerLevel, short *codeOffsets, unsigned short *totalCodes);
-void dsi_huff_genPrefix(stpk_Context *ctx, unsigned int levels, const unsigned char *leafNodesPerLevel, const unsigned char *alphabet, unsigned char *symbols, unsigned char *widths);
-unsigned int dsi_huff_decode(stpk_Context *ctx, const unsigned char *alphabet, const unsigned char *symbols, const unsigned char *widths, const short *codeOffsets, const unsigned short *totalCodes, int delta);
+unsigned int dsi_huff_open(stpk_Context *ctx, dsi_huff_Stream *hs);
+unsigned int dsi_huff_read(stpk_Context *ctx, dsi_huff_Stream *hs, unsigned char *dst, unsigned int len);
+unsigned int dsi_huff_end(stpk_Context *ctx, dsi_huff_Stream *hs);
+void dsi_huff_close(stpk_Context *ctx, dsi_huff_Stream *hs);
+unsigned int dsi_huff_streamOpen(stpk_Context *ctx, dsi_huff_Stream *hs, stream_Buffer *in, unsigned int len);
+unsigned int dsi_huff_streamRead(stpk_Context *ctx, dsi_huff_Stream *hs, stream_Buffer *in, stream_Buffer *out);
+unsigned int dsi_huff_genOffsets(stpk_Context *ctx, unsigned int levels, const unsigned char *leafNodesPerLevel, int *codeOffsets, unsigned int *totalCodes);
+void dsi_huff_genPrefix(stpk_Context *ctx, unsigned int levels, const unsigned char *alphabet, const int *codeOffsets, const unsigned int *totalCodes, dsi_huff_Entry *table);
+int dsi_huff_useMulti(stpk_Context *ctx, unsigned int levels, const unsigned char *leafNodesPerLevel);
+void dsi_huff_genMulti(stpk_Context *ctx, const dsi_huff_Entry *table, dsi_huff_Entry *multi);
+unsigned int dsi_huff_decode(stpk_Context *ctx, const dsi_huff_Entry *table, const dsi_huff_Entry *multi, int whole);
+unsigned int dsi_huff_finish(stpk_Context *ctx, const bitreader_Reader *br, unsigned int srcOffset);
+
+// Look up the code starting at the MSB of the given bits.
+static inline dsi_huff_Entry dsi_huff_lookup(const dsi_huff_Entry *table, uint32_t bits)
+{
+	dsi_huff_Entry entry = table[bits >> (32 - DSI_HUFF_PREFIX_WIDTH)];
+
+	if (DSI_HUFF_ENTRY_WIDTH(entry) == DSI_HUFF_WIDTH_ESC) {
+		entry = table[DSI_HUFF_ENTRY_OFFSET(entry) + ((bits << DSI_HUFF_PREFIX_WIDTH) >> (32 - DSI_HUFF_ENTRY_SYMBOL(entry)))];
+	}
+
+	return entry;
+}
 
 #endif
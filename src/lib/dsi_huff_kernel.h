@@ -0,0 +1,172 @@
+/*
+ * stunpack - Stunts/4D [Sports] Driving game resource unpacker
+ * Copyright (C) 2008-2024 Daniel Stien <daniel@stien.org>
+ *  
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ * 
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ * 
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software 
+ * Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA 02111-1307, USA.
+ */
+
+// Huffman decode kernel template. Included by dsi_huff.c once for each
+// combination of the following options, which must be defined as 0 or 1:
+//   DSI_HUFF_KERNEL_REVERSE  reverse bit order of each byte (DSI1)
+//   DSI_HUFF_KERNEL_MULTI    look up several symbols in the multi-symbol table
+//   DSI_HUFF_KERNEL_TRACE    record trace events and show progress bar
+// DSI_HUFF_KERNEL_NAME is the name of the generated function.
+
+#if DSI_HUFF_KERNEL_TRACE
+#	define DSI_HUFF_KERNEL_EVENT(type, len, value) TRACE_EVENT(ctx, (type), br.offset, dstOffset, \
+					(unsigned short)(br.bits >> 48), (len), br.count, curWidth, (value))
+#else
+#	define DSI_HUFF_KERNEL_EVENT(type, len, value)
+#endif
+
+#if DSI_HUFF_KERNEL_MULTI
+#	define DSI_HUFF_KERNEL_STEP DSI_HUFF_MULTI_MAX
+#else
+#	define DSI_HUFF_KERNEL_STEP 1
+#endif
+
+static unsigned int DSI_HUFF_KERNEL_NAME(stpk_Context *ctx, const dsi_huff_Entry *table, const dsi_huff_Entry *multi, bitreader_Reader *reader)
+{
+	unsigned char curWidth = 0, code, *dst = ctx->dst.data;
+	unsigned int srcBits = ctx->src.len * 8, dstOffset = ctx->dst.offset, dstLen = ctx->dst.len, safe;
+	dsi_huff_Entry entry;
+	bitreader_Reader br = *reader;
+#if DSI_HUFF_KERNEL_MULTI
+	unsigned char count;
+#endif
+#if DSI_HUFF_KERNEL_TRACE
+	unsigned int progress = 0, progressOffset = 0;
+
+	TRACE_HEADER(STPK_TRACE_HUFF_SYMBOL);
+#endif
+
+	while (dstOffset < dstLen) {
+#if DSI_HUFF_KERNEL_TRACE
+		// Progress bar.
+		if (dstOffset >= progressOffset) {
+			progressOffset = util_progress(ctx, &progress, 10, dstOffset, dstLen);
+		}
+#endif
+
+		// Fast loop without bounds checks.
+		safe = dsi_huff_safeCodes(&br, dstLen - dstOffset, DSI_HUFF_KERNEL_STEP);
+#if DSI_HUFF_KERNEL_TRACE
+		// Stop at the next progress bar mark, and trace every code in the careful loop.
+		safe = TRACE_ON(ctx) ? 0 : UTIL_MIN(safe, (progressOffset - dstOffset + DSI_HUFF_KERNEL_STEP - 1) / DSI_HUFF_KERNEL_STEP);
+#endif
+
+		for (; safe; safe--) {
+			if (br.count < DSI_HUFF_LEVELS_MAX) {
+				bitreader_refillFast(&br, DSI_HUFF_KERNEL_REVERSE);
+			}
+
+#if DSI_HUFF_KERNEL_MULTI
+			entry = multi[bitreader_peek(&br, DSI_HUFF_MULTI_WIDTH)];
+			if (DSI_HUFF_MULTI_ENTRY_COUNT(entry)) {
+				dst[dstOffset + 0] = DSI_HUFF_MULTI_ENTRY_SYMBOL(entry, 0);
+				dst[dstOffset + 1] = DSI_HUFF_MULTI_ENTRY_SYMBOL(entry, 1);
+				dst[dstOffset + 2] = DSI_HUFF_MULTI_ENTRY_SYMBOL(entry, 2);
+				dstOffset += DSI_HUFF_MULTI_ENTRY_COUNT(entry);
+				bitreader_consume(&br, entry & DSI_HUFF_MULTI_WIDTH_MASK);
+				continue;
+			}
+#endif
+
+			entry = table[bitreader_peek(&br, DSI_HUFF_PREFIX_WIDTH)];
+			if (DSI_HUFF_ENTRY_WIDTH(entry) == DSI_HUFF_WIDTH_ESC) {
+				entry = table[DSI_HUFF_ENTRY_OFFSET(entry)
+					+ (bitreader_peek(&br, DSI_HUFF_PREFIX_WIDTH + DSI_HUFF_ENTRY_SYMBOL(entry)) & ((1 << DSI_HUFF_ENTRY_SYMBOL(entry)) - 1))];
+			}
+
+			// Leave invalid codes to the careful loop for reporting.
+			if (!DSI_HUFF_ENTRY_WIDTH(entry)) {
+				break;
+			}
+
+			dst[dstOffset++] = DSI_HUFF_ENTRY_SYMBOL(entry);
+			bitreader_consume(&br, DSI_HUFF_ENTRY_WIDTH(entry));
+		}
+
+		if (dstOffset >= dstLen) {
+			break;
+		}
+
+		// Careful loop decoding a single code with bounds checks.
+
+		// Keep enough bits in the reservoir for the widest code.
+		if (br.count < DSI_HUFF_LEVELS_MAX) {
+			bitreader_refillOrder(&br, DSI_HUFF_KERNEL_REVERSE);
+			DSI_HUFF_KERNEL_EVENT(STPK_TRACE_HUFF_REFILL, 0, 0);
+		}
+
+		code = bitreader_peek(&br, DSI_HUFF_PREFIX_WIDTH);
+
+#if DSI_HUFF_KERNEL_MULTI
+		// Emit several symbols from one lookup if they fit. All three are
+		// written, the destination buffer is padded for the excess.
+		if ((count = DSI_HUFF_MULTI_ENTRY_COUNT(entry = multi[bitreader_peek(&br, DSI_HUFF_MULTI_WIDTH)]))
+			&& count <= dstLen - dstOffset
+		) {
+			dst[dstOffset + 0] = DSI_HUFF_MULTI_ENTRY_SYMBOL(entry, 0);
+			dst[dstOffset + 1] = DSI_HUFF_MULTI_ENTRY_SYMBOL(entry, 1);
+			dst[dstOffset + 2] = DSI_HUFF_MULTI_ENTRY_SYMBOL(entry, 2);
+			dstOffset += count;
+			curWidth = entry & DSI_HUFF_MULTI_WIDTH_MASK;
+			DSI_HUFF_KERNEL_EVENT(STPK_TRACE_HUFF_MULTI, count, DSI_HUFF_MULTI_ENTRY_SYMBOL(entry, 0));
+		}
+		else
+#endif
+		{
+			entry = table[code];
+			curWidth = DSI_HUFF_ENTRY_WIDTH(entry);
+
+			// If code is wider than 8 bits, look up the remaining bits in the second level table.
+			if (curWidth == DSI_HUFF_WIDTH_ESC) {
+				DSI_HUFF_KERNEL_EVENT(STPK_TRACE_HUFF_ESCAPE, 0, 0);
+				entry = table[DSI_HUFF_ENTRY_OFFSET(entry)
+					+ (bitreader_peek(&br, DSI_HUFF_PREFIX_WIDTH + DSI_HUFF_ENTRY_SYMBOL(entry)) & ((1 << DSI_HUFF_ENTRY_SYMBOL(entry)) - 1))];
+				curWidth = DSI_HUFF_ENTRY_WIDTH(entry);
+			}
+
+			if (!curWidth) {
+				UTIL_ERR("Invalid Huffman code at bit offset %d\n", bitreader_tell(&br) - ctx->src.offset * 8);
+				return STPK_RET_ERR;
+			}
+
+			dst[dstOffset++] = DSI_HUFF_ENTRY_SYMBOL(entry);
+			DSI_HUFF_KERNEL_EVENT(STPK_TRACE_HUFF_SYMBOL, 0, DSI_HUFF_ENTRY_SYMBOL(entry));
+		}
+
+		bitreader_consume(&br, curWidth);
+
+		// Bytes beyond the source buffer are read as zero, but codes may not be.
+		if (br.offset > br.len && bitreader_tell(&br) > srcBits && dstOffset < dstLen) {
+			UTIL_ERR("Reached unexpected end of source buffer while decoding Huffman codes\n");
+			return STPK_RET_ERR;
+		}
+	}
+
+#if DSI_HUFF_KERNEL_TRACE
+	util_progress(ctx, &progress, 10, dstOffset, dstLen);
+#endif
+
+	*reader = br;
+	ctx->dst.offset = dstOffset;
+
+	return STPK_RET_OK;
+}
+
+#undef DSI_HUFF_KERNEL_EVENT
+#undef DSI_HUFF_KERNEL_STEP
@@ -17,12 +17,21 @@
  * Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA 02111-1307, USA.
  */
 
+#include <errno.h>
+#include <string.h>
+
+#if defined(__SSE2__)
+#	include <emmintrin.h>
+#endif
+
 #include "dsi.h"
+#include "trace.h"
 #include "util.h"
 
 #include "dsi_rle.h"
 
-inline unsigned int dsi_rle_repeatByte(stpk_Context *ctx, unsigned char cur, unsigned int rep);
+static inline unsigned int dsi_rle_readRun(const unsigned char *src, unsigned int *srcOffset, unsigned char type, unsigned char *cur);
+static inline unsigned int dsi_rle_repeatByte(stpk_Context *ctx, unsigned int dstOffset, unsigned char cur, unsigned int rep);
 
 // Check if data at given offset is a likely RLE header:
 // - Type is RLE
@@ -36,23 +45,35 @@ int dsi_rle_isValid(stpk_Buffer *buf, unsigned int offset)
 		&& (buf->data[offset + 8] & DSI_RLE_ESCLEN_MASK) <= DSI_RLE_ESCLEN_MAX;
 }
 
-// Decompress run-length encoded sub-file.
-unsigned int dsi_rle_decompress(stpk_Context *ctx)
+// Get the length of the run-length header at the start of data, or as much of
+// it as can be told from the first len bytes.
+unsigned int dsi_rle_headerLen(const unsigned char *data, unsigned int len)
+{
+	if (len < DSI_RLE_HEADER_MIN) {
+		return DSI_RLE_HEADER_MIN;
+	}
+
+	return DSI_RLE_HEADER_MIN + UTIL_MIN(data[DSI_RLE_HEADER_MIN - 1] & DSI_RLE_ESCLEN_MASK, DSI_RLE_ESCLEN_MAX);
+}
+
+// Read run-length header and generate escape code lookup table where the index
+// is the escape code and the value is the escape code's positional property.
+static unsigned int dsi_rle_readHeader(stpk_Context *ctx, stpk_Buffer *src, unsigned char *escLookup, int *seqEsc)
 {
-	unsigned int srcLen, dstLen, i;
-	unsigned char unk, escLen, esc[DSI_RLE_ESCLEN_MAX], escLookup[DSI_RLE_ESCLOOKUP_LEN];
+	unsigned int srcLen, i;
+	unsigned char unk, escLen, esc[DSI_RLE_ESCLEN_MAX];
 
-	srcLen = dsi_readLength(&ctx->src);
+	srcLen = dsi_readLength(src);
 	UTIL_VERBOSE1("  %-10s %d\n", "srcLen", srcLen);
 
-	unk = ctx->src.data[ctx->src.offset++];
+	unk = src->data[src->offset++];
 	UTIL_VERBOSE1("  %-10s %02X\n", "unk", unk);
 
 	if (unk) {
 		UTIL_WARN("Unknown RLE header field (unk) is %02X, expected 0\n", unk);
 	}
 
-	escLen = ctx->src.data[ctx->src.offset++];
+	escLen = src->data[src->offset++];
 	UTIL_VERBOSE1("  %-10s %d (no sequences = %d)\n\n", "escLen", escLen & DSI_RLE_ESCLEN_MASK, UTIL_GET_FLAG(escLen, DSI_RLE_ESCLEN_NOSEQ));
 
 	if ((escLen & DSI_RLE_ESCLEN_MASK) > DSI_RLE_ESCLEN_MAX) {
@@ -61,200 +82,759 @@ unsigned int dsi_rle_decompress(stpk_Context *ctx)
 	}
 
 	// Read escape codes.
-	for (i = 0; i < (escLen & DSI_RLE_ESCLEN_MASK); i++) esc[i] = ctx->src.data[ctx->src.offset++];
+	for (i = 0; i < (escLen & DSI_RLE_ESCLEN_MASK); i++) esc[i] = src->data[src->offset++];
 	UTIL_VERBOSE_ARR(esc, escLen & DSI_RLE_ESCLEN_MASK, "esc");
 
-	if (ctx->src.offset > ctx->src.len) {
+	if (src->offset > src->len) {
 		UTIL_ERR("Reached end of source buffer while parsing run-length header\n");
 		return 1;
 	}
 
-	// Generate escape code lookup table where the index is the escape code
-	// and the value is the escape code's positional property.
 	for (i = 0; i < DSI_RLE_ESCLOOKUP_LEN; i++) escLookup[i] = 0;
 	for (i = 0; i < (escLen & DSI_RLE_ESCLEN_MASK); i++) escLookup[esc[i]] = i + 1;
 	UTIL_VERBOSE_ARR(escLookup, DSI_RLE_ESCLOOKUP_LEN, "escLookup");
 
+	// Sequence runs are expanded while decoding single-byte runs.
+	*seqEsc = !UTIL_GET_FLAG(escLen, DSI_RLE_ESCLEN_NOSEQ) && (escLen & DSI_RLE_ESCLEN_MASK) > DSI_RLE_ESCSEQ_POS
+		? esc[DSI_RLE_ESCSEQ_POS]
+		: DSI_RLE_NOSEQ;
+
+	return 0;
+}
+
+// Decompress run-length encoded sub-file.
+unsigned int dsi_rle_decompress(stpk_Context *ctx, dsi_rle_Window *window, int inPlace)
+{
+	unsigned char escLookup[DSI_RLE_ESCLOOKUP_LEN];
+	int seqEsc;
+
+	if (dsi_rle_readHeader(ctx, &ctx->src, escLookup, &seqEsc)) {
+		return 1;
+	}
+
 	UTIL_NOVERBOSE("Run-length ");
 
-	// Decode sequence run as a separate pass.
-	if (!UTIL_GET_FLAG(escLen, DSI_RLE_ESCLEN_NOSEQ)) {
-		if (dsi_rle_decodeSeq(ctx, esc[DSI_RLE_ESCSEQ_POS])) {
+	return dsi_rle_decodeRuns(ctx, escLookup, seqEsc, window, inPlace);
+}
+
+// Check sequence runs from the given source offset, and sum up the length of
+// the single-byte run token stream they expand to together with the bytes
+// between them.
+unsigned int dsi_rle_scanSeq(stpk_Context *ctx, unsigned int offset, int seqEsc, unsigned int *tokensLen)
+{
+	const unsigned char *src = ctx->src.data, *seqStart, *seqEnd;
+	unsigned int len = ctx->src.len, seqLen, rep;
+
+	*tokensLen = 0;
+
+	while (offset < len) {
+		if (seqEsc == DSI_RLE_NOSEQ || (seqStart = (const unsigned char*)memchr(src + offset, seqEsc, len - offset)) == NULL) {
+			seqStart = src + len;
+		}
+
+		*tokensLen += seqStart - (src + offset);
+		offset = seqStart - src + 1;
+
+		// Without sequence runs there is no token stream to fit in the output.
+		if (seqEsc != DSI_RLE_NOSEQ && *tokensLen > ctx->dst.len) {
+			UTIL_ERR("Reached end of temporary buffer while writing non-RLE byte\n");
+			return 1;
+		}
+
+		if (offset > len) {
+			break;
+		}
+
+		// Sequence end escape code must be followed by the repetition count.
+		if (offset >= len || (seqEnd = (const unsigned char*)memchr(src + offset, seqEsc, len - offset - 1)) == NULL) {
+			UTIL_ERR("Reached end of source buffer before finding sequence end escape code %02X\n", seqEsc);
 			return 1;
 		}
 
-		srcLen = ctx->dst.offset;
-		dstLen = ctx->dst.len;
-		util_dst2src(ctx);
-		ctx->src.len = srcLen;
-		ctx->dst.len = dstLen;
+		seqLen = seqEnd - (src + offset);
+		rep = seqEnd[1];
+		offset += seqLen + 2;
 
-		if (util_allocDst(ctx)) {
+		// A repetition count of 0 wraps around to an endless sequence.
+		if (seqLen && (!rep || rep > (ctx->dst.len - *tokensLen) / seqLen)) {
+			UTIL_ERR("Reached end of temporary buffer while writing repeated sequence\n");
 			return 1;
 		}
+
+		*tokensLen += seqLen * rep;
 	}
 
-	return dsi_rle_decodeOne(ctx, escLookup);
+	return 0;
 }
 
-// Decode sequence runs.
-unsigned int dsi_rle_decodeSeq(stpk_Context *ctx, unsigned char esc)
+// Start reading a sequence run at the reader's source offset. Returns 1 if the
+// sequence end is not within the source buffer, which only happens for windows
+// as other sources are checked by dsi_rle_scanSeq().
+static inline unsigned int dsi_rle_readSeq(dsi_rle_Reader *rd)
 {
-	unsigned char cur;
-	unsigned int progress = 0, seqOffset, rep, i;
+	const unsigned char *seqEnd;
+
+	if (rd->offset >= rd->len
+		|| (seqEnd = (const unsigned char*)memchr(rd->src + rd->offset, rd->seqEsc, rd->len - rd->offset - 1)) == NULL
+	) {
+		return 1;
+	}
+
+	rd->seq = rd->src + rd->offset;
+	rd->seqLen = seqEnd - rd->seq;
+	rd->seqPos = 0;
+	rd->seqRep = rd->seqLen ? seqEnd[1] : 0;
+	rd->offset += rd->seqLen + 2;
+
+	return 0;
+}
+
+// Check a sequence run as it is read, like dsi_rle_scanSeq() does up front
+// when the whole source is decoded from a buffer.
+static inline unsigned int dsi_rle_checkSeq(stpk_Context *ctx, const dsi_rle_Reader *rd)
+{
+	if (rd->passLen && rd->seqLen && (!rd->seqRep || rd->seqRep > rd->passLen / rd->seqLen)) {
+		UTIL_ERR("Reached end of temporary buffer while writing repeated sequence\n");
+		return 1;
+	}
+
+	return 0;
+}
+
+// Check if a window has more of the source left to decode.
+static inline int dsi_rle_more(const dsi_rle_Reader *rd)
+{
+	return rd->window != NULL && rd->base + rd->len < rd->total;
+}
+
+// Move the unread part of a window, including the pattern of the current
+// sequence run, to its start and decode more of the source after it. The window
+// is doubled if the unread part takes up more than half of it.
+static unsigned int dsi_rle_refill(stpk_Context *ctx, dsi_rle_Reader *rd)
+{
+	dsi_rle_Window *window = rd->window;
+	unsigned int keep = rd->seqRep ? (unsigned int)(rd->seq - rd->src) : rd->offset;
+	unsigned int left = rd->len - keep, len;
+	unsigned char *data;
+
+	if (left > window->size / 2) {
+		if ((data = (unsigned char*)util_alloc(ctx, sizeof(unsigned char) * (window->size * 2 + UTIL_DST_PADDING))) == NULL) {
+			UTIL_ERR("Error allocating memory for run-length source window. (%s)\n", strerror(errno));
+			return 1;
+		}
+		memcpy(data, rd->src + keep, left);
+		util_dealloc(ctx, window->data);
+		window->data = data;
+		window->size *= 2;
+	}
+	else {
+		memmove(window->data, rd->src + keep, left);
+	}
+
+	len = UTIL_MIN(window->size - left, rd->total - rd->base - rd->len);
+	if (window->fill(ctx, window->source, window->data + left, len)) {
+		return 1;
+	}
+
+	if (rd->seqRep) {
+		rd->seq = window->data;
+	}
+	rd->src = window->data;
+	rd->base += keep;
+	rd->offset -= keep;
+	rd->len = left + len;
+
+	return 0;
+}
+
+// Read the next byte of the single-byte run token stream, expanding sequence
+// runs and refilling windows. Returns 1 at the end of the source buffer.
+static inline unsigned int dsi_rle_readToken(stpk_Context *ctx, dsi_rle_Reader *rd, unsigned char *cur)
+{
+	while (!rd->seqRep) {
+		if (rd->offset < rd->len) {
+			*cur = rd->src[rd->offset++];
+
+			if (*cur != rd->seqEsc) {
+				return 0;
+			}
+
+			if (!dsi_rle_readSeq(rd)) {
+				if (dsi_rle_checkSeq(ctx, rd)) {
+					return 1;
+				}
+				continue;
+			}
+
+			// Sequence end is not decoded yet.
+			rd->offset--;
+		}
+
+		if (!dsi_rle_more(rd)) {
+			UTIL_ERR("Reached unexpected end of source buffer while decoding single-byte runs\n");
+			return 1;
+		}
+
+		if (dsi_rle_refill(ctx, rd)) {
+			return 1;
+		}
+	}
+
+	*cur = rd->seq[rd->seqPos++];
+
+	if (rd->seqPos == rd->seqLen) {
+		rd->seqPos = 0;
+		rd->seqRep--;
+	}
+
+	return 0;
+}
+
+// Get the number of bytes an in-place pass can write at the given offset,
+// followed by the padding overshot by block writes, without overwriting the
+// part of its source that is still to be read.
+static inline unsigned int dsi_rle_inPlaceRoom(const dsi_rle_Reader *rd, const unsigned char *dst, unsigned int dstOffset, unsigned int dstLen)
+{
+	unsigned int end = (unsigned int)((rd->seqRep ? rd->seq : rd->src + rd->offset) - dst);
+
+	end = end > UTIL_DST_PADDING ? UTIL_MIN(end - UTIL_DST_PADDING, dstLen) : 0;
+
+	return end > dstOffset ? end - dstOffset : 0;
+}
+
+// Move the output of an in-place pass to a buffer of its own when there is not
+// enough room left before its source. Returns the new destination buffer, or
+// NULL on allocation failure.
+static unsigned char *dsi_rle_spill(stpk_Context *ctx, unsigned int dstOffset)
+{
+	unsigned char *data;
+
+	if ((data = (unsigned char*)util_alloc(ctx, sizeof(unsigned char) * (ctx->dst.len + UTIL_DST_PADDING))) == NULL) {
+		UTIL_ERR("Error allocating memory for destination buffer. (%s)\n", strerror(errno));
+		return NULL;
+	}
+
+	memcpy(data, ctx->dst.data, dstOffset);
+	ctx->dst.data = data;
+
+	return data;
+}
+
+#ifdef DSI_RLE_SCAN_SIMD
+// Copy a block of bytes and return the number of literal bytes before the
+// first escape code in it.
+static inline unsigned int dsi_rle_copyLiterals(unsigned char *dst, const unsigned char *src, const __m128i *escVec, unsigned int escCount)
+{
+	__m128i block = _mm_loadu_si128((const __m128i*)src), match = _mm_setzero_si128();
+	unsigned int i, mask;
+
+	for (i = 0; i < escCount; i++) {
+		match = _mm_or_si128(match, _mm_cmpeq_epi8(block, escVec[i]));
+	}
+
+	_mm_storeu_si128((__m128i*)dst, block);
+	mask = _mm_movemask_epi8(match);
+
+	return mask ? (unsigned int)__builtin_ctz(mask) : DSI_RLE_SCAN_LEN;
+}
+#endif
+
+// Decode sequence runs and single-byte runs in a single pass. Sequence runs are
+// expanded into the token stream by reading their repetitions from the source
+// again, so no temporary buffer is needed. Tokens outside of sequences are
+// decoded directly from the source without checking its length as long as the
+// longest token fits, and the rest one by one through the reader. If a window is
+// given, the source buffer holds its beginning and the rest is decoded into the
+// window as it is read. In place, the source is at the end of the destination
+// buffer, and the fast loop stops writing before the part of it still to be
+// read. If the output is limited, decoding stops at the limit, cutting the last
+// run short, and the rest of the source is neither decoded nor checked.
+unsigned int dsi_rle_decodeRuns(stpk_Context *ctx, const unsigned char *escLookup, int seqEsc, dsi_rle_Window *window, int inPlace)
+{
+	unsigned char cur, token[DSI_RLE_TOKEN_MAX], *dst = ctx->dst.data;
+	const unsigned char *src = ctx->src.data;
+	unsigned int dstOffset = ctx->dst.offset, dstLen = util_limitLen(ctx), dstFast;
+	unsigned int progress = 0, progressOffset = 0, srcFast, tokensLen, rep, len, i;
+	int limited = dstLen < ctx->dst.len;
+	dsi_rle_Reader rd;
+#ifdef DSI_RLE_SCAN_SIMD
+	__m128i escVec[DSI_RLE_ESCLEN_MAX];
+	unsigned int escCount = 0;
+
+	for (i = 0; i < DSI_RLE_ESCLOOKUP_LEN; i++) {
+		if (escLookup[i]) {
+			escVec[escCount++] = _mm_set1_epi8((char)i);
+		}
+	}
+#endif
+
+	rd.src = ctx->src.data;
+	rd.offset = ctx->src.offset;
+	rd.len = ctx->src.len;
+	rd.base = 0;
+	rd.total = window != NULL ? window->total : ctx->src.len;
+	rd.window = window;
+	rd.passLen = window != NULL || limited ? ctx->dst.len : 0;
+	rd.seqEsc = seqEsc;
+	rd.seq = NULL;
+	rd.seqLen = rd.seqPos = rd.seqRep = 0;
+
+	// Sequence runs are checked up front, like a separate sequence pass would.
+	// Windows only hold part of the source, and limited output only needs part
+	// of it, so their sequence runs are checked as they are read.
+	if (!rd.passLen && dsi_rle_scanSeq(ctx, rd.offset, seqEsc, &tokensLen)) {
+		return 1;
+	}
+
+	ctx->dst.len = dstLen;
 
 	UTIL_NOVERBOSE("[");
 
-	UTIL_VERBOSE1("Decoding sequence runs...    ");
-	UTIL_VERBOSE2("\n\nsrcOff dstOff rep seq\n");
-	UTIL_VERBOSE2("~~~~~~ ~~~~~~ ~~~ ~~~~~~~~\n");
+	UTIL_VERBOSE1("Decoding runs... ");
 
-	// We do not know the destination length for this pass, dst->len covers both RLE passes.
-	while (ctx->src.offset < ctx->src.len) {
-		cur = ctx->src.data[ctx->src.offset++];
+	UTIL_VERBOSE2("\n");
+	TRACE_HEADER(STPK_TRACE_RLE_RUN);
 
-		if (cur == esc) {
-			seqOffset = ctx->src.offset;
+	while (dstOffset < dstLen) {
+		// Progress bar.
+		if (rd.base + rd.offset >= progressOffset) {
+			progressOffset = util_progress(ctx, &progress, 25, rd.base + rd.offset, rd.total);
+		}
 
-			while ((cur = ctx->src.data[ctx->src.offset++]) != esc) {
-				if (ctx->src.offset >= ctx->src.len) {
-					UTIL_ERR("Reached end of source buffer before finding sequence end escape code %02X\n", esc);
+		// Decode more of the source into the window before the fast loop runs
+		// out of tokens.
+		if (rd.offset + DSI_RLE_TOKEN_MAX > rd.len && !rd.seqRep && dsi_rle_more(&rd)) {
+			if (dsi_rle_refill(ctx, &rd)) {
+				return 1;
+			}
+		}
+		src = rd.src;
+		dstFast = inPlace ? dstOffset + dsi_rle_inPlaceRoom(&rd, dst, dstOffset, dstLen) : dstLen;
+
+		// Fast loop outside of sequences, stopping at the next progress bar
+		// mark. Tokens are traced in the careful loop.
+		srcFast = TRACE_ON(ctx) || rd.seqRep || rd.len < DSI_RLE_TOKEN_MAX ? 0 : UTIL_MIN(rd.len - DSI_RLE_TOKEN_MAX + 1, progressOffset - rd.base);
+		while (rd.offset < srcFast && dstOffset < dstFast) {
+			cur = src[rd.offset];
+
+			if (!escLookup[cur]) {
+				dst[dstOffset++] = cur;
+				rd.offset++;
+
+#ifdef DSI_RLE_SCAN_SIMD
+				// Copy spans of more than one literal byte up to the next escape
+				// code a block at a time. The destination buffer is padded for the
+				// excess.
+				if (!escLookup[src[rd.offset]] && rd.offset + DSI_RLE_SCAN_LEN <= rd.len) {
+					do {
+						len = UTIL_MIN(dsi_rle_copyLiterals(dst + dstOffset, src + rd.offset, escVec, escCount), dstFast - dstOffset);
+						rd.offset += len;
+						dstOffset += len;
+					} while (len == DSI_RLE_SCAN_LEN && rd.offset + DSI_RLE_SCAN_LEN <= rd.len);
+				}
+#endif
+				continue;
+			}
+
+			if (cur == seqEsc) {
+				// Sequences ending after the window are read by the careful loop.
+				rd.offset++;
+				if (dsi_rle_readSeq(&rd)) {
+					rd.offset--;
+					break;
+				}
+				if (dsi_rle_checkSeq(ctx, &rd)) {
 					return 1;
 				}
 
-				ctx->dst.data[ctx->dst.offset++] = cur;
+				// Sequences containing escape codes are decoded by the careful loop.
+				for (i = 0; i < rd.seqLen && !escLookup[rd.seq[i]]; i++);
+				if (i < rd.seqLen) {
+					break;
+				}
+
+				// Copy the repetitions that fit, and keep track of where the copy
+				// stopped if the output is full or reaches the pattern in place.
+				if (rd.seqLen * rd.seqRep > dstFast - dstOffset && inPlace) {
+					dstFast = dstOffset + dsi_rle_inPlaceRoom(&rd, dst, dstOffset, dstLen);
+				}
+				len = UTIL_MIN(rd.seqLen * rd.seqRep, dstFast - dstOffset);
+				if (rd.seqRep) {
+					util_copyRepeat(dst + dstOffset, rd.seq, rd.seqLen, len);
+					dstOffset += len;
+					rd.seqRep -= len / rd.seqLen;
+					rd.seqPos = len % rd.seqLen;
+				}
+				continue;
 			}
 
-			rep = ctx->src.data[ctx->src.offset++] - 1; // Already wrote sequence once.
-			UTIL_VERBOSE2("%6d %6d %02X  %2.*X\n", ctx->src.offset, ctx->dst.offset, rep + 1, ctx->src.offset - seqOffset - 2, ctx->src.data[seqOffset]);
+			// Run arguments starting a sequence are read by the careful loop.
+			if (seqEsc != DSI_RLE_NOSEQ) {
+				len = DSI_RLE_RUNLEN(escLookup[cur]);
+				for (i = 1; i <= len && src[rd.offset + i] != seqEsc; i++);
+				if (i <= len) {
+					break;
+				}
+			}
 
-			while (rep--) {
-				for (i = 0; i < (ctx->src.offset - seqOffset - 2); i++) {
-					if (ctx->dst.offset >= ctx->dst.len) {
-						UTIL_ERR("Reached end of temporary buffer while writing repeated sequence\n");
-						return 1;
-					}
+			// Runs that do not fit are left for the careful loop, which reports
+			// runs past the end of the output.
+			i = rd.offset + 1;
+			rep = dsi_rle_readRun(src, &i, escLookup[cur], &cur);
+			if (rep > dstFast - dstOffset) {
+				break;
+			}
+			rd.offset = i;
+
+			util_fill(dst + dstOffset, cur, rep);
+			dstOffset += rep;
+		}
+
+		if (dstOffset >= dstLen) {
+			break;
+		}
+
+		// Careful loop decoding a single token through the reader.
+		if (dsi_rle_readToken(ctx, &rd, &cur)) {
+			return 1;
+		}
 
-					ctx->dst.data[ctx->dst.offset++] = ctx->src.data[seqOffset + i];
+		if (escLookup[cur]) {
+			len = DSI_RLE_RUNLEN(escLookup[cur]);
+			for (i = 0; i < len; i++) {
+				if (dsi_rle_readToken(ctx, &rd, &token[i])) {
+					return 1;
 				}
 			}
 
+			i = 0;
+			rep = dsi_rle_readRun(token, &i, escLookup[cur], &cur);
+			TRACE_EVENT(ctx, STPK_TRACE_RLE_RUN, rd.offset, dstOffset, 0, rep, 0, 0, cur);
 		}
 		else {
-			ctx->dst.data[ctx->dst.offset++] = cur;
-			UTIL_VERBOSE2("%6d %6d     %02X\n", ctx->src.offset, ctx->dst.offset, cur);
+			rep = 1;
+			TRACE_EVENT(ctx, STPK_TRACE_RLE_LITERAL, rd.offset, dstOffset, 0, 1, 0, 0, cur);
+		}
 
-			if (ctx->dst.offset > ctx->dst.len) {
-				UTIL_ERR("Reached end of temporary buffer while writing non-RLE byte\n");
+		// The last run is cut short by the output limit.
+		if (limited) {
+			rep = UTIL_MIN(rep, dstLen - dstOffset);
+		}
+
+		// Move the output out of place if the token does not fit before the
+		// source. Writes past the end of the output are reported below.
+		if (inPlace && rep <= dstLen - dstOffset && rep > dsi_rle_inPlaceRoom(&rd, dst, dstOffset, dstLen)) {
+			if ((dst = dsi_rle_spill(ctx, dstOffset)) == NULL) {
 				return 1;
 			}
+			inPlace = 0;
 		}
 
-		// Progress bar.
-		if (ctx->verbosity && (ctx->verbosity < 3) && ((ctx->src.offset * 100) / ctx->src.len) >= (progress * 25)) {
-			ctx->logCallback(STPK_LOG_INFO, "%4d%%", progress++ * 25);
+		if (dsi_rle_repeatByte(ctx, dstOffset, cur, rep)) {
+			return 1;
 		}
+
+		dstOffset += rep;
 	}
 
+	util_progress(ctx, &progress, 25, rd.base + rd.offset, rd.total);
+
 	UTIL_VERBOSE1("\n");
-	UTIL_NOVERBOSE("]   ");
+	UTIL_NOVERBOSE("]\n");
+
+	// Decode the rest of a window's source to count the tokens left in it,
+	// unless the output is limited.
+	while (!limited && dsi_rle_more(&rd)) {
+		if (dsi_rle_refill(ctx, &rd)) {
+			return 1;
+		}
+	}
+
+	ctx->src.data = (unsigned char*)rd.src;
+	ctx->src.offset = rd.offset;
+	ctx->src.len = rd.len;
+	ctx->dst.offset = dstOffset;
+
+	if (limited) {
+		return 0;
+	}
+
+	// Tokens left in the current sequence and the rest of the source.
+	dsi_rle_scanSeq(ctx, rd.offset, seqEsc, &tokensLen);
+	tokensLen += rd.seqRep * rd.seqLen - rd.seqPos;
+
+	if (tokensLen) {
+		UTIL_WARN("RLE decoding finished with unprocessed data left in source buffer (%d bytes left)\n", tokensLen);
+	}
 
 	return 0;
 }
 
-// Decode single-byte runs.
-unsigned int dsi_rle_decodeOne(stpk_Context *ctx, const unsigned char *escLookup)
+// Open a run-length pass of len bytes at the read offset of a stream, where
+// its whole header is buffered.
+unsigned int dsi_rle_streamOpen(stpk_Context *ctx, dsi_rle_Stream *rs, stream_Buffer *in, unsigned int len)
 {
-	unsigned char cur;
-	unsigned int progress = 0, rep;
+	stpk_Buffer src = { .data = in->data, .offset = in->offset, .len = in->len };
 
-	UTIL_NOVERBOSE("[");
+	if (dsi_rle_readHeader(ctx, &src, rs->escLookup, &rs->seqEsc)) {
+		return 1;
+	}
 
-	UTIL_VERBOSE1("Decoding single-byte runs... ");
+	in->offset = src.offset;
+	rs->len = len;
+	rs->offset = 0;
+	rs->seqLen = rs->seqPos = rs->seqRep = 0;
+	rs->seqPlain = 0;
+	rs->tokenLen = 0;
+	rs->runRep = 0;
 
-	UTIL_VERBOSE2("\n\nsrcOff dstOff   rep cur\n");
-	UTIL_VERBOSE2("~~~~~~ ~~~~~~ ~~~~~ ~~~\n");
+	return 0;
+}
 
-	while (ctx->dst.offset < ctx->dst.len) {
-		cur = ctx->src.data[ctx->src.offset++];
+// Decode the next chunk of a run-length pass from a stream into the free part
+// of out. Whole tokens outside of sequences are decoded by a fast loop like
+// the one in dsi_rle_decodeRuns(), and the rest a byte at a time, so tokens may
+// be split anywhere by the end of the buffered source. Streams are not traced.
+unsigned int dsi_rle_streamRead(stpk_Context *ctx, dsi_rle_Stream *rs, stream_Buffer *in, stream_Buffer *out)
+{
+	const unsigned char *escLookup = rs->escLookup, *src, *seqEnd;
+	unsigned char cur, *dst = out->data;
+	unsigned int dstOffset = out->len, dstEnd = out->len + UTIL_MIN(out->size - out->len, rs->len - rs->offset);
+	unsigned int srcOffset, srcFast, rep, len, i;
+	int seqEsc = rs->seqEsc;
+#ifdef DSI_RLE_SCAN_SIMD
+	__m128i escVec[DSI_RLE_ESCLEN_MAX];
+	unsigned int escCount = 0;
+
+	for (i = 0; i < DSI_RLE_ESCLOOKUP_LEN; i++) {
+		if (escLookup[i]) {
+			escVec[escCount++] = _mm_set1_epi8((char)i);
+		}
+	}
+#endif
+
+	while (dstOffset < dstEnd) {
+		// Continue a run cut short by the end of the output.
+		if (rs->runRep) {
+			len = UTIL_MIN(rs->runRep, dstEnd - dstOffset);
+			util_fill(dst + dstOffset, rs->runByte, len);
+			dstOffset += len;
+			rs->runRep -= len;
+			continue;
+		}
 
-		if (ctx->src.offset > ctx->src.len) {
-			UTIL_ERR("Reached unexpected end of source buffer while decoding single-byte runs\n");
-			return 1;
+		src = in->data;
+
+		if (rs->seqRep) {
+			// Copy whole repetitions of patterns without escape codes at once.
+			if (rs->seqPlain && !rs->tokenLen && !rs->seqPos) {
+				len = UTIL_MIN(rs->seqLen * rs->seqRep, dstEnd - dstOffset);
+				util_copyRepeat(dst + dstOffset, src + in->offset, rs->seqLen, len);
+				dstOffset += len;
+				rs->seqRep -= len / rs->seqLen;
+				rs->seqPos = len % rs->seqLen;
+
+				if (!rs->seqRep) {
+					in->offset += rs->seqLen + 2;
+				}
+				continue;
+			}
+
+			cur = src[in->offset + rs->seqPos++];
+			if (rs->seqPos == rs->seqLen) {
+				rs->seqPos = 0;
+
+				// Consume the sequence run after its last repetition.
+				if (!--rs->seqRep) {
+					in->offset += rs->seqLen + 2;
+				}
+			}
 		}
+		else {
+			// Fast loop between tokens, leaving sequence runs, runs that do not
+			// fit and run arguments starting a sequence to the byte by byte
+			// decoding below.
+			if (!rs->tokenLen) {
+				srcOffset = in->offset;
+				srcFast = in->len >= DSI_RLE_TOKEN_MAX ? in->len - DSI_RLE_TOKEN_MAX + 1 : 0;
+
+				while (srcOffset < srcFast && dstOffset < dstEnd) {
+					cur = src[srcOffset];
+
+					if (!escLookup[cur]) {
+						dst[dstOffset++] = cur;
+						srcOffset++;
+
+#ifdef DSI_RLE_SCAN_SIMD
+						if (!escLookup[src[srcOffset]] && srcOffset + DSI_RLE_SCAN_LEN <= in->len) {
+							do {
+								len = UTIL_MIN(dsi_rle_copyLiterals(dst + dstOffset, src + srcOffset, escVec, escCount), dstEnd - dstOffset);
+								srcOffset += len;
+								dstOffset += len;
+							} while (len == DSI_RLE_SCAN_LEN && srcOffset + DSI_RLE_SCAN_LEN <= in->len);
+						}
+#endif
+						continue;
+					}
 
-		if (escLookup[cur]) {
-			switch (escLookup[cur]) {
-				// Type 1: One-byte counter for repetitions
-				case 1:
-					rep = ctx->src.data[ctx->src.offset];
-					cur = ctx->src.data[ctx->src.offset + 1];
-					ctx->src.offset += 2;
-
-					if (dsi_rle_repeatByte(ctx, cur, rep)) {
-						return 1;
+					if (cur == seqEsc) {
+						break;
 					}
 
-					break;
+					if (seqEsc != DSI_RLE_NOSEQ) {
+						len = DSI_RLE_RUNLEN(escLookup[cur]);
+						for (i = 1; i <= len && src[srcOffset + i] != seqEsc; i++);
+						if (i <= len) {
+							break;
+						}
+					}
 
-				// Type 2: Used for sequences. Serves no purpose here, but
-				// would be handled by the default case if it were to occur.
+					i = srcOffset + 1;
+					rep = dsi_rle_readRun(src, &i, escLookup[cur], &cur);
+					if (rep > dstEnd - dstOffset) {
+						break;
+					}
+					srcOffset = i;
 
-				// Type 3: Two-byte counter for repetitions
-				case 3:
-					rep = ctx->src.data[ctx->src.offset] | ctx->src.data[ctx->src.offset + 1] << 8;
-					cur = ctx->src.data[ctx->src.offset + 2];
-					ctx->src.offset += 3;
+					util_fill(dst + dstOffset, cur, rep);
+					dstOffset += rep;
+				}
 
-					if (dsi_rle_repeatByte(ctx, cur, rep)) {
-						return 1;
-					}
+				in->offset = srcOffset;
 
+				if (dstOffset >= dstEnd) {
 					break;
+				}
+			}
+
+			if (in->offset >= in->len) {
+				if (in->end) {
+					UTIL_ERR("Reached unexpected end of source buffer while decoding single-byte runs\n");
+					return 1;
+				}
+				break;
+			}
 
-				// Type n: n repetitions
-				default:
-					rep = escLookup[cur] - 1;
-					cur = ctx->src.data[ctx->src.offset++];
+			cur = src[in->offset];
 
-					if (dsi_rle_repeatByte(ctx, cur, rep)) {
+			if (cur == seqEsc) {
+				// Wait for the sequence end escape code and repetition count,
+				// growing the source buffer if the pattern fills all of it.
+				if (in->len - in->offset < 2
+					|| (seqEnd = (const unsigned char*)memchr(src + in->offset + 1, seqEsc, in->len - in->offset - 2)) == NULL
+				) {
+					if (in->end) {
+						UTIL_ERR("Reached end of source buffer before finding sequence end escape code %02X\n", seqEsc);
+						return 1;
+					}
+					if (stream_avail(in) == in->size && stream_grow(ctx, in)) {
 						return 1;
 					}
+					break;
+				}
+
+				in->offset++;
+				rs->seqLen = seqEnd - (src + in->offset);
+				rs->seqRep = rs->seqLen ? seqEnd[1] : 0;
+				rs->seqPos = 0;
+
+				// A repetition count of 0 wraps around to an endless sequence.
+				if (rs->seqLen && (!rs->seqRep || rs->seqRep > rs->len / rs->seqLen)) {
+					UTIL_ERR("Reached end of temporary buffer while writing repeated sequence\n");
+					return 1;
+				}
+
+				if (!rs->seqRep) {
+					in->offset += rs->seqLen + 2;
+				}
+
+				for (i = 0; i < rs->seqLen && !escLookup[src[in->offset + i]]; i++);
+				rs->seqPlain = i == rs->seqLen;
+				continue;
 			}
+
+			in->offset++;
 		}
-		else {
-			ctx->dst.data[ctx->dst.offset++] = cur;
-			UTIL_VERBOSE2("%6d %6d        %02X\n", ctx->src.offset, ctx->dst.offset, cur);
+
+		// Single-byte run token read a byte at a time, from the source or a
+		// sequence run.
+		if (!rs->tokenLen && !escLookup[cur]) {
+			dst[dstOffset++] = cur;
+			continue;
 		}
 
-		// Progress bar.
-		if (ctx->verbosity && (ctx->verbosity < 3) && ((ctx->src.offset * 100) / ctx->src.len) >= (progress * 25)) {
-			ctx->logCallback(STPK_LOG_INFO, "%4d%%", progress++ * 25);
+		rs->token[rs->tokenLen++] = cur;
+		if (rs->tokenLen <= DSI_RLE_RUNLEN(escLookup[rs->token[0]])) {
+			continue;
+		}
+
+		i = 0;
+		rep = dsi_rle_readRun(rs->token + 1, &i, escLookup[rs->token[0]], &rs->runByte);
+		rs->tokenLen = 0;
+
+		if (rep > rs->len - rs->offset - (dstOffset - out->len)) {
+			UTIL_ERR("Reached end of temporary buffer while writing byte run\n");
+			return 1;
 		}
+
+		rs->runRep = rep;
 	}
 
-	UTIL_VERBOSE1("\n");
-	UTIL_NOVERBOSE("]\n");
+	rs->offset += dstOffset - out->len;
+	out->total += dstOffset - out->len;
+	out->len = dstOffset;
 
-	if (ctx->src.offset < ctx->src.len) {
-		UTIL_WARN("RLE decoding finished with unprocessed data left in source buffer (%d bytes left)\n", ctx->src.len - ctx->src.offset);
+	if (rs->offset == rs->len) {
+		out->end = 1;
+
+		if (stream_avail(in) || rs->tokenLen) {
+			UTIL_WARN("RLE decoding finished with unprocessed data left in source buffer (%d bytes left)\n", stream_avail(in));
+		}
 	}
 
 	return 0;
 }
 
-inline unsigned int dsi_rle_repeatByte(stpk_Context *ctx, unsigned char cur, unsigned int rep)
+// Read repetition count and byte following an escape code of the given type.
+static inline unsigned int dsi_rle_readRun(const unsigned char *src, unsigned int *srcOffset, unsigned char type, unsigned char *cur)
 {
-	UTIL_VERBOSE2("%6d %6d    %02X  %02X\n", ctx->src.offset, ctx->dst.offset, rep, cur);
+	unsigned int rep;
+
+	switch (type) {
+		// Type 1: One-byte counter for repetitions
+		case 1:
+			rep = src[*srcOffset];
+			*cur = src[*srcOffset + 1];
+			*srcOffset += 2;
+			break;
+
+		// Type 2: Used for sequences. Serves no purpose here, but
+		// would be handled by the default case if it were to occur.
+
+		// Type 3: Two-byte counter for repetitions
+		case 3:
+			rep = src[*srcOffset] | src[*srcOffset + 1] << 8;
+			*cur = src[*srcOffset + 2];
+			*srcOffset += 3;
+			break;
+
+		// Type n: n repetitions
+		default:
+			rep = type - 1;
+			*cur = src[(*srcOffset)++];
+	}
 
-	while (rep--) {
-		if (ctx->dst.offset >= ctx->dst.len) {
-			UTIL_ERR("Reached end of temporary buffer while writing byte run\n");
-			return 1;
-		}
+	return rep;
+}
 
-		ctx->dst.data[ctx->dst.offset++] = cur;
+static inline unsigned int dsi_rle_repeatByte(stpk_Context *ctx, unsigned int dstOffset, unsigned char cur, unsigned int rep)
+{
+	if (rep > ctx->dst.len - dstOffset) {
+		UTIL_ERR("Reached end of temporary buffer while writing byte run\n");
+		return 1;
 	}
 
+	util_fill(ctx->dst.data + dstOffset, cur, rep);
+
 	return 0;
 }
@@ -22,15 +22,83 @@
 
 #include <stunpack.h>
 
+#include "stream.h"
+
 #define DSI_RLE_ESCLEN_MASK   0x7F
 #define DSI_RLE_ESCLEN_MAX    0x0A
 #define DSI_RLE_ESCLEN_NOSEQ  0x80
 #define DSI_RLE_ESCLOOKUP_LEN 0x100
 #define DSI_RLE_ESCSEQ_POS    0x01
+#define DSI_RLE_NOSEQ         (-1)
+
+// Length of the run-length header up to and including escLen.
+#define DSI_RLE_HEADER_MIN    0x05
+
+// Length of the longest single-byte run token, and of the repetition count
+// and byte following an escape code of the given type.
+#define DSI_RLE_TOKEN_MAX     0x04
+#define DSI_RLE_RUNLEN(type)  ((type) == 1 ? 2 : (type) == 3 ? 3 : 1)
+
+// Scan literal bytes for escape codes 16 at a time where SSE2 and GCC builtins
+// are available.
+#if defined(__SSE2__) && defined(__GNUC__)
+#	define DSI_RLE_SCAN_SIMD
+#	define DSI_RLE_SCAN_LEN 0x10
+#endif
+
+// Window over a source that is decoded while it is read, such as the output of
+// a preceding Huffman pass. The fill callback decodes the next len bytes of the
+// source into dst.
+typedef struct {
+	unsigned char *data;
+	unsigned int  size;   // Allocated length, not including UTIL_DST_PADDING.
+	unsigned int  total;  // Length of the whole source.
+	unsigned int  (*fill)(stpk_Context *ctx, void *source, unsigned char *dst, unsigned int len);
+	void          *source;
+} dsi_rle_Window;
+
+// Reader for the stream of single-byte run tokens with sequence runs expanded.
+typedef struct {
+	const unsigned char *src;
+	unsigned int offset;
+	unsigned int len;
+	unsigned int base;    // Source offset of src, non-zero for windows.
+	unsigned int total;   // Length of the whole source.
+	dsi_rle_Window *window;
+	unsigned int passLen; // Decoded length of the whole pass if sequence runs
+	                      // are checked as they are read, otherwise 0.
+	int          seqEsc;  // Sequence escape code or DSI_RLE_NOSEQ.
+	const unsigned char *seq;
+	unsigned int seqLen;
+	unsigned int seqPos;  // Offset in current repetition.
+	unsigned int seqRep;  // Repetitions left, including the current one.
+} dsi_rle_Reader;
+
+// Run-length pass decoded from a stream. The pattern of the current sequence
+// run is kept at the read offset of the source until its last repetition, and
+// run tokens and runs cut short by the end of either buffer are continued by
+// the next read.
+typedef struct {
+	unsigned char escLookup[DSI_RLE_ESCLOOKUP_LEN];
+	int           seqEsc;
+	unsigned int  len;       // Decoded length of the pass.
+	unsigned int  offset;    // Bytes decoded so far.
+	unsigned int  seqLen;
+	unsigned int  seqPos;    // Offset in current repetition.
+	unsigned int  seqRep;    // Repetitions left, including the current one.
+	int           seqPlain;  // Pattern has no escape codes.
+	unsigned char token[DSI_RLE_TOKEN_MAX];
+	unsigned int  tokenLen;  // Bytes of the current run token read so far.
+	unsigned int  runRep;    // Bytes left of the current run.
+	unsigned char runByte;
+} dsi_rle_Stream;
 
 int dsi_rle_isValid(stpk_Buffer *buf, unsigned int offset);
-unsigned int dsi_rle_decompress(stpk_Context *ctx);
-unsigned int dsi_rle_decodeSeq(stpk_Context *ctx, unsigned char esc);
-unsigned int dsi_rle_decodeOne(stpk_Context *ctx, const unsigned char *escLookup);
+unsigned int dsi_rle_headerLen(const unsigned char *data, unsigned int len);
+unsigned int dsi_rle_decompress(stpk_Context *ctx, dsi_rle_Window *window, int inPlace);
+unsigned int dsi_rle_scanSeq(stpk_Context *ctx, unsigned int offset, int seqEsc, unsigned int *tokensLen);
+unsigned int dsi_rle_decodeRuns(stpk_Context *ctx, const unsigned char *escLookup, int seqEsc, dsi_rle_Window *window, int inPlace);
+unsigned int dsi_rle_streamOpen(stpk_Context *ctx, dsi_rle_Stream *rs, stream_Buffer *in, unsigned int len);
+unsigned int dsi_rle_streamRead(stpk_Context *ctx, dsi_rle_Stream *rs, stream_Buffer *in, stream_Buffer *out);
 
 #endif
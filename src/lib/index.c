@@ -0,0 +1,449 @@
+/*
+ * stunpack - Stunts/4D [Sports] Driving game resource unpacker
+ * Copyright (C) 2008-2024 Daniel Stien <daniel@stien.org>
+ *  
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ * 
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ * 
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software 
+ * Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA 02111-1307, USA.
+ */
+
+#include <errno.h>
+#include <string.h>
+
+#include "dsi.h"
+#include "rpck.h"
+#include "stream.h"
+#include "util.h"
+
+#include "index.h"
+
+static void index_put32(unsigned char *dst, uint32_t val)
+{
+	dst[0] = val & 0xFF;
+	dst[1] = (val >> 8) & 0xFF;
+	dst[2] = (val >> 16) & 0xFF;
+	dst[3] = (val >> 24) & 0xFF;
+}
+
+static uint32_t index_get32(const unsigned char *src)
+{
+	return src[0] | src[1] << 8 | src[2] << 16 | (uint32_t)src[3] << 24;
+}
+
+// Get the length of the state of a stage when saved.
+static unsigned int index_stateLen(unsigned char type)
+{
+	switch (type) {
+		case DSI_TYPE_RLE:
+			return 4 * 4 + 2 + DSI_RLE_TOKEN_MAX + 4 + 1;
+		case DSI_TYPE_HUFF:
+			return 4 + 1;
+		default:
+			return 3 * 4 + 1;
+	}
+}
+
+// Check the state of a stage against the decoded length of its pass and the
+// input buffered at its read offset, which holds the pattern of a pending
+// sequence run. Returns 1 if the state could not have been saved from such a
+// pass.
+int index_checkState(unsigned char type, const index_State *state, unsigned int len, unsigned int inLen)
+{
+	unsigned int left;
+
+	if (state->offset > len) {
+		return 1;
+	}
+	left = len - state->offset;
+
+	switch (type) {
+		case DSI_TYPE_RLE:
+			if (state->tokenLen > DSI_RLE_TOKEN_MAX || state->runRep > left) {
+				return 1;
+			}
+			if (!state->seqRep) {
+				return state->seqPos != 0;
+			}
+			return !state->seqLen || state->seqPos >= state->seqLen || state->seqLen > inLen || inLen - state->seqLen < 2
+				|| (uint64_t)state->seqRep * state->seqLen - state->seqPos > left;
+		case DSI_TYPE_HUFF:
+			return 0;
+		default:
+			return state->literal > RPCK_BLOCK_MAX || state->literal > left || state->runRep > left;
+	}
+}
+
+// Set up an empty index recording a checkpoint about every interval bytes of
+// output, or INDEX_INTERVAL if 0, once attached to a stream with
+// stpk_stream_index(). Returns NULL on allocation failure.
+stpk_Index *stpk_index_init(stpk_Context *ctx, unsigned int interval)
+{
+	stpk_Index *index;
+
+	if ((index = (stpk_Index*)util_alloc(ctx, sizeof(stpk_Index))) == NULL) {
+		UTIL_ERR("Error allocating memory for index. (%s)\n", strerror(errno));
+		return NULL;
+	}
+
+	index->ctx = ctx;
+	index->interval = interval ? interval : INDEX_INTERVAL;
+	index->type = STPK_FMT_UNKNOWN;
+	index->count = 0;
+	index->checkpoints = NULL;
+	index->states = NULL;
+	index->len = index->size = 0;
+	index->next = index->interval;
+
+	return index;
+}
+
+void stpk_index_deinit(stpk_Index *index)
+{
+	stpk_Context *ctx = index->ctx;
+
+	if (index->checkpoints != NULL) {
+		util_dealloc(ctx, index->checkpoints);
+	}
+	if (index->states != NULL) {
+		util_dealloc(ctx, index->states);
+	}
+
+	util_dealloc(ctx, index);
+}
+
+// Append a checkpoint, doubling the allocated number when full, and get it
+// along with the state of its stages to fill in.
+int index_add(stpk_Index *index, index_Checkpoint **checkpoint, index_State **states)
+{
+	stpk_Context *ctx = index->ctx;
+	index_Checkpoint *newCheckpoints;
+	index_State *newStates;
+	unsigned int size;
+
+	if (index->len == index->size) {
+		size = index->size ? index->size * 2 : 0x10;
+
+		if ((newCheckpoints = (index_Checkpoint*)util_alloc(ctx, sizeof(index_Checkpoint) * size)) == NULL) {
+			UTIL_ERR("Error allocating memory for index checkpoints. (%s)\n", strerror(errno));
+			return 1;
+		}
+		if ((newStates = (index_State*)util_alloc(ctx, sizeof(index_State) * size * index->count)) == NULL) {
+			UTIL_ERR("Error allocating memory for index checkpoints. (%s)\n", strerror(errno));
+			util_dealloc(ctx, newCheckpoints);
+			return 1;
+		}
+
+		if (index->len) {
+			memcpy(newCheckpoints, index->checkpoints, sizeof(index_Checkpoint) * index->len);
+			memcpy(newStates, index->states, sizeof(index_State) * index->len * index->count);
+			util_dealloc(ctx, index->checkpoints);
+			util_dealloc(ctx, index->states);
+		}
+
+		index->checkpoints = newCheckpoints;
+		index->states = newStates;
+		index->size = size;
+	}
+
+	*checkpoint = &index->checkpoints[index->len];
+	*states = &index->states[index->len * index->count];
+	index->len++;
+
+	return 0;
+}
+
+// Write an index to dst in the sidecar file format, all numbers little endian:
+//
+//   magic "STPX", version, format type, stage count, interval (32-bit),
+//   checkpoint count (32-bit)
+//   per stage: type, Huffman version, header length, header
+//   per checkpoint: output offset (32-bit), source offset (32-bit), source
+//   bit, then the state of each stage in the fields of its type
+//
+// Returns the length of the file, and only gets the length if dst is NULL.
+unsigned int stpk_index_save(const stpk_Index *index, unsigned char *dst)
+{
+	const index_Checkpoint *checkpoint;
+	const index_State *state;
+	unsigned int len = INDEX_FILE_HEADER_LEN, checkpointLen = INDEX_FILE_CHECKPOINT_LEN, i, j;
+	unsigned char *p;
+
+	for (i = 0; i < index->count; i++) {
+		len += 3 + index->stages[i].len;
+		checkpointLen += index_stateLen(index->stages[i].type);
+	}
+	len += checkpointLen * index->len;
+
+	if (dst == NULL) {
+		return len;
+	}
+
+	memcpy(dst, INDEX_MAGIC, 4);
+	dst[4] = INDEX_VERSION;
+	dst[5] = index->type;
+	dst[6] = index->count;
+	index_put32(dst + 7, index->interval);
+	index_put32(dst + 11, index->len);
+	p = dst + INDEX_FILE_HEADER_LEN;
+
+	for (i = 0; i < index->count; i++) {
+		*p++ = index->stages[i].type;
+		*p++ = index->stages[i].version;
+		*p++ = index->stages[i].len;
+		memcpy(p, index->stages[i].data, index->stages[i].len);
+		p += index->stages[i].len;
+	}
+
+	for (i = 0; i < index->len; i++) {
+		checkpoint = &index->checkpoints[i];
+		index_put32(p, checkpoint->dstOffset);
+		index_put32(p + 4, checkpoint->srcOffset);
+		p[8] = checkpoint->srcBit;
+		p += INDEX_FILE_CHECKPOINT_LEN;
+
+		for (j = 0; j < index->count; j++) {
+			state = &index->states[i * index->count + j];
+			index_put32(p, state->offset);
+
+			switch (index->stages[j].type) {
+				case DSI_TYPE_RLE:
+					index_put32(p + 4, state->seqLen);
+					index_put32(p + 8, state->seqPos);
+					index_put32(p + 12, state->seqRep);
+					p[16] = state->seqPlain;
+					p[17] = state->tokenLen;
+					memcpy(p + 18, state->token, DSI_RLE_TOKEN_MAX);
+					index_put32(p + 18 + DSI_RLE_TOKEN_MAX, state->runRep);
+					p[22 + DSI_RLE_TOKEN_MAX] = state->runByte;
+					break;
+				case DSI_TYPE_HUFF:
+					p[4] = state->sum;
+					break;
+				default:
+					index_put32(p + 4, state->literal);
+					index_put32(p + 8, state->runRep);
+					p[12] = state->runByte;
+					break;
+			}
+
+			p += index_stateLen(index->stages[j].type);
+		}
+	}
+
+	return len;
+}
+
+// Read an index saved by stpk_index_save(). Returns NULL if it is not valid, or
+// on allocation failure.
+stpk_Index *stpk_index_load(stpk_Context *ctx, const unsigned char *src, unsigned int len)
+{
+	stpk_Index *index;
+	index_Checkpoint *checkpoint;
+	index_State *state;
+	const unsigned char *p = src + INDEX_FILE_HEADER_LEN, *end = src + len;
+	unsigned int count, checkpointLen = INDEX_FILE_CHECKPOINT_LEN, i, j;
+
+	if (len < INDEX_FILE_HEADER_LEN || memcmp(src, INDEX_MAGIC, 4) != 0) {
+		UTIL_ERR("Invalid index. Expected magic bytes \"%s\"\n", INDEX_MAGIC);
+		return NULL;
+	}
+
+	if (src[4] != INDEX_VERSION) {
+		UTIL_ERR("Unsupported index version %d, expected %d\n", src[4], INDEX_VERSION);
+		return NULL;
+	}
+
+	if ((src[5] != STPK_FMT_DSI && src[5] != STPK_FMT_RPCK) || !src[6] || src[6] > DSI_PASSES_MASK) {
+		UTIL_ERR("Invalid index. Unexpected format type %d with %d stage(s)\n", src[5], src[6]);
+		return NULL;
+	}
+
+	if ((index = stpk_index_init(ctx, index_get32(src + 7))) == NULL) {
+		return NULL;
+	}
+
+	index->type = (stpk_FmtType)src[5];
+	index->count = src[6];
+	count = index_get32(src + 11);
+
+	for (i = 0; i < index->count; i++) {
+		if (end - p < 3 || end - p - 3 < p[2] || p[2] > INDEX_HEADER_MAX || (i ? p[2] < STREAM_PASS_HEADER_LEN : p[2])
+			|| (index->type == STPK_FMT_RPCK ? p[0] != STREAM_TYPE_RPCK : p[0] != DSI_TYPE_RLE && p[0] != DSI_TYPE_HUFF)
+			|| (p[0] == DSI_TYPE_HUFF && p[1] != STPK_FMT_DSI_VER_1 && p[1] != STPK_FMT_DSI_VER_2)
+		) {
+			UTIL_ERR("Invalid index. Error parsing stage %d/%d\n", i + 1, index->count);
+			goto deinitIndex;
+		}
+
+		index->stages[i].type = p[0];
+		index->stages[i].version = p[1];
+		index->stages[i].len = p[2];
+		memcpy(index->stages[i].data, p + 3, p[2]);
+		p += 3 + p[2];
+		checkpointLen += index_stateLen(index->stages[i].type);
+	}
+
+	if ((unsigned int)(end - p) / checkpointLen != count || (unsigned int)(end - p) % checkpointLen) {
+		UTIL_ERR("Invalid index. Expected %d checkpoint(s) of %d bytes, got %d bytes\n", count, checkpointLen, (int)(end - p));
+		goto deinitIndex;
+	}
+
+	for (i = 0; i < count; i++) {
+		if (index_add(index, &checkpoint, &state)) {
+			goto deinitIndex;
+		}
+
+		checkpoint->dstOffset = index_get32(p);
+		checkpoint->srcOffset = index_get32(p + 4);
+		checkpoint->srcBit = p[8];
+		p += INDEX_FILE_CHECKPOINT_LEN;
+
+		if (checkpoint->srcBit > 7 || (i && checkpoint->dstOffset <= checkpoint[-1].dstOffset)) {
+			UTIL_ERR("Invalid index. Error parsing checkpoint %d/%d\n", i + 1, count);
+			goto deinitIndex;
+		}
+
+		for (j = 0; j < index->count; j++, state++) {
+			memset(state, 0, sizeof(index_State));
+			state->offset = index_get32(p);
+
+			switch (index->stages[j].type) {
+				case DSI_TYPE_RLE:
+					state->seqLen = index_get32(p + 4);
+					state->seqPos = index_get32(p + 8);
+					state->seqRep = index_get32(p + 12);
+					state->seqPlain = p[16];
+					state->tokenLen = p[17];
+					memcpy(state->token, p + 18, DSI_RLE_TOKEN_MAX);
+					state->runRep = index_get32(p + 18 + DSI_RLE_TOKEN_MAX);
+					state->runByte = p[22 + DSI_RLE_TOKEN_MAX];
+					break;
+				case DSI_TYPE_HUFF:
+					state->sum = p[4];
+					break;
+				default:
+					state->literal = index_get32(p + 4);
+					state->runRep = index_get32(p + 8);
+					state->runByte = p[12];
+					break;
+			}
+
+			// Only the passes after the first keep their length, and they have
+			// consumed all of their input at a checkpoint. The last one has
+			// decoded all of the output so far.
+			if (index_checkState(index->stages[j].type, state, j ? dsi_peekLength(index->stages[j].data, 1) : UINT32_MAX, j ? 0 : UINT32_MAX)
+				|| (j == index->count - 1U && state->offset != checkpoint->dstOffset)
+			) {
+				UTIL_ERR("Invalid index. Error parsing checkpoint %d/%d\n", i + 1, count);
+				goto deinitIndex;
+			}
+
+			p += index_stateLen(index->stages[j].type);
+		}
+	}
+
+	return index;
+
+deinitIndex:
+	stpk_index_deinit(index);
+	return NULL;
+}
+
+// Decompress len bytes of the output starting at offset into the destination
+// buffer, resuming from the last checkpoint of the index before offset. The
+// source must be the one the index was built from. dst.len is set to the
+// length decoded, which is less than len past the end of the output.
+unsigned int stpk_decompressRange(stpk_Context *ctx, const stpk_Index *index, unsigned int offset, unsigned int len)
+{
+	stpk_Context run = *ctx;
+	stpk_Stream *stream;
+	const unsigned char *src = ctx->src.data + ctx->src.offset;
+	unsigned char skip[INDEX_SKIP_LEN];
+	unsigned int srcLen = ctx->src.len - ctx->src.offset, fed = 0, pos = 0, read, retval, lo, hi, mid, i;
+
+	// Decode the stages the index was built from, and only probe the version of
+	// Huffman passes if there are no checkpoints to go by.
+	if (run.format.type == STPK_FMT_AUTO) {
+		util_setFmtType(&run, index->type);
+	}
+	run.format.type = index->type;
+	run.limit = 0;
+	if (index->type == STPK_FMT_DSI) {
+		run.format.dsi.version = STPK_FMT_DSI_VER_2;
+		for (i = index->count; i--;) {
+			if (index->stages[i].type == DSI_TYPE_HUFF) {
+				run.format.dsi.version = (stpk_FmtDsiVer)index->stages[i].version;
+			}
+		}
+		run.format.dsi.maxPasses = index->count;
+		run.format.dsi.detected = STPK_FMT_DSI_VER_AUTO;
+	}
+
+	// Find the number of checkpoints at or before offset.
+	for (lo = 0, hi = index->len; lo < hi;) {
+		mid = lo + (hi - lo) / 2;
+		if (index->checkpoints[mid].dstOffset <= offset) {
+			lo = mid + 1;
+		}
+		else {
+			hi = mid;
+		}
+	}
+
+	if ((ctx->dst.data = (unsigned char*)util_alloc(ctx, sizeof(unsigned char) * (len + UTIL_DST_PADDING))) == NULL) {
+		UTIL_ERR("Error allocating memory for destination buffer. (%s)\n", strerror(errno));
+		return STPK_RET_ERR;
+	}
+	ctx->dst.len = 0;
+
+	if ((stream = stpk_stream_init(&run, 0)) == NULL) {
+		return STPK_RET_ERR;
+	}
+
+	if (lo) {
+		UTIL_VERBOSE1("Resuming from checkpoint %d/%d at output offset %d\n", lo, index->len, index->checkpoints[lo - 1].dstOffset);
+
+		if ((retval = stream_resume(stream, index, lo - 1, src, srcLen, &fed)) != STPK_RET_OK) {
+			goto deinitStream;
+		}
+		pos = index->checkpoints[lo - 1].dstOffset;
+	}
+
+	do {
+		fed += stpk_stream_feed(stream, src + fed, srcLen - fed);
+		if (fed == srcLen) {
+			stpk_stream_end(stream);
+		}
+
+		// Skip the output up to offset, then read the range.
+		do {
+			if (pos < offset) {
+				retval = stpk_stream_read(stream, skip, UTIL_MIN(INDEX_SKIP_LEN, offset - pos), &read);
+				pos += read;
+			}
+			else {
+				retval = stpk_stream_read(stream, ctx->dst.data + ctx->dst.len, len - ctx->dst.len, &read);
+				ctx->dst.len += read;
+
+				if (ctx->dst.len == len) {
+					retval = STPK_RET_OK;
+				}
+			}
+		} while (retval == STPK_RET_MORE_OUTPUT);
+	} while (retval == STPK_RET_NEED_INPUT);
+
+deinitStream:
+	stpk_stream_deinit(stream);
+
+	return retval;
+}
@@ -0,0 +1,96 @@
+/*
+ * stunpack - Stunts/4D [Sports] Driving game resource unpacker
+ * Copyright (C) 2008-2024 Daniel Stien <daniel@stien.org>
+ *  
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ * 
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ * 
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software 
+ * Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA 02111-1307, USA.
+ */
+
+#ifndef STPK_LIB_INDEX_H
+#define STPK_LIB_INDEX_H
+
+#include <stdint.h>
+#include <stunpack.h>
+
+#include "dsi.h"
+#include "dsi_rle.h"
+#include "stream.h"
+
+#define INDEX_MAGIC   "STPX"
+#define INDEX_VERSION 1
+
+// Output between checkpoints if no interval is given.
+#define INDEX_INTERVAL 0x10000
+
+// Longest pass header kept for resuming a stage after the first, which is
+// always a run-length pass.
+#define INDEX_HEADER_MAX (STREAM_PASS_HEADER_LEN + DSI_RLE_HEADER_MIN + DSI_RLE_ESCLEN_MAX)
+
+// Length of the file header and the fixed part of each checkpoint when saved.
+#define INDEX_FILE_HEADER_LEN 15
+#define INDEX_FILE_CHECKPOINT_LEN 9
+
+// Output decoded between skipped checkpoints is read through a buffer of this
+// many bytes.
+#define INDEX_SKIP_LEN 0x1000
+
+// Stage of a stream, as needed to open it again without its source.
+typedef struct {
+	unsigned char type;     // DSI_TYPE_RLE, DSI_TYPE_HUFF or STREAM_TYPE_RPCK.
+	unsigned char version;  // Bit stream format of a Huffman pass.
+	unsigned char len;      // Length of the pass header kept, 0 for the first stage.
+	unsigned char data[INDEX_HEADER_MAX];
+} index_Stage;
+
+// Decoder state of a stage at a checkpoint. Only the fields of its type are
+// used.
+typedef struct {
+	uint32_t      offset;    // Bytes decoded of the pass.
+	uint32_t      seqLen;
+	uint32_t      seqPos;
+	uint32_t      seqRep;
+	uint32_t      literal;
+	uint32_t      runRep;
+	unsigned char runByte;
+	unsigned char sum;       // Running sum of delta coded Huffman output.
+	unsigned char seqPlain;
+	unsigned char tokenLen;
+	unsigned char token[DSI_RLE_TOKEN_MAX];
+} index_State;
+
+// Point where every stage can be resumed from the source alone, which is when
+// all output between stages has been consumed.
+typedef struct {
+	uint32_t      dstOffset;  // Output decoded so far.
+	uint32_t      srcOffset;  // Source byte the first stage resumes from.
+	unsigned char srcBit;     // Bits of that byte already read by a Huffman pass.
+} index_Checkpoint;
+
+struct stpk_Index {
+	stpk_Context     *ctx;
+	unsigned int     interval;
+	stpk_FmtType     type;
+	unsigned char    count;  // Number of stages.
+	index_Stage      stages[DSI_PASSES_MASK];
+	index_Checkpoint *checkpoints;
+	index_State      *states;  // State of each stage, count per checkpoint.
+	unsigned int     len;      // Number of checkpoints.
+	unsigned int     size;     // Allocated number of checkpoints.
+	unsigned int     next;     // Output to decode before the next checkpoint.
+};
+
+int index_checkState(unsigned char type, const index_State *state, unsigned int len, unsigned int inLen);
+int index_add(stpk_Index *index, index_Checkpoint **checkpoint, index_State **states);
+
+#endif
@@ -17,10 +17,78 @@
  * Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA 02111-1307, USA.
  */
 
+#include <string.h>
+
 #include "rpck.h"
 
+#include "trace.h"
 #include "util.h"
 
+// Write a literal block or a run of up to RPCK_SHORT_MAX bytes with a single
+// whole word store, selecting between the two without a branch. The first
+// source byte is both the first literal and the run value.
+static inline void rpck_storeShort(unsigned char *dst, const unsigned char *src, int literal)
+{
+#if defined(__SSE2__)
+    __m128i lit = _mm_loadu_si128((const __m128i*)src);
+    __m128i run = _mm_set1_epi8((char)src[0]);
+    __m128i mask = _mm_set1_epi8((char)-literal);
+    _mm_storeu_si128((__m128i*)dst, _mm_or_si128(_mm_and_si128(mask, lit), _mm_andnot_si128(mask, run)));
+#else
+    uint64_t lit, run = 0x0101010101010101ULL * src[0], mask = -(uint64_t)literal;
+    memcpy(&lit, src, sizeof(lit));
+    lit = (mask & lit) | (~mask & run);
+    memcpy(dst, &lit, sizeof(lit));
+#endif
+}
+
+// Decode blocks without bounds checks while the longest block fits in both
+// buffers. Short blocks are written by rpck_storeShort() if shortStores is set,
+// or each block is copied or filled after a branch on its type otherwise, as
+// before short stores were added. Called with a constant shortStores, so each
+// mode gets a loop of its own.
+static inline void rpck_decodeFast(stpk_Context *ctx, int shortStores)
+{
+    unsigned char *src = ctx->src.data, *dst = ctx->dst.data;
+    uint32_t srcOffset = ctx->src.offset, srcLen = ctx->src.len, dstOffset = ctx->dst.offset, dstLen = ctx->dst.len;
+
+    while (srcOffset + RPCK_BLOCK_MAX + 1 <= srcLen && dstOffset + RPCK_BLOCK_MAX <= dstLen) {
+        if (!shortStores) {
+            signed char ctrl = src[srcOffset++];
+            if (ctrl < 0) {
+                memcpy(dst + dstOffset, src + srcOffset, -ctrl);
+                srcOffset -= ctrl;
+                dstOffset -= ctrl;
+            }
+            else {
+                util_fill(dst + dstOffset, src[srcOffset++], ctrl + 1);
+                dstOffset += ctrl + 1;
+            }
+            continue;
+        }
+
+        signed char ctrl = src[srcOffset];
+        int literal = ctrl < 0;
+        unsigned int len = literal ? -ctrl : ctrl + 1;
+
+        if (len <= RPCK_SHORT_MAX) {
+            rpck_storeShort(dst + dstOffset, src + srcOffset + 1, literal);
+        }
+        else if (literal) {
+            util_copy(dst + dstOffset, src + srcOffset + 1, len);
+        }
+        else {
+            util_fill(dst + dstOffset, src[srcOffset + 1], len);
+        }
+
+        srcOffset += literal ? len + 1 : 2;
+        dstOffset += len;
+    }
+
+    ctx->src.offset = srcOffset;
+    ctx->dst.offset = dstOffset;
+}
+
 int rpck_isValid(stpk_Context *ctx)
 {
     if (ctx->src.len < RPCK_SIZE_MIN) {
@@ -34,7 +102,10 @@ int rpck_isValid(stpk_Context *ctx)
         && (finalLen - savedLen + RPCK_SIZE_MIN) == ctx->src.len;
 }
 
-unsigned int rpck_decompress(stpk_Context *ctx)
+// Decompress RPck file, or as much of it as the output limit allows, cutting
+// the last block short. The output is written to dst of dstLen bytes and
+// UTIL_DST_PADDING more if it is set, or to a buffer of its own.
+unsigned int rpck_decompress(stpk_Context *ctx, unsigned char *dst, unsigned int dstLen)
 {
     if (ctx->src.len < RPCK_SIZE_MIN) {
         UTIL_ERR("Unexpected EOF while reading RPck header.\n");
@@ -42,7 +113,7 @@ unsigned int rpck_decompress(stpk_Context *ctx)
 	}
     if (!rpck_checkMagic(ctx)) {
         unsigned char magic[5];
-        UTIL_ERR("Invalid magic bytes. Expected \"RPck\" or \"Rpck\", got \"%s\"\n", magic, util_stringCharsSafe(ctx->src.data, magic, sizeof(magic)));
+        UTIL_ERR("Invalid magic bytes. Expected \"RPck\" or \"Rpck\", got \"%s\"\n", util_stringCharsSafe(ctx->src.data, magic, sizeof(magic)));
         return 0;
     }
     ctx->src.offset += 4;
@@ -58,13 +129,35 @@ unsigned int rpck_decompress(stpk_Context *ctx)
     UTIL_VERBOSE1("  %-10s %d\n", "savedLen", savedLen);
     UTIL_VERBOSE1("  %-10s %.2f\n", "ratio", (float)ctx->dst.len / ctx->src.len);
 
-    if (util_allocDst(ctx)) {
+    if (dst != NULL) {
+        if (util_limitLen(ctx) > dstLen) {
+            UTIL_ERR("Destination buffer of %d bytes is too short, expected %d\n", dstLen, util_limitLen(ctx));
+            return 1;
+        }
+        ctx->dst.data = dst;
+    }
+    else if (util_allocDst(ctx)) {
         return 1;
     }
 
-    while (ctx->src.offset < ctx->src.len) {
+    int limited = util_limitLen(ctx) < ctx->dst.len;
+    ctx->dst.len = util_limitLen(ctx);
+
+    UTIL_VERBOSE1("  %-10s %s\n", "store", stpk_fmtRpckStoreStr(ctx->format.rpck.store));
+
+    // Blocks are traced in the careful loop below.
+    if (!TRACE_ON(ctx)) {
+        if (ctx->format.rpck.store == STPK_FMT_RPCK_STORE_BLOCK) {
+            rpck_decodeFast(ctx, 0);
+        }
+        else {
+            rpck_decodeFast(ctx, 1);
+        }
+    }
+
+    // Careful loop with bounds checks near the end of the buffers.
+    while (ctx->src.offset < ctx->src.len && (!limited || ctx->dst.offset < ctx->dst.len)) {
         signed char ctrl = ctx->src.data[ctx->src.offset++];
-        UTIL_VERBOSE2("Offset %04X  Read ctrl %d ", ctx->src.offset - 1, ctrl);
         if (ctrl < 0) {
             if (ctx->src.offset - ctrl > ctx->src.len) {
                 UTIL_ERR("Attempted to read %d byte(s) past end of source buffer at offset %04X",
@@ -73,16 +166,20 @@ unsigned int rpck_decompress(stpk_Context *ctx)
                 return 1;
             }
             if (ctx->dst.offset - ctrl > ctx->dst.len) {
-                UTIL_ERR("Attempted to write %d byte(s) past end of destination buffer at offset %04X",
-                    (ctx->dst.offset - ctrl) - ctx->dst.len,
-                    ctx->dst.offset);
-                return 1;
+                if (limited) {
+                    ctrl = -(signed char)(ctx->dst.len - ctx->dst.offset);
+                }
+                else {
+                    UTIL_ERR("Attempted to write %d byte(s) past end of destination buffer at offset %04X",
+                        (ctx->dst.offset - ctrl) - ctx->dst.len,
+                        ctx->dst.offset);
+                    return 1;
+                }
             }
+            TRACE_EVENT(ctx, STPK_TRACE_RPCK_COPY, ctx->src.offset - 1, ctx->dst.offset, 0, -ctrl, 0, 0, 0);
             for (; ctrl; ctrl++) {
-                UTIL_VERBOSE2(" %02X", ctx->src.data[ctx->src.offset]);
                 ctx->dst.data[ctx->dst.offset++] = ctx->src.data[ctx->src.offset++];
             }
-            UTIL_VERBOSE2("\n");
         }
         else {
             if (ctx->src.offset >= ctx->src.len) {
@@ -91,14 +188,20 @@ unsigned int rpck_decompress(stpk_Context *ctx)
                 return 1;
             }
             unsigned char data = ctx->src.data[ctx->src.offset++];
-            if (ctx->dst.offset + ctrl + 1 > ctx->dst.len) {
-                UTIL_ERR("Attempted to write %d byte(s) past end of destination buffer at offset %04X",
-                    (ctx->dst.offset + ctrl + 1) - ctx->dst.len,
-                    ctx->dst.offset);
-                return 1;
+            unsigned int len = ctrl + 1;
+            if (ctx->dst.offset + len > ctx->dst.len) {
+                if (limited) {
+                    len = ctx->dst.len - ctx->dst.offset;
+                }
+                else {
+                    UTIL_ERR("Attempted to write %d byte(s) past end of destination buffer at offset %04X",
+                        (ctx->dst.offset + len) - ctx->dst.len,
+                        ctx->dst.offset);
+                    return 1;
+                }
             }
-            UTIL_VERBOSE2(" x %02X\n", data);
-            for (int i = ctrl + 1; i; i--) {
+            TRACE_EVENT(ctx, STPK_TRACE_RPCK_FILL, ctx->src.offset - 2, ctx->dst.offset, 0, len, 0, 0, data);
+            for (unsigned int i = len; i; i--) {
                 ctx->dst.data[ctx->dst.offset++] = data;
             }
         }
@@ -106,3 +209,143 @@ unsigned int rpck_decompress(stpk_Context *ctx)
 
     return 0;
 }
+
+// Open an RPck file at the read offset of a stream, where its whole header is
+// buffered.
+unsigned int rpck_streamOpen(stpk_Context *ctx, rpck_Stream *rs, stream_Buffer *in)
+{
+    stpk_Context file = *ctx;
+
+    file.src.data = in->data + in->offset;
+    file.src.offset = 4;
+    file.src.len = stream_avail(in);
+
+    if (!rpck_checkMagic(&file)) {
+        unsigned char magic[5];
+        UTIL_ERR("Invalid magic bytes. Expected \"RPck\" or \"Rpck\", got \"%s\"\n", util_stringCharsSafe(file.src.data, magic, sizeof(magic)));
+        return 1;
+    }
+
+    UTIL_NOVERBOSE("Format: RPck [streamed]\n");
+    UTIL_VERBOSE1("  %-10s %s\n", "format", stpk_fmtTypeStr(ctx->format.type));
+
+    rs->len = rpck_readLength(&file.src);
+    UTIL_VERBOSE1("  %-10s %d\n", "dstLen", rs->len);
+
+    uint32_t savedLen = rpck_readLength(&file.src);
+    UTIL_VERBOSE1("  %-10s %d\n", "savedLen", savedLen);
+
+    in->offset += file.src.offset;
+    rs->offset = 0;
+    rs->literal = 0;
+    rs->runRep = 0;
+
+    return 0;
+}
+
+// Decode the next chunk of an RPck file from a stream into the free part of
+// out, with the fast loop of rpck_decompress() while the longest block fits in
+// both buffers. Streams are not traced.
+unsigned int rpck_streamRead(stpk_Context *ctx, rpck_Stream *rs, stream_Buffer *in, stream_Buffer *out)
+{
+    unsigned char *src = in->data, *dst = out->data;
+    uint32_t srcOffset = in->offset, srcLen = in->len, dstOffset = out->len;
+    uint32_t dstEnd = out->len + UTIL_MIN(out->size - out->len, rs->len - rs->offset), len;
+
+    for (;;) {
+        // Continue a block cut short by the end of either buffer.
+        if (rs->literal) {
+            len = UTIL_MIN(rs->literal, UTIL_MIN(srcLen - srcOffset, dstEnd - dstOffset));
+            memcpy(dst + dstOffset, src + srcOffset, len);
+            srcOffset += len;
+            dstOffset += len;
+            if ((rs->literal -= len)) {
+                break;
+            }
+        }
+        if (rs->runRep) {
+            len = UTIL_MIN(rs->runRep, dstEnd - dstOffset);
+            util_fill(dst + dstOffset, rs->runByte, len);
+            dstOffset += len;
+            if ((rs->runRep -= len)) {
+                break;
+            }
+        }
+
+        while (srcOffset + RPCK_BLOCK_MAX + 1 <= srcLen && dstOffset + RPCK_BLOCK_MAX <= dstEnd) {
+            signed char ctrl = src[srcOffset];
+            int literal = ctrl < 0;
+            len = literal ? -ctrl : ctrl + 1;
+
+            if (len <= RPCK_SHORT_MAX) {
+                rpck_storeShort(dst + dstOffset, src + srcOffset + 1, literal);
+            }
+            else if (literal) {
+                util_copy(dst + dstOffset, src + srcOffset + 1, len);
+            }
+            else {
+                util_fill(dst + dstOffset, src[srcOffset + 1], len);
+            }
+
+            srcOffset += literal ? len + 1 : 2;
+            dstOffset += len;
+        }
+
+        // Start the next block, which the loop above continues.
+        if (srcOffset >= srcLen) {
+            break;
+        }
+
+        signed char ctrl = src[srcOffset];
+        if (ctrl < 0) {
+            len = -ctrl;
+        }
+        else if (srcOffset + 1 < srcLen) {
+            len = ctrl + 1;
+            rs->runByte = src[srcOffset + 1];
+        }
+        else {
+            break;
+        }
+
+        if (len > rs->len - rs->offset - (dstOffset - out->len)) {
+            UTIL_ERR("Attempted to write %d byte(s) past end of destination buffer at offset %04X\n",
+                len - (rs->len - rs->offset - (dstOffset - out->len)),
+                rs->offset + dstOffset - out->len);
+            return 1;
+        }
+
+        if (ctrl < 0) {
+            rs->literal = len;
+            srcOffset++;
+        }
+        else {
+            rs->runRep = len;
+            srcOffset += 2;
+        }
+    }
+
+    in->offset = srcOffset;
+    rs->offset += dstOffset - out->len;
+    out->total += dstOffset - out->len;
+    out->len = dstOffset;
+
+    if (in->end && srcOffset == srcLen) {
+        if (rs->literal) {
+            UTIL_ERR("Attempted to read %d byte(s) past end of source buffer at offset %04X\n",
+                rs->literal,
+                stream_tell(in, srcOffset));
+            return 1;
+        }
+        if (!rs->runRep) {
+            out->end = 1;
+        }
+    }
+    else if (in->end && srcOffset + 1 == srcLen && !rs->literal && !rs->runRep) {
+        UTIL_ERR("Attempted to read 1 byte past end of source buffer at offset %04X\n",
+            stream_tell(in, srcOffset + 1));
+        return 1;
+    }
+
+    return 0;
+}
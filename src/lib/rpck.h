@@ -23,10 +23,37 @@
 #include <stdint.h>
 #include <stunpack.h>
 
+#include "stream.h"
+
 #define RPCK_SIZE_MIN 14
 
+// Length of the magic bytes, decoded length and saved length.
+#define RPCK_HEADER_LEN 12
+
+// Longest literal block or run, encoded by a control byte of -128 or 127.
+#define RPCK_BLOCK_MAX 128
+
+// Longest block written by a single whole word store in the fast loop.
+#if defined(__SSE2__)
+#	define RPCK_SHORT_MAX 16
+#else
+#	define RPCK_SHORT_MAX 8
+#endif
+
+// RPck file decoded from a stream. Blocks cut short by the end of either
+// buffer are continued by the next read.
+typedef struct {
+    unsigned int  len;      // Decoded length.
+    unsigned int  offset;   // Bytes decoded so far.
+    unsigned int  literal;  // Bytes left of the current literal block.
+    unsigned int  runRep;   // Bytes left of the current run.
+    unsigned char runByte;
+} rpck_Stream;
+
 int rpck_isValid(stpk_Context *ctx);
-unsigned int rpck_decompress(stpk_Context *ctx);
+unsigned int rpck_decompress(stpk_Context *ctx, unsigned char *dst, unsigned int dstLen);
+unsigned int rpck_streamOpen(stpk_Context *ctx, rpck_Stream *rs, stream_Buffer *in);
+unsigned int rpck_streamRead(stpk_Context *ctx, rpck_Stream *rs, stream_Buffer *in, stream_Buffer *out);
 
 inline int rpck_checkMagic(stpk_Context *ctx)
 {
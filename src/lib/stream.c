@@ -0,0 +1,805 @@
+/*
+ * stunpack - Stunts/4D [Sports] Driving game resource unpacker
+ * Copyright (C) 2008-2024 Daniel Stien <daniel@stien.org>
+ *  
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ * 
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ * 
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software 
+ * Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA 02111-1307, USA.
+ */
+
+#include <errno.h>
+#include <string.h>
+
+#include "dsi.h"
+#include "dsi_huff.h"
+#include "dsi_rle.h"
+#include "index.h"
+#include "rpck.h"
+#include "util.h"
+
+#include "bitreader.h"
+#include "stream.h"
+
+// Source buffered after a Huffman header before probing the bit stream format,
+// enough for the widest codes of a whole probe and a refill.
+#define STREAM_PROBE_LEN (DSI_PROBE_LEN * DSI_HUFF_LEVELS_MAX / 8 + 8)
+
+// Decoder of a single pass, reading the output of the previous one.
+typedef struct {
+	unsigned char type;  // DSI_TYPE_RLE, DSI_TYPE_HUFF or STREAM_TYPE_RPCK.
+	int           open;  // Header has been read.
+	int           wait;  // Both DSI versions are plausible, waiting for the whole pass.
+	union {
+		dsi_huff_Stream huff;
+		dsi_rle_Stream  rle;
+		rpck_Stream     rpck;
+	};
+} stream_Stage;
+
+struct stpk_Stream {
+	stpk_Context  *ctx;
+	stpk_Format   format;  // Format asked for, put back in the context by stpk_stream_deinit().
+	unsigned int  windowLen;
+	stream_Buffer src;     // Source fed to the stream.
+	stream_Buffer *bufs;   // Output of each stage, the last is read back.
+	stream_Stage  *stages;
+	unsigned char count;   // Number of stages, set up after the file header is read.
+	unsigned char passes;  // Number of passes in the source.
+	int           detect;  // Detect the DSI version of each Huffman pass.
+	stpk_Index    *index;  // Checkpoints recorded while decoding, or NULL.
+	int           done;
+	int           error;   // Decoding failed, and the stream can only be deinitialized.
+};
+
+static int stream_initBuffer(stpk_Context *ctx, stream_Buffer *buf, unsigned int size)
+{
+	if ((buf->data = (unsigned char*)util_alloc(ctx, sizeof(unsigned char) * (size + UTIL_DST_PADDING))) == NULL) {
+		UTIL_ERR("Error allocating memory for stream buffer. (%s)\n", strerror(errno));
+		return 1;
+	}
+
+	buf->offset = buf->len = buf->total = 0;
+	buf->size = size;
+	buf->end = 0;
+
+	return 0;
+}
+
+// Double the size of a buffer for a reader that needs more of its source at
+// once than fits.
+int stream_grow(stpk_Context *ctx, stream_Buffer *buf)
+{
+	unsigned char *data;
+
+	if ((data = (unsigned char*)util_alloc(ctx, sizeof(unsigned char) * (buf->size * 2 + UTIL_DST_PADDING))) == NULL) {
+		UTIL_ERR("Error allocating memory for stream buffer. (%s)\n", strerror(errno));
+		return 1;
+	}
+
+	memcpy(data, buf->data + buf->offset, stream_avail(buf));
+	util_dealloc(ctx, buf->data);
+	buf->data = data;
+	buf->len -= buf->offset;
+	buf->offset = 0;
+	buf->size *= 2;
+
+	return 0;
+}
+
+// Set up a stream decoding the source fed to it through buffers of windowLen
+// bytes, or DSI_WINDOW_LEN if 0. The context must outlive the stream, which
+// sets the format detected in it until deinitialized. Returns NULL on
+// allocation failure.
+stpk_Stream *stpk_stream_init(stpk_Context *ctx, unsigned int windowLen)
+{
+	stpk_Stream *stream;
+
+	if ((stream = (stpk_Stream*)util_alloc(ctx, sizeof(stpk_Stream))) == NULL) {
+		UTIL_ERR("Error allocating memory for stream. (%s)\n", strerror(errno));
+		return NULL;
+	}
+
+	stream->ctx = ctx;
+	stream->format = ctx->format;
+	stream->windowLen = windowLen ? UTIL_MAX(windowLen, STREAM_WINDOW_MIN) : DSI_WINDOW_LEN;
+	stream->bufs = NULL;
+	stream->stages = NULL;
+	stream->count = stream->passes = 0;
+	stream->detect = 0;
+	stream->index = NULL;
+	stream->done = 0;
+	stream->error = 0;
+
+	if (stream_initBuffer(ctx, &stream->src, stream->windowLen)) {
+		util_dealloc(ctx, stream);
+		return NULL;
+	}
+
+	return stream;
+}
+
+void stpk_stream_deinit(stpk_Stream *stream)
+{
+	stpk_Context *ctx = stream->ctx;
+	unsigned int i;
+
+	for (i = 0; i < stream->count; i++) {
+		if (stream->stages[i].type == DSI_TYPE_HUFF && stream->stages[i].open) {
+			dsi_huff_close(ctx, &stream->stages[i].huff);
+		}
+		if (stream->bufs[i].data != NULL) {
+			util_dealloc(ctx, stream->bufs[i].data);
+		}
+	}
+
+	if (stream->stages != NULL) {
+		util_dealloc(ctx, stream->stages);
+	}
+	if (stream->bufs != NULL) {
+		util_dealloc(ctx, stream->bufs);
+	}
+
+	util_dealloc(ctx, stream->src.data);
+	util_restoreFormat(ctx, &stream->format);
+	util_dealloc(ctx, stream);
+}
+
+// Copy up to len bytes of the source into the stream. Returns the number of
+// bytes taken, which is less than len when the stream's source buffer is full
+// and some of the output has to be read first.
+unsigned int stpk_stream_feed(stpk_Stream *stream, const unsigned char *src, unsigned int len)
+{
+	stream_Buffer *in = &stream->src;
+
+	if (in->end) {
+		return 0;
+	}
+
+	if (in->size - in->len < len) {
+		stream_compact(in);
+	}
+
+	len = UTIL_MIN(len, in->size - in->len);
+	memcpy(in->data + in->len, src, len);
+	in->len += len;
+	in->total += len;
+
+	return len;
+}
+
+// Mark the end of the source.
+void stpk_stream_end(stpk_Stream *stream)
+{
+	stream->src.end = 1;
+}
+
+// Record checkpoints of the stream into an index from stpk_index_init() while
+// decoding. Must be set before the first read, and the index outlives the
+// stream.
+void stpk_stream_index(stpk_Stream *stream, stpk_Index *index)
+{
+	stream->index = index;
+}
+
+// Detect the format and read the file header, then set up a stage for each
+// pass to decode. Returns STPK_RET_NEED_INPUT if the header is not buffered
+// yet.
+static unsigned int stream_open(stpk_Stream *stream)
+{
+	stpk_Context *ctx = stream->ctx;
+	stream_Buffer *in = &stream->src;
+	const unsigned char *data = in->data + in->offset;
+	unsigned int i, count, finalLen = 0;
+
+	if (stream_avail(in) < STREAM_PASS_HEADER_LEN) {
+		if (!in->end) {
+			return STPK_RET_NEED_INPUT;
+		}
+
+		UTIL_ERR("Reached EOF while parsing file header\n");
+		return STPK_RET_ERR;
+	}
+
+	// Only the magic bytes of RPck files can be checked before all of the
+	// source is read, and anything else is assumed to be DSI.
+	if (ctx->format.type == STPK_FMT_AUTO) {
+		if (data[0] == 'R' && (data[1] == 'P' || data[1] == 'p') && data[2] == 'c' && data[3] == 'k') {
+			util_setFmtType(ctx, STPK_FMT_RPCK);
+		}
+		else if (data[1] == 0xFB) {
+			util_setFmtType(ctx, STPK_FMT_EAC);
+		}
+		else {
+			util_setFmtType(ctx, STPK_FMT_DSI);
+		}
+	}
+
+	switch (ctx->format.type) {
+		case STPK_FMT_RPCK:
+			stream->passes = count = 1;
+			break;
+		case STPK_FMT_DSI:
+			if (UTIL_GET_FLAG(data[0], DSI_PASSES_RECUR)) {
+				stream->passes = data[0] & DSI_PASSES_MASK;
+				finalLen = dsi_peekLength((unsigned char*)data, 1);
+				in->offset += STREAM_PASS_HEADER_LEN;
+			}
+			else {
+				stream->passes = 1;
+			}
+
+			UTIL_NOVERBOSE("Format: DSI (version: %s) [streamed]\n", stpk_fmtDsiVerStr(ctx->format.dsi.version));
+			UTIL_VERBOSE1("  %-10s %s\n", "format", stpk_fmtTypeStr(ctx->format.type));
+			UTIL_VERBOSE1("  %-10s %s\n", "version", stpk_fmtDsiVerStr(ctx->format.dsi.version));
+			UTIL_VERBOSE1("  %-10s %d\n", "passes", stream->passes);
+			if (stream->passes > 1) {
+				UTIL_VERBOSE1("  %-10s %d\n", "finalLen", finalLen);
+			}
+
+			if (!stream->passes) {
+				UTIL_ERR("Error parsing source file. Expected at least one pass\n");
+				return STPK_RET_ERR;
+			}
+
+			count = ctx->format.dsi.maxPasses > 0 && ctx->format.dsi.maxPasses < stream->passes
+				? ctx->format.dsi.maxPasses
+				: stream->passes;
+			stream->detect = ctx->format.dsi.version == STPK_FMT_DSI_VER_AUTO;
+			ctx->format.dsi.detected = STPK_FMT_DSI_VER_AUTO;
+			break;
+		default:
+			UTIL_ERR("Decompressing %s format as a stream is not supported\n", stpk_fmtTypeStr(ctx->format.type));
+			return STPK_RET_ERR_UNKNOWN_FMT;
+	}
+
+	if ((stream->stages = (stream_Stage*)util_alloc(ctx, sizeof(stream_Stage) * count)) == NULL
+		|| (stream->bufs = (stream_Buffer*)util_alloc(ctx, sizeof(stream_Buffer) * count)) == NULL
+	) {
+		UTIL_ERR("Error allocating memory for stream stages. (%s)\n", strerror(errno));
+		return STPK_RET_ERR;
+	}
+
+	for (i = 0; i < count; i++) {
+		stream->stages[i].type = ctx->format.type == STPK_FMT_RPCK ? STREAM_TYPE_RPCK : 0;
+		stream->stages[i].open = 0;
+		stream->stages[i].wait = 0;
+		stream->bufs[i].data = NULL;
+	}
+	stream->count = count;
+
+	if (stream->index != NULL) {
+		stream->index->type = ctx->format.type;
+		stream->index->count = count;
+	}
+
+	for (i = 0; i < count; i++) {
+		if (stream_initBuffer(ctx, &stream->bufs[i], stream->windowLen)) {
+			return STPK_RET_ERR;
+		}
+	}
+
+	return STPK_RET_OK;
+}
+
+// Get the length of the DSI pass header at the start of data, or as much of it
+// as can be told from the first len bytes.
+static unsigned int stream_passHeaderLen(const unsigned char *data, unsigned int len)
+{
+	if (len < STREAM_PASS_HEADER_LEN) {
+		return STREAM_PASS_HEADER_LEN;
+	}
+
+	switch (data[0]) {
+		case DSI_TYPE_RLE:
+			return STREAM_PASS_HEADER_LEN + dsi_rle_headerLen(data + STREAM_PASS_HEADER_LEN, len - STREAM_PASS_HEADER_LEN);
+		case DSI_TYPE_HUFF:
+			return STREAM_PASS_HEADER_LEN + dsi_huff_headerLen(data + STREAM_PASS_HEADER_LEN, len - STREAM_PASS_HEADER_LEN);
+		default:
+			return STREAM_PASS_HEADER_LEN;
+	}
+}
+
+// Keep what is needed to open a stage again in the index, which is the header
+// of a stage after the first. Headers of Huffman passes after the first are
+// not kept, and the stream is not resumed past them.
+static void stream_indexStage(stpk_Stream *stream, unsigned int i, const stream_Buffer *in)
+{
+	index_Stage *stage;
+
+	if (stream->index == NULL) {
+		return;
+	}
+
+	stage = &stream->index->stages[i];
+	stage->type = stream->stages[i].type;
+	stage->version = stage->type == DSI_TYPE_HUFF && stream->stages[i].huff.br.reverse ? STPK_FMT_DSI_VER_1 : STPK_FMT_DSI_VER_2;
+	stage->len = i && in->offset <= INDEX_HEADER_MAX ? in->offset : 0;
+	memcpy(stage->data, in->data, stage->len);
+}
+
+// Pick the version of a Huffman pass from the beginning of its bit stream, or
+// as much of it as fits, and keep how plausible each version is in valid, as
+// ranked by dsi_probeHuff(). Until the end of the source, only the codes that
+// are surely buffered are probed, which also keeps the last pass from being
+// taken as decoded in whole. Decoding without the whole pass can not be retried
+// with the other version, so if the probe decodes both cleanly, all of the pass
+// is buffered and checked before one is picked. Returns 1 while more of the
+// pass is needed.
+static unsigned int stream_detectHuff(stpk_Stream *stream, unsigned int i, const stream_Buffer *in, unsigned int headerLen, int *valid)
+{
+	stpk_Context *ctx = stream->ctx, probe = *ctx;
+	stream_Stage *stage = &stream->stages[i];
+	unsigned int bits, probeLen;
+	int lastPass = i == stream->passes - 1U;
+
+	if (!in->end && (stage->wait || in->len < UTIL_MIN(headerLen + STREAM_PROBE_LEN, in->size))) {
+		return 1;
+	}
+
+	probe.src.data = in->data;
+	probe.src.offset = STREAM_PASS_HEADER_LEN;
+	probe.src.len = in->len;
+	probe.dst.len = dsi_peekLength((unsigned char*)in->data, 1);
+
+	bits = (in->len - headerLen) * 8;
+	probeLen = in->end ? DSI_PROBE_LEN : bits > 64 ? (bits - 64) / DSI_HUFF_LEVELS_MAX : 0;
+
+	valid[0] = dsi_probeHuff(&probe, STPK_FMT_DSI_VER_1, lastPass, probeLen);
+	valid[1] = dsi_probeHuff(&probe, STPK_FMT_DSI_VER_2, lastPass, probeLen);
+
+	if (valid[0] == DSI_PROBE_OK && valid[1] == DSI_PROBE_OK) {
+		if (!in->end) {
+			// More of the bit stream can not tell them apart once the whole
+			// probe is decoded.
+			stage->wait = probeLen >= UTIL_MIN(DSI_PROBE_LEN, probe.dst.len);
+			return 1;
+		}
+
+		// Check DSI1 all the way too unless DSI2 decodes cleanly.
+		if ((valid[1] = dsi_checkHuff(&probe, STPK_FMT_DSI_VER_2, lastPass)) != DSI_PROBE_OK) {
+			valid[0] = dsi_checkHuff(&probe, STPK_FMT_DSI_VER_1, lastPass);
+		}
+	}
+
+	ctx->format.dsi.version = dsi_pickHuff(valid[0], valid[1]);
+
+	return 0;
+}
+
+// Read the header of a stage once it is buffered. Huffman passes of unknown
+// version wait until stream_detectHuff() picks one, growing the buffer when it
+// is full.
+static unsigned int stream_openStage(stpk_Stream *stream, unsigned int i, stream_Buffer *in)
+{
+	stpk_Context *ctx = stream->ctx;
+	stream_Stage *stage = &stream->stages[i];
+	const unsigned char *data;
+	unsigned int len, headerLen;
+	int valid[2] = {0, 0};
+
+	// Headers are shorter than the shortest buffer.
+	stream_compact(in);
+	data = in->data;
+
+	if (stage->type == STREAM_TYPE_RPCK) {
+		if (in->len < RPCK_HEADER_LEN) {
+			if (!in->end) {
+				return 0;
+			}
+
+			UTIL_ERR("Unexpected EOF while reading RPck header.\n");
+			return 1;
+		}
+
+		if (rpck_streamOpen(ctx, &stage->rpck, in)) {
+			return 1;
+		}
+
+		stage->open = 1;
+		stream_indexStage(stream, i, in);
+		return 0;
+	}
+
+	headerLen = stream_passHeaderLen(data, in->len);
+	if (in->len < headerLen) {
+		if (!in->end) {
+			return 0;
+		}
+
+		UTIL_ERR("Reached EOF while parsing pass %d/%d header\n", i + 1, stream->passes);
+		return 1;
+	}
+
+	if (data[0] == DSI_TYPE_HUFF && stream->detect && stream_detectHuff(stream, i, in, headerLen, valid)) {
+		return stream_avail(in) == in->size && stream_grow(ctx, in);
+	}
+
+	UTIL_NOVERBOSE("Pass %d/%d: ", i + 1, stream->passes);
+	UTIL_VERBOSE1("\nPass %d/%d\n", i + 1, stream->passes);
+
+	stage->type = data[0];
+	len = dsi_peekLength((unsigned char*)data, 1);
+	in->offset = STREAM_PASS_HEADER_LEN;
+	UTIL_VERBOSE1("  %-10s %d\n", "dstLen", len);
+
+	switch (stage->type) {
+		case DSI_TYPE_RLE:
+			UTIL_VERBOSE1("  %-10s Run-length encoding\n", "type");
+
+			if (dsi_rle_streamOpen(ctx, &stage->rle, in, len)) {
+				return 1;
+			}
+
+			UTIL_NOVERBOSE("Run-length [streamed]\n");
+			break;
+		case DSI_TYPE_HUFF:
+			UTIL_VERBOSE1("  %-10s Huffman coding\n", "type");
+
+			if (stream->detect) {
+				UTIL_VERBOSE1("  %-10s %s (plausible %s: %d, %s: %d)\n", "detected",
+					stpk_fmtDsiVerStr(ctx->format.dsi.version),
+					stpk_fmtDsiVerStr(STPK_FMT_DSI_VER_1), valid[0],
+					stpk_fmtDsiVerStr(STPK_FMT_DSI_VER_2), valid[1]
+				);
+			}
+
+			if (dsi_huff_streamOpen(ctx, &stage->huff, in, len)) {
+				return 1;
+			}
+
+			ctx->format.dsi.detected = ctx->format.dsi.version;
+			if (stream->detect) {
+				ctx->format.dsi.version = STPK_FMT_DSI_VER_AUTO;
+			}
+
+			UTIL_NOVERBOSE("Huffman    [streamed]\n");
+			break;
+		default:
+			UTIL_ERR("Error parsing source file. Expected type 1 (run-length) or 2 (Huffman), got %02X\n", stage->type);
+			return 1;
+	}
+
+	stage->open = 1;
+	stream_indexStage(stream, i, in);
+
+	return 0;
+}
+
+// Decode as much as fits of the next chunk of a stage. Once a stage is done,
+// the rest of its source is dropped.
+static unsigned int stream_runStage(stpk_Stream *stream, unsigned int i)
+{
+	stpk_Context *ctx = stream->ctx;
+	stream_Stage *stage = &stream->stages[i];
+	stream_Buffer *in = i ? &stream->bufs[i - 1] : &stream->src, *out = &stream->bufs[i];
+
+	if (out->end) {
+		in->offset = in->len;
+		return 0;
+	}
+
+	// Make room for the output once the reader has caught up or less than half
+	// of the buffer is left.
+	if (out->offset == out->len || out->size - out->len < out->size / 2) {
+		stream_compact(out);
+	}
+
+	if (!stage->open) {
+		if (stream_openStage(stream, i, in)) {
+			return 1;
+		}
+		if (!stage->open) {
+			return 0;
+		}
+	}
+
+	switch (stage->type) {
+		case DSI_TYPE_RLE:
+			return dsi_rle_streamRead(ctx, &stage->rle, in, out);
+		case DSI_TYPE_HUFF:
+			return dsi_huff_streamRead(ctx, &stage->huff, in, out);
+		default:
+			return rpck_streamRead(ctx, &stage->rpck, in, out);
+	}
+}
+
+// Get the state of a stage to resume it from.
+static void stream_saveStage(const stream_Stage *stage, index_State *state)
+{
+	memset(state, 0, sizeof(index_State));
+
+	switch (stage->type) {
+		case DSI_TYPE_RLE:
+			state->offset = stage->rle.offset;
+			state->seqLen = stage->rle.seqLen;
+			state->seqPos = stage->rle.seqPos;
+			state->seqRep = stage->rle.seqRep;
+			state->seqPlain = stage->rle.seqPlain;
+			state->tokenLen = stage->rle.tokenLen;
+			memcpy(state->token, stage->rle.token, DSI_RLE_TOKEN_MAX);
+			state->runRep = stage->rle.runRep;
+			state->runByte = stage->rle.runByte;
+			break;
+		case DSI_TYPE_HUFF:
+			state->offset = stage->huff.offset;
+			state->sum = stage->huff.sum;
+			break;
+		default:
+			state->offset = stage->rpck.offset;
+			state->literal = stage->rpck.literal;
+			state->runRep = stage->rpck.runRep;
+			state->runByte = stage->rpck.runByte;
+			break;
+	}
+}
+
+// Restore the state of a stage, once checked against its pass and the input
+// buffered at its read offset. Returns 1 if it does not match them.
+static int stream_restoreStage(stream_Stage *stage, const index_State *state, unsigned int inLen)
+{
+	unsigned int len = stage->type == DSI_TYPE_RLE ? stage->rle.len : stage->type == DSI_TYPE_HUFF ? stage->huff.len : stage->rpck.len;
+
+	if (index_checkState(stage->type, state, len, inLen)) {
+		return 1;
+	}
+
+	switch (stage->type) {
+		case DSI_TYPE_RLE:
+			stage->rle.offset = state->offset;
+			stage->rle.seqLen = state->seqLen;
+			stage->rle.seqPos = state->seqPos;
+			stage->rle.seqRep = state->seqRep;
+			stage->rle.seqPlain = state->seqPlain;
+			stage->rle.tokenLen = state->tokenLen;
+			memcpy(stage->rle.token, state->token, DSI_RLE_TOKEN_MAX);
+			stage->rle.runRep = state->runRep;
+			stage->rle.runByte = state->runByte;
+			break;
+		case DSI_TYPE_HUFF:
+			stage->huff.offset = state->offset;
+			stage->huff.sum = state->sum;
+			break;
+		default:
+			stage->rpck.offset = state->offset;
+			stage->rpck.literal = state->literal;
+			stage->rpck.runRep = state->runRep;
+			stage->rpck.runByte = state->runByte;
+			break;
+	}
+
+	return 0;
+}
+
+// Record a checkpoint once the output has passed the next one, if every stage
+// can be resumed from the source alone. That is when the stages after the
+// first have consumed all of their input, which also holds any pending
+// sequence pattern, and none of them is a Huffman pass, which would have read
+// ahead into its bit reservoir. A Huffman first stage resumes from its bit
+// position in the source.
+static int stream_checkpoint(stpk_Stream *stream)
+{
+	stpk_Index *index = stream->index;
+	stream_Buffer *in = &stream->src, *out = &stream->bufs[stream->count - 1];
+	index_Checkpoint *checkpoint;
+	index_State *states;
+	const dsi_huff_Stream *hs = &stream->stages[0].huff;
+	unsigned int bits, i;
+
+	if (out->total < index->next || out->end) {
+		return 0;
+	}
+
+	for (i = 0; i < stream->count; i++) {
+		if (!stream->stages[i].open
+			|| (i && (stream->stages[i].type == DSI_TYPE_HUFF || !index->stages[i].len || stream_avail(&stream->bufs[i - 1])))
+		) {
+			return 0;
+		}
+	}
+
+	if (index_add(index, &checkpoint, &states)) {
+		return 1;
+	}
+
+	checkpoint->dstOffset = out->total;
+
+	if (stream->bufs[0].end) {
+		checkpoint->srcOffset = in->total;
+		checkpoint->srcBit = 0;
+	}
+	else if (stream->stages[0].type == DSI_TYPE_HUFF) {
+		bits = stream_tell(in, hs->br.offset) * 8 - hs->br.count;
+		checkpoint->srcOffset = bits / 8;
+		checkpoint->srcBit = bits % 8;
+	}
+	else {
+		checkpoint->srcOffset = stream_tell(in, in->offset);
+		checkpoint->srcBit = 0;
+	}
+
+	for (i = 0; i < stream->count; i++) {
+		stream_saveStage(&stream->stages[i], &states[i]);
+	}
+
+	index->next = out->total + index->interval;
+
+	return 0;
+}
+
+// Set up a new stream to continue from checkpoint n of an index built from the
+// same source of len bytes. The first stage is opened from the headers at the
+// start of the source, and the others from the headers kept in the index. The
+// source is then fed again from where the first stage resumes, and the number
+// of bytes fed is returned in fed.
+unsigned int stream_resume(stpk_Stream *stream, const stpk_Index *index, unsigned int n, const unsigned char *src, unsigned int len, unsigned int *fed)
+{
+	stpk_Context *ctx = stream->ctx;
+	const index_Checkpoint *checkpoint = &index->checkpoints[n];
+	const index_State *states = &index->states[n * index->count];
+	stream_Buffer *in = &stream->src, header;
+	dsi_huff_Stream *hs;
+	unsigned char data[INDEX_HEADER_MAX + UTIL_DST_PADDING];
+	unsigned int retval, i;
+
+	if (stpk_stream_feed(stream, src, len) == len) {
+		stpk_stream_end(stream);
+	}
+
+	if ((retval = stream_open(stream)) != STPK_RET_OK) {
+		stream->error = 1;
+		return retval == STPK_RET_NEED_INPUT ? STPK_RET_ERR : retval;
+	}
+
+	if (stream->count != index->count || checkpoint->srcOffset > len) {
+		UTIL_ERR("Error resuming stream. The index does not match the source\n");
+		stream->error = 1;
+		return STPK_RET_ERR;
+	}
+
+	// The version of each Huffman pass is kept in the index.
+	stream->detect = 0;
+
+	for (i = 0; i < stream->count; i++) {
+		if (index->stages[i].type == DSI_TYPE_HUFF) {
+			ctx->format.dsi.version = (stpk_FmtDsiVer)index->stages[i].version;
+		}
+
+		if (i) {
+			memcpy(data, index->stages[i].data, index->stages[i].len);
+			header.data = data;
+			header.offset = 0;
+			header.len = header.size = header.total = index->stages[i].len;
+			header.end = 1;
+		}
+
+		if (stream_openStage(stream, i, i ? &header : in) || !stream->stages[i].open || stream->stages[i].type != index->stages[i].type) {
+			UTIL_ERR("Error resuming stream. The index does not match the source\n");
+			stream->error = 1;
+			return STPK_RET_ERR;
+		}
+	}
+
+	// Feed the source again from where the first stage resumes, positioned as
+	// when the index was built.
+	in->offset = in->len = 0;
+	in->total = checkpoint->srcOffset;
+	in->end = 0;
+
+	*fed = checkpoint->srcOffset + stpk_stream_feed(stream, src + checkpoint->srcOffset, len - checkpoint->srcOffset);
+	if (*fed == len) {
+		stpk_stream_end(stream);
+	}
+
+	// The first stage resumes from the source buffered, and the others from
+	// empty input.
+	for (i = 0; i < stream->count; i++) {
+		if (stream_restoreStage(&stream->stages[i], &states[i], i ? 0 : in->len)) {
+			UTIL_ERR("Invalid index. Checkpoint %d/%d does not match the source\n", n + 1, index->len);
+			stream->error = 1;
+			return STPK_RET_ERR;
+		}
+		stream->bufs[i].total = states[i].offset;
+	}
+
+	if (stream->stages[0].type == DSI_TYPE_HUFF) {
+		hs = &stream->stages[0].huff;
+		bitreader_init(&hs->br, in->data, 0, in->len, hs->br.reverse);
+		if (checkpoint->srcBit) {
+			bitreader_refill(&hs->br);
+			bitreader_consume(&hs->br, checkpoint->srcBit);
+		}
+
+		hs->src.data = in->data;
+		hs->src.len = in->len;
+		in->offset = hs->src.offset = UTIL_MIN(hs->br.offset, in->len);
+	}
+
+	return STPK_RET_OK;
+}
+
+// Read up to len bytes of output into dst, decoding as much of the source fed
+// so far as is needed. The number of bytes read is returned in read. Returns
+// STPK_RET_OK when all of the output has been read, STPK_RET_MORE_OUTPUT when dst
+// is full, or STPK_RET_NEED_INPUT when more of the source has to be fed, or
+// stpk_stream_end() called, to decode more.
+unsigned int stpk_stream_read(stpk_Stream *stream, unsigned char *dst, unsigned int len, unsigned int *read)
+{
+	stpk_Context *ctx = stream->ctx;
+	stream_Buffer *in, *out;
+	unsigned int retval, consumed, written, size, i;
+	int progress;
+
+	*read = 0;
+
+	if (stream->error) {
+		return STPK_RET_ERR;
+	}
+
+	if (stream->stages == NULL && (retval = stream_open(stream)) != STPK_RET_OK) {
+		stream->error = retval != STPK_RET_NEED_INPUT;
+		return retval;
+	}
+
+	out = &stream->bufs[stream->count - 1];
+
+	for (;;) {
+		i = UTIL_MIN(stream_avail(out), len - *read);
+		memcpy(dst + *read, out->data + out->offset, i);
+		out->offset += i;
+		*read += i;
+
+		if (out->end && !stream_avail(out)) {
+			if (!stream->done && stream->count < stream->passes) {
+				UTIL_MSG("Parsing limited to %d decompression pass(es), aborting.\n", stream->count);
+			}
+			stream->done = 1;
+			return STPK_RET_OK;
+		}
+
+		if (*read == len) {
+			return STPK_RET_MORE_OUTPUT;
+		}
+
+		// Run every stage once, and stop when none of them gets any further.
+		progress = 0;
+		for (i = 0; i < stream->count; i++) {
+			in = i ? &stream->bufs[i - 1] : &stream->src;
+			consumed = stream_tell(in, in->offset);
+			size = in->size;
+			written = stream->bufs[i].total + stream->bufs[i].end;
+
+			if (stream_runStage(stream, i)) {
+				stream->error = 1;
+				return STPK_RET_ERR;
+			}
+
+			progress |= consumed != stream_tell(in, in->offset) || size != in->size
+				|| written != stream->bufs[i].total + stream->bufs[i].end;
+		}
+
+		if (progress && stream->index != NULL && stream_checkpoint(stream)) {
+			stream->error = 1;
+			return STPK_RET_ERR;
+		}
+
+		if (!progress) {
+			if (stream->src.end || stream_avail(&stream->src) == stream->src.size) {
+				UTIL_ERR("Stream stopped decoding before the end of the output\n");
+				stream->error = 1;
+				return STPK_RET_ERR;
+			}
+
+			return STPK_RET_NEED_INPUT;
+		}
+	}
+}
@@ -0,0 +1,75 @@
+/*
+ * stunpack - Stunts/4D [Sports] Driving game resource unpacker
+ * Copyright (C) 2008-2024 Daniel Stien <daniel@stien.org>
+ *  
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ * 
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ * 
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software 
+ * Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA 02111-1307, USA.
+ */
+
+#ifndef STPK_LIB_STREAM_H
+#define STPK_LIB_STREAM_H
+
+#include <string.h>
+
+#include <stunpack.h>
+
+// Shortest window a stream is decoded through, which holds the longest pass
+// header.
+#define STREAM_WINDOW_MIN 0x400
+
+// Length of the type and decoded length in front of each DSI pass.
+#define STREAM_PASS_HEADER_LEN 4
+
+// Stage type of RPck streams, next to DSI_TYPE_RLE and DSI_TYPE_HUFF.
+#define STREAM_TYPE_RPCK  0x80
+
+// Buffer between two stages of a stream, or at either end of it. The writer
+// appends at len and the reader consumes from offset. Bytes before offset are
+// no longer needed, and are dropped when the buffer is compacted, so readers
+// keep anything they return to at offset.
+typedef struct {
+	unsigned char *data;
+	unsigned int  offset;
+	unsigned int  len;
+	unsigned int  size;   // Allocated length, not including UTIL_DST_PADDING.
+	unsigned int  total;  // Bytes written since the start of the stream.
+	int           end;    // Nothing more will be written.
+} stream_Buffer;
+
+int stream_grow(stpk_Context *ctx, stream_Buffer *buf);
+unsigned int stream_resume(stpk_Stream *stream, const stpk_Index *index, unsigned int n, const unsigned char *src, unsigned int len, unsigned int *fed);
+
+// Number of bytes written but not yet consumed.
+static inline unsigned int stream_avail(const stream_Buffer *buf)
+{
+	return buf->len - buf->offset;
+}
+
+// Get the position of a buffer offset counted from the start of the stream.
+static inline unsigned int stream_tell(const stream_Buffer *buf, unsigned int offset)
+{
+	return buf->total - buf->len + offset;
+}
+
+// Move the unconsumed bytes to the start of the buffer.
+static inline void stream_compact(stream_Buffer *buf)
+{
+	if (buf->offset) {
+		memmove(buf->data, buf->data + buf->offset, buf->len - buf->offset);
+		buf->len -= buf->offset;
+		buf->offset = 0;
+	}
+}
+
+#endif
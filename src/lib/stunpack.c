@@ -35,26 +35,35 @@ stpk_Context stpk_init(stpk_Format format, int verbosity, stpk_LogCallback logCa
 	stpk_Context ctx;
 	ctx.src = empty;
 	ctx.dst = empty;
+	ctx.limit = 0;
+	ctx.scratch = empty;
 	ctx.format = format;
 	ctx.verbosity = verbosity;
 	ctx.logCallback = logCallback;
+	ctx.logSink = NULL;
+	ctx.logData = NULL;
 	ctx.allocCallback = allocCallback;
 	ctx.deallocCallback = deallocCallback;
+	ctx.allocator.alloc = NULL;
+	ctx.allocator.dealloc = NULL;
+	ctx.allocator.userData = NULL;
+	ctx.align = 0;
+	ctx.trace = NULL;
 
 	return ctx;
 }
 
 void stpk_deinit(stpk_Context *ctx)
 {
-	if (ctx->deallocCallback) {
+	if (ctx->deallocCallback || ctx->allocator.alloc != NULL) {
 		if (ctx->src.data != NULL) {
-			ctx->deallocCallback(ctx->src.data);
+			util_dealloc(ctx, ctx->src.data);
 			ctx->src.data = NULL;
 			ctx->src.len = 0;
 			ctx->src.offset = 0;
 		}
 		if (ctx->dst.data != NULL) {
-			ctx->deallocCallback(ctx->dst.data);
+			util_dealloc(ctx, ctx->dst.data);
 			ctx->dst.data = NULL;
 			ctx->dst.len = 0;
 			ctx->dst.offset = 0;
@@ -62,40 +71,160 @@ void stpk_deinit(stpk_Context *ctx)
 	}
 }
 
+// Set the format detected for the duration of a call, which restores the one
+// asked for with util_restoreFormat() when done.
+static stpk_FmtType stpk_detectFmtType(stpk_Context *ctx)
+{
+	if (ctx->format.type == STPK_FMT_AUTO) {
+		util_setFmtType(ctx, stpk_getFmtType(ctx));
+	}
+
+	return ctx->format.type;
+}
+
 unsigned int stpk_decompress(stpk_Context *ctx)
 {
-	switch (stpk_getFmtType(ctx)) {
+	unsigned int retval;
+	stpk_Format format = ctx->format;
+
+	switch (stpk_detectFmtType(ctx)) {
 		case STPK_FMT_RPCK:
-			return rpck_decompress(ctx);
+			retval = rpck_decompress(ctx, NULL, 0);
+			break;
 		case STPK_FMT_DSI:
-			return dsi_decompress(ctx);
+			retval = dsi_decompress(ctx);
+			break;
 		default:
-			return STPK_RET_ERR_UNKNOWN_FMT;
+			retval = STPK_RET_ERR_UNKNOWN_FMT;
 	}
+
+	util_restoreFormat(ctx, &format);
+
+	return retval;
 }
 
-// Guess format type if user didn't specify format in context.
+// Decompress into the caller's buffer dst of dstLen bytes, at least
+// stpk_getDecompressedSize(), with STPK_DST_PADDING bytes to spare past it.
+// Working memory of stpk_getScratchLen() bytes is taken from scratch, so
+// nothing is allocated. The source is left to the caller, dst.len is set to the
+// length decompressed and dst.data is left unset.
+unsigned int stpk_decompressInto(stpk_Context *ctx, unsigned char *dst, unsigned int dstLen, unsigned char *scratch, unsigned int scratchLen)
+{
+	unsigned int retval, len;
+	stpk_Format format = ctx->format;
+	stpk_Buffer src = ctx->src, empty = {
+		.data = NULL,
+		.offset = 0,
+		.len = 0
+	};
+
+	if (scratchLen < (len = stpk_getScratchLen(ctx))) {
+		UTIL_ERR("Scratch region of %d bytes is too short, expected %d\n", scratchLen, len);
+		return 1;
+	}
+
+	ctx->scratch.data = scratch;
+	ctx->scratch.offset = 0;
+	ctx->scratch.len = scratchLen;
+
+	switch (stpk_detectFmtType(ctx)) {
+		case STPK_FMT_RPCK:
+			retval = rpck_decompress(ctx, dst, dstLen);
+			break;
+		case STPK_FMT_DSI:
+			retval = dsi_decompressInto(ctx, dst, dstLen);
+			break;
+		default:
+			retval = STPK_RET_ERR_UNKNOWN_FMT;
+	}
+
+	ctx->src = src;
+	ctx->dst.data = NULL;
+	ctx->scratch = empty;
+	util_restoreFormat(ctx, &format);
+
+	return retval;
+}
+
+// Guess format type if user didn't specify format in context. The context is
+// left as it is, so it can be used for files of other formats.
 stpk_FmtType stpk_getFmtType(stpk_Context *ctx)
 {
-	if (ctx->format.type == STPK_FMT_AUTO) {
-		if (rpck_isValid(ctx)) {
-			ctx->format.type = STPK_FMT_RPCK;
-		}
-		// TODO: Check other header details, cleanup, move to eac.c.
-		else if (ctx->src.data[1] == 0xFB) {
-			ctx->format.type = STPK_FMT_EAC;
-		}
-		else if (dsi_isValid(ctx)) {
-			ctx->format.type = STPK_FMT_DSI;
-			ctx->format.dsi.version = STPK_FMT_DSI_VER_AUTO;
-			ctx->format.dsi.maxPasses = 0;
-		}
-		else {
-			ctx->format.type = STPK_FMT_UNKNOWN;
-		}
+	if (ctx->format.type != STPK_FMT_AUTO) {
+		return ctx->format.type;
 	}
 
-	return ctx->format.type;
+	if (rpck_isValid(ctx)) {
+		return STPK_FMT_RPCK;
+	}
+	// TODO: Check other header details, cleanup, move to eac.c.
+	else if (ctx->src.data[1] == 0xFB) {
+		return STPK_FMT_EAC;
+	}
+	else if (dsi_isValid(ctx)) {
+		return STPK_FMT_DSI;
+	}
+
+	return STPK_FMT_UNKNOWN;
+}
+
+// Get the length of a buffer for decompressing in place, with the source at
+// its end. Only the headers at the source offset are read, so the rest of the
+// source does not need to be loaded yet. Returns 0 if the format does not
+// support decompressing in place.
+unsigned int stpk_getInPlaceLen(stpk_Context *ctx)
+{
+	unsigned int len = 0;
+	stpk_Format format = ctx->format;
+
+	if (stpk_detectFmtType(ctx) == STPK_FMT_DSI) {
+		len = dsi_inPlaceLen(ctx);
+	}
+
+	util_restoreFormat(ctx, &format);
+
+	return len;
+}
+
+// Get the length of the output from the headers at the source offset without
+// decoding, as limited by the output limit. Returns 0 if it can not be told.
+unsigned int stpk_getDecompressedSize(stpk_Context *ctx)
+{
+	unsigned int len = 0;
+	stpk_Format format = ctx->format;
+
+	switch (stpk_detectFmtType(ctx)) {
+		case STPK_FMT_RPCK:
+			if (ctx->src.offset <= ctx->src.len && ctx->src.len - ctx->src.offset >= RPCK_SIZE_MIN) {
+				len = rpck_peekLength(ctx->src.data, ctx->src.offset + 4);
+				len = ctx->limit && ctx->limit < len ? ctx->limit : len;
+			}
+			break;
+		case STPK_FMT_DSI:
+			len = dsi_decompressedLen(ctx);
+			break;
+		default:
+			break;
+	}
+
+	util_restoreFormat(ctx, &format);
+
+	return len;
+}
+
+// Get the length of the scratch region stpk_decompressInto() needs.
+unsigned int stpk_getScratchLen(stpk_Context *ctx)
+{
+	unsigned int len = 0;
+	stpk_Format format = ctx->format;
+
+	if (stpk_detectFmtType(ctx) == STPK_FMT_DSI) {
+		len = dsi_scratchLen(ctx);
+	}
+
+	util_restoreFormat(ctx, &format);
+
+	return len;
 }
 
 const char *stpk_fmtTypeStr(stpk_FmtType type)
@@ -127,3 +256,29 @@ const char *stpk_fmtDsiVerStr(stpk_FmtDsiVer version)
 			return "unknown";
 	}
 }
+
+const char *stpk_fmtDsiMultiStr(stpk_FmtDsiMulti multi)
+{
+	switch (multi) {
+		case STPK_FMT_DSI_MULTI_AUTO:
+			return "auto";
+		case STPK_FMT_DSI_MULTI_OFF:
+			return "off";
+		case STPK_FMT_DSI_MULTI_ON:
+			return "on";
+		default:
+			return "unknown";
+	}
+}
+
+const char *stpk_fmtRpckStoreStr(stpk_FmtRpckStore store)
+{
+	switch (store) {
+		case STPK_FMT_RPCK_STORE_SHORT:
+			return "short";
+		case STPK_FMT_RPCK_STORE_BLOCK:
+			return "block";
+		default:
+			return "unknown";
+	}
+}
@@ -0,0 +1,192 @@
+/*
+ * stunpack - Stunts/4D [Sports] Driving game resource unpacker
+ * Copyright (C) 2008-2024 Daniel Stien <daniel@stien.org>
+ *  
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ * 
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ * 
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software 
+ * Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA 02111-1307, USA.
+ */
+
+#include <stdint.h>
+#include <stdio.h>
+
+#include "util.h"
+
+#include "trace.h"
+
+static void trace_put16(unsigned char *dst, uint16_t val)
+{
+	dst[0] = val & 0xFF;
+	dst[1] = (val >> 8) & 0xFF;
+}
+
+static void trace_put32(unsigned char *dst, uint32_t val)
+{
+	trace_put16(dst, val & 0xFFFF);
+	trace_put16(dst + 2, (val >> 16) & 0xFFFF);
+}
+
+static uint16_t trace_get16(const unsigned char *src)
+{
+	return src[0] | src[1] << 8;
+}
+
+static uint32_t trace_get32(const unsigned char *src)
+{
+	return trace_get16(src) | (uint32_t)trace_get16(src + 2) << 16;
+}
+
+// Record an event in the trace of the context, and print it as text if very
+// verbose.
+void trace_record(stpk_Context *ctx, stpk_TraceType type, unsigned int srcOffset, unsigned int dstOffset, unsigned short bits, unsigned short len, unsigned char count, unsigned char width, unsigned char value)
+{
+	stpk_Trace *trace = ctx->trace;
+	stpk_TraceEvent event;
+	char str[TRACE_STR_LEN];
+
+	event.srcOffset = srcOffset;
+	event.dstOffset = dstOffset;
+	event.bits = bits;
+	event.len = len;
+	event.type = type;
+	event.count = count;
+	event.width = width;
+	event.value = value;
+
+	if (ctx->verbosity > 2) {
+		stpk_trace_format(&event, str, sizeof(str));
+		UTIL_LOG(1, STPK_LOG_INFO, "%s\n", str);
+	}
+
+	if (trace == NULL) {
+		return;
+	}
+
+	trace->events[trace->next++] = event;
+	trace->len = UTIL_MIN(trace->len + 1, trace->size);
+
+	if (trace->next == trace->size) {
+		trace->next = 0;
+		if (trace->flush != NULL) {
+			trace->flush(trace->userData, trace->events, trace->size);
+			trace->len = 0;
+		}
+	}
+}
+
+// Format an event as a line of the text table of its decoder, without line
+// break. Returns the length of the line, which is cut short to fit in len bytes.
+unsigned int stpk_trace_format(const stpk_TraceEvent *event, char *str, unsigned int len)
+{
+	char bits[UTIL_BITS16_LEN];
+	int ret;
+
+	switch (event->type) {
+		case STPK_TRACE_HUFF_REFILL:
+			ret = snprintf(str, len, "%6u %6u %2d %2d %04X %s %02X -> Refilled bit reservoir",
+				event->srcOffset, event->dstOffset, event->count, event->width, event->bits,
+				util_stringBits16(event->bits, bits), event->bits >> 8);
+			break;
+
+		case STPK_TRACE_HUFF_ESCAPE:
+			ret = snprintf(str, len, "%6u %6u %2d %2d %04X %s %02X -> Escaping to second level table",
+				event->srcOffset, event->dstOffset, event->count, event->width, event->bits,
+				util_stringBits16(event->bits, bits), event->bits >> 8);
+			break;
+
+		case STPK_TRACE_HUFF_SYMBOL:
+			ret = snprintf(str, len, "%6u %6u %2d %2d %04X %s %02X -> Wrote %02X",
+				event->srcOffset, event->dstOffset, event->count, event->width, event->bits,
+				util_stringBits16(event->bits, bits), event->bits >> 8, event->value);
+			break;
+
+		case STPK_TRACE_HUFF_MULTI:
+			ret = snprintf(str, len, "%6u %6u %2d %2d %04X %s %02X -> Wrote %d symbol(s) from multi-symbol table",
+				event->srcOffset, event->dstOffset, event->count, event->width, event->bits,
+				util_stringBits16(event->bits, bits), event->bits >> 8, event->len);
+			break;
+
+		case STPK_TRACE_RLE_RUN:
+			ret = snprintf(str, len, "%6u %6u    %02X  %02X", event->srcOffset, event->dstOffset, event->len, event->value);
+			break;
+
+		case STPK_TRACE_RLE_LITERAL:
+			ret = snprintf(str, len, "%6u %6u        %02X", event->srcOffset, event->dstOffset, event->value);
+			break;
+
+		case STPK_TRACE_RPCK_COPY:
+			ret = snprintf(str, len, "Offset %04X  Read ctrl %d  copy %d to %04X", event->srcOffset, -event->len, event->len, event->dstOffset);
+			break;
+
+		case STPK_TRACE_RPCK_FILL:
+			ret = snprintf(str, len, "Offset %04X  Read ctrl %d  x %02X", event->srcOffset, event->len - 1, event->value);
+			break;
+
+		default:
+			ret = snprintf(str, len, "Unknown event type %d", event->type);
+			break;
+	}
+
+	return ret < 0 ? 0 : UTIL_MIN((unsigned int)ret, len ? len - 1 : 0);
+}
+
+// Get the header of the text table that events of a type are formatted for.
+// Events of the same decoder share a header.
+const char *stpk_trace_header(stpk_TraceType type)
+{
+	switch (type) {
+		case STPK_TRACE_HUFF_REFILL:
+		case STPK_TRACE_HUFF_ESCAPE:
+		case STPK_TRACE_HUFF_SYMBOL:
+		case STPK_TRACE_HUFF_MULTI:
+			return "srcOff dstOff rW cW curWord               cd    Description\n"
+			       "~~~~~~ ~~~~~~ ~~ ~~ ~~~~~~~~~~~~~~~~~~~~~ ~~    ~~~~~~~~~~~~~~~~~~\n";
+		case STPK_TRACE_RLE_RUN:
+		case STPK_TRACE_RLE_LITERAL:
+			return "srcOff dstOff   rep cur\n"
+			       "~~~~~~ ~~~~~~ ~~~~~ ~~~\n";
+		default:
+			return "";
+	}
+}
+
+// Pack events into len * STPK_TRACE_EVENT_LEN bytes of little-endian fields,
+// for saving a trace to be formatted elsewhere.
+void stpk_trace_pack(const stpk_TraceEvent *events, unsigned int len, unsigned char *dst)
+{
+	for (; len; len--, events++, dst += STPK_TRACE_EVENT_LEN) {
+		trace_put32(dst, events->srcOffset);
+		trace_put32(dst + 4, events->dstOffset);
+		trace_put16(dst + 8, events->bits);
+		trace_put16(dst + 10, events->len);
+		dst[12] = events->type;
+		dst[13] = events->count;
+		dst[14] = events->width;
+		dst[15] = events->value;
+	}
+}
+
+// Unpack len events packed by stpk_trace_pack().
+void stpk_trace_unpack(const unsigned char *src, unsigned int len, stpk_TraceEvent *events)
+{
+	for (; len; len--, events++, src += STPK_TRACE_EVENT_LEN) {
+		events->srcOffset = trace_get32(src);
+		events->dstOffset = trace_get32(src + 4);
+		events->bits = trace_get16(src + 8);
+		events->len = trace_get16(src + 10);
+		events->type = src[12];
+		events->count = src[13];
+		events->width = src[14];
+		events->value = src[15];
+	}
+}
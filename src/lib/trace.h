@@ -0,0 +1,51 @@
+/*
+ * stunpack - Stunts/4D [Sports] Driving game resource unpacker
+ * Copyright (C) 2008-2024 Daniel Stien <daniel@stien.org>
+ *  
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ * 
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ * 
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software 
+ * Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA 02111-1307, USA.
+ */
+
+#ifndef STPK_LIB_TRACE_H
+#define STPK_LIB_TRACE_H
+
+#include <stunpack.h>
+
+#include "util.h"
+
+// Tracing is compiled out of the decoders if defined as 0, so they carry no
+// checks for it.
+#ifndef STPK_TRACE
+#	define STPK_TRACE 1
+#endif
+
+// Longest line of text formatted for an event.
+#define TRACE_STR_LEN 0x80
+
+#if STPK_TRACE
+// Whether decoders record events, which makes them decode one step at a time
+// in their careful loops.
+#	define TRACE_ON(ctx) ((ctx)->trace != NULL || (ctx)->verbosity > 2)
+#	define TRACE_EVENT(ctx, ...) if (TRACE_ON(ctx)) trace_record((ctx), __VA_ARGS__)
+#else
+#	define TRACE_ON(ctx) 0
+#	define TRACE_EVENT(ctx, ...)
+#endif
+
+// Print the table header for the events of a decoder when tracing as text.
+#define TRACE_HEADER(type) UTIL_LOG(TRACE_ON(ctx) && ctx->verbosity > 2, STPK_LOG_INFO, "\n%s", stpk_trace_header(type))
+
+void trace_record(stpk_Context *ctx, stpk_TraceType type, unsigned int srcOffset, unsigned int dstOffset, unsigned short bits, unsigned short len, unsigned char count, unsigned char width, unsigned char value);
+
+#endif
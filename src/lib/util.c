@@ -19,13 +19,141 @@
 
 #include <ctype.h>
 #include <errno.h>
+#include <stdarg.h>
 #include <string.h>
 
+#if defined(__SSE2__)
+#	include <emmintrin.h>
+#endif
+
 #include "util.h"
 
+// Pass a message to the context's log sink along with its user data.
+void util_log(const stpk_Context *ctx, stpk_LogType type, const char *msg, ...)
+{
+	va_list args;
+
+	va_start(args, msg);
+	ctx->logSink(ctx->logData, type, msg, args);
+	va_end(args);
+}
+
+// Set the detected format type, with the default options of the format.
+void util_setFmtType(stpk_Context *ctx, stpk_FmtType type)
+{
+	ctx->format.type = type;
+
+	if (type == STPK_FMT_DSI) {
+		ctx->format.dsi.version = STPK_FMT_DSI_VER_AUTO;
+		ctx->format.dsi.maxPasses = 0;
+		ctx->format.dsi.multi = STPK_FMT_DSI_MULTI_AUTO;
+		ctx->format.dsi.inPlace = 0;
+		ctx->format.dsi.detected = STPK_FMT_DSI_VER_AUTO;
+	}
+	else if (type == STPK_FMT_RPCK) {
+		ctx->format.rpck.store = STPK_FMT_RPCK_STORE_SHORT;
+	}
+}
+
+// Put back the format asked for after decoding with the one detected, keeping
+// the DSI version detected, so the context can be used for the next file.
+void util_restoreFormat(stpk_Context *ctx, const stpk_Format *format)
+{
+	stpk_FmtDsiVer detected = ctx->format.dsi.detected;
+	int dsi = ctx->format.type == STPK_FMT_DSI;
+
+	ctx->format = *format;
+
+	if (dsi) {
+		ctx->format.dsi.detected = detected;
+	}
+}
+
+// Take size bytes aligned to align from the unused part of a region, followed
+// by a footer for util_unbump(). Returns NULL if they do not fit.
+void *util_bump(stpk_Buffer *region, unsigned int size, unsigned int align)
+{
+	uintptr_t addr = (uintptr_t)(region->data + region->offset);
+	unsigned int offset = region->offset + (unsigned int)((align - addr % align) % align);
+	unsigned int footer[2];
+
+	if (offset > region->len || region->len - offset < size || region->len - offset - size < UTIL_BUMP_FOOTER_LEN) {
+		return NULL;
+	}
+
+	footer[0] = region->offset;
+	footer[1] = offset;
+	memcpy(region->data + offset + size, footer, UTIL_BUMP_FOOTER_LEN);
+	region->offset = offset + size + UTIL_BUMP_FOOTER_LEN;
+
+	return region->data + offset;
+}
+
+// Give back memory taken by util_bump() if it is the last taken that is still
+// in use, as told by the footer at the end of the part in use. Anything else is
+// only given back when the region is emptied, as memory taken after it may
+// still be in use. Returns whether ptr is within the region at all.
+int util_unbump(stpk_Buffer *region, void *ptr)
+{
+	unsigned char *data = (unsigned char*)ptr;
+	unsigned int footer[2];
+
+	if (data < region->data || data >= region->data + region->len) {
+		return 0;
+	}
+
+	if (region->offset >= UTIL_BUMP_FOOTER_LEN) {
+		memcpy(footer, region->data + region->offset - UTIL_BUMP_FOOTER_LEN, UTIL_BUMP_FOOTER_LEN);
+
+		if (data == region->data + footer[1]) {
+			region->offset = footer[0];
+		}
+	}
+
+	return 1;
+}
+
+// Allocate memory for decoding, aligned as the context asks. While
+// decompressing into caller buffers, it is taken from the scratch region
+// instead, and is only reused if freed in reverse order of allocation.
+void *util_alloc(stpk_Context *ctx, unsigned int size)
+{
+	void *ptr;
+
+	if (ctx->scratch.data != NULL) {
+		if ((ptr = util_bump(&ctx->scratch, size, util_align(ctx))) == NULL) {
+			UTIL_ERR("Scratch region of %d bytes is too short, %d bytes in use and %d more needed\n", ctx->scratch.len, ctx->scratch.offset, size);
+		}
+
+		return ptr;
+	}
+
+	if (ctx->allocator.alloc != NULL) {
+		return ctx->allocator.alloc(ctx->allocator.userData, size, util_align(ctx));
+	}
+
+	return ctx->allocCallback(size);
+}
+
+// Free memory from util_alloc().
+void util_dealloc(stpk_Context *ctx, void *ptr)
+{
+	if (ctx->scratch.data != NULL) {
+		util_unbump(&ctx->scratch, ptr);
+	}
+	else if (ctx->allocator.alloc != NULL) {
+		ctx->allocator.dealloc(ctx->allocator.userData, ptr);
+	}
+	else {
+		ctx->deallocCallback(ptr);
+	}
+}
+
+// Allocate the destination buffer, only as long as the output limit if it is
+// set.
 int util_allocDst(stpk_Context *ctx)
 {
-	if ((ctx->dst.data = (unsigned char*)ctx->allocCallback(sizeof(unsigned char) * ctx->dst.len)) == NULL) {
+	if ((ctx->dst.data = (unsigned char*)util_alloc(ctx, sizeof(unsigned char) * (util_limitLen(ctx) + UTIL_DST_PADDING))) == NULL) {
 		UTIL_ERR("Error allocating memory for destination buffer. (%s)\n", strerror(errno));
 		return 1;
 	}
@@ -36,7 +164,7 @@ int util_allocDst(stpk_Context *ctx)
 void util_dst2src(stpk_Context *ctx)
 {
 	if (ctx->src.data != NULL) {
-		ctx->deallocCallback(ctx->src.data);
+		util_dealloc(ctx, ctx->src.data);
 	}
 	ctx->src.data = ctx->dst.data;
 	ctx->src.len = ctx->dst.len;
@@ -44,15 +172,71 @@ void util_dst2src(stpk_Context *ctx)
 	ctx->src.offset = ctx->dst.offset = 0;
 }
 
- // Write bit values as string to static char[16] buffer. Used in verbose output.
-char *util_stringBits16(unsigned short val)
+// Print progress bar marks for each step percent passed by offset. Returns the
+// offset of the next mark, so decoders only need to call this when they reach it.
+unsigned int util_progress(const stpk_Context *ctx, unsigned int *progress, unsigned int step, unsigned int offset, unsigned int len)
+{
+	if (!ctx->verbosity || ctx->verbosity > 2) {
+		return UTIL_PROGRESS_NONE;
+	}
+
+	while (*progress * step <= 100 && (unsigned long long)offset * 100 >= (unsigned long long)len * *progress * step) {
+		UTIL_LOG(1, STPK_LOG_INFO, "%4d%%", *progress * step);
+		(*progress)++;
+	}
+
+	if (*progress * step > 100) {
+		return UTIL_PROGRESS_NONE;
+	}
+
+	// Smallest offset where offset * 100 / len reaches the next mark.
+	return (unsigned int)(((unsigned long long)len * *progress * step + 99) / 100);
+}
+
+// Replace each byte with the sum of itself and all preceding bytes, modulo 256,
+// continuing from the given initial sum. Returns the last sum.
+unsigned char util_prefixSum(unsigned char *data, unsigned int len, unsigned char sum)
+{
+	unsigned int i = 0;
+
+#if defined(__SSE2__)
+	__m128i cur, carry = _mm_set1_epi8((char)sum);
+
+	// Sum within each 16 byte block in four shift-and-add steps, then add the
+	// running sum carried over from the previous block.
+	for (; i + 16 <= len; i += 16) {
+		cur = _mm_loadu_si128((const __m128i*)(data + i));
+		cur = _mm_add_epi8(cur, _mm_slli_si128(cur, 1));
+		cur = _mm_add_epi8(cur, _mm_slli_si128(cur, 2));
+		cur = _mm_add_epi8(cur, _mm_slli_si128(cur, 4));
+		cur = _mm_add_epi8(cur, _mm_slli_si128(cur, 8));
+		cur = _mm_add_epi8(cur, carry);
+		_mm_storeu_si128((__m128i*)(data + i), cur);
+
+		// Broadcast the last byte.
+		cur = _mm_unpackhi_epi8(cur, cur);
+		cur = _mm_shufflehi_epi16(cur, 0xFF);
+		carry = _mm_unpackhi_epi64(cur, cur);
+	}
+	sum = (unsigned char)_mm_cvtsi128_si32(carry);
+#endif
+
+	for (; i < len; i++) {
+		data[i] = sum += data[i];
+	}
+
+	return sum;
+}
+
+// Write bit values as string to str of UTIL_BITS16_LEN chars. Used in verbose
+// output.
+char *util_stringBits16(unsigned short val, char *str)
 {
-	static char buf[16 + 1];
 	int i;
-	for (i = 0; i < 16; i++) buf[(16 - 1) - i] = '0' + UTIL_GET_FLAG(val, (1 << i));
-	buf[i] = 0;
+	for (i = 0; i < 16; i++) str[(16 - 1) - i] = '0' + UTIL_GET_FLAG(val, (1 << i));
+	str[i] = 0;
 
-	return buf;
+	return str;
 }
 
 // Copy n-1 bytes from source to fixed destination buffer as printable ASCII characters.
@@ -61,7 +245,7 @@ unsigned char *util_stringCharsSafe(const unsigned char *src, unsigned char *dst
     for (unsigned i = 0; i < len - 1; i++) {
         dst[i] = isprint(src[i]) ? src[i] : '.';
     }
-    dst[len] = 0;
+    dst[len - 1] = 0;
     return dst;
 }
 
@@ -70,15 +254,15 @@ void util_printArray(const stpk_Context *ctx, const unsigned char *arr, unsigned
 {
 	unsigned int i = 0;
 
-	ctx->logCallback(STPK_LOG_INFO, "  %s[%02X]\n", name, len);
-	ctx->logCallback(STPK_LOG_INFO, "    0  1  2  3  4  5  6  7  8  9  A  B  C  D  E  F\n");
+	UTIL_LOG(1, STPK_LOG_INFO, "  %s[%02X]\n", name, len);
+	UTIL_LOG(1, STPK_LOG_INFO, "    0  1  2  3  4  5  6  7  8  9  A  B  C  D  E  F\n");
 
 	while (i < len) {
-		if ((i % 0x10) == 0) ctx->logCallback(STPK_LOG_INFO, " %2X", i / 0x10);
-		ctx->logCallback(STPK_LOG_INFO, " %02X", arr[i++]);
-		if ((i % 0x10) == 0) ctx->logCallback(STPK_LOG_INFO, "\n");
+		if ((i % 0x10) == 0) UTIL_LOG(1, STPK_LOG_INFO, " %2X", i / 0x10);
+		UTIL_LOG(1, STPK_LOG_INFO, " %02X", arr[i++]);
+		if ((i % 0x10) == 0) UTIL_LOG(1, STPK_LOG_INFO, "\n");
 	}
 
-	if ((i % 0x10) != 0) ctx->logCallback(STPK_LOG_INFO, "\n");
-	ctx->logCallback(STPK_LOG_INFO, "\n");
+	if ((i % 0x10) != 0) UTIL_LOG(1, STPK_LOG_INFO, "\n");
+	UTIL_LOG(1, STPK_LOG_INFO, "\n");
 }
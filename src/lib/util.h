@@ -20,9 +20,17 @@
 #ifndef STPK_LIB_UTIL_H
 #define STPK_LIB_UTIL_H
 
+#include <stdint.h>
+#include <string.h>
+
+#if defined(__SSE2__)
+#	include <emmintrin.h>
+#endif
+
 #include <stunpack.h>
 
-#define UTIL_LOG(show, type, msg, ...) if (show && ctx->logCallback) ctx->logCallback((type), (msg), ## __VA_ARGS__)
+#define UTIL_LOG(show, type, msg, ...) if (show) (ctx->logSink != NULL ? util_log(ctx, (type), (msg), ## __VA_ARGS__) \
+					: ctx->logCallback != NULL ? ctx->logCallback((type), (msg), ## __VA_ARGS__) : (void)0)
 #define UTIL_MSG(msg, ...)       UTIL_LOG(ctx->verbosity,      STPK_LOG_INFO, (msg), ## __VA_ARGS__)
 #define UTIL_ERR(msg, ...)       UTIL_LOG(ctx->verbosity,      STPK_LOG_ERR,  (msg), ## __VA_ARGS__)
 #define UTIL_WARN(msg, ...)      UTIL_LOG(ctx->verbosity,      STPK_LOG_WARN, (msg), ## __VA_ARGS__)
@@ -30,19 +38,127 @@
 #define UTIL_VERBOSE1(msg, ...)  UTIL_LOG(ctx->verbosity >  1, STPK_LOG_INFO, (msg), ## __VA_ARGS__)
 #define UTIL_VERBOSE2(msg, ...)  UTIL_LOG(ctx->verbosity >  2, STPK_LOG_INFO, (msg), ## __VA_ARGS__)
 #define UTIL_VERBOSE_ARR(arr, len, name) if (ctx->verbosity > 1) util_printArray(ctx, arr, len, name)
-#define UTIL_VERBOSE_HUFF(msg, ...) UTIL_VERBOSE2("%6d %6d %2d %2d %04X %s %02X -> " msg "\n", \
-					ctx->src.offset, ctx->dst.offset, readWidth, curWidth, curWord, \
-					util_stringBits16(curWord), code, ## __VA_ARGS__)
+
+// Destination buffers are allocated with this many bytes to spare, so decoders
+// may write a few bytes past the end instead of checking each write.
+#define UTIL_DST_PADDING STPK_DST_PADDING
+
+// Length of a string of 16 bit values.
+#define UTIL_BITS16_LEN (16 + 1)
+
+// Runs longer than this are filled by memset instead of inline stores.
+#define UTIL_FILL_INLINE_MAX 0x10
+
+// Progress bar mark not reached by any offset.
+#define UTIL_PROGRESS_NONE (~0u)
+
+// Bytes kept after each allocation taken from a region by util_bump(), holding
+// the region offset before it and where it starts.
+#define UTIL_BUMP_FOOTER_LEN (2 * sizeof(unsigned int))
 
 #define UTIL_GET_FLAG(data, mask) ((data & mask) == mask)
 #define UTIL_MAX(X, Y) (((X) > (Y)) ? (X) : (Y))
 #define UTIL_MIN(X, Y) (((X) < (Y)) ? (X) : (Y))
 
+void util_log(const stpk_Context *ctx, stpk_LogType type, const char *msg, ...);
+void util_setFmtType(stpk_Context *ctx, stpk_FmtType type);
+void util_restoreFormat(stpk_Context *ctx, const stpk_Format *format);
+void *util_bump(stpk_Buffer *region, unsigned int size, unsigned int align);
+int util_unbump(stpk_Buffer *region, void *ptr);
+void *util_alloc(stpk_Context *ctx, unsigned int size);
+void util_dealloc(stpk_Context *ctx, void *ptr);
 int util_allocDst(stpk_Context *ctx);
 void util_dst2src(stpk_Context *ctx);
+unsigned int util_progress(const stpk_Context *ctx, unsigned int *progress, unsigned int step, unsigned int offset, unsigned int len);
+
+unsigned char util_prefixSum(unsigned char *data, unsigned int len, unsigned char sum);
 
-char *util_stringBits16(unsigned short val);
+char *util_stringBits16(unsigned short val, char *str);
 unsigned char *util_stringCharsSafe(const unsigned char *src, unsigned char *dst, unsigned int len);
 void util_printArray(const stpk_Context *ctx, const unsigned char *arr, unsigned int len, const char *name);
 
+// Get the alignment of memory allocated for the context.
+static inline unsigned int util_align(const stpk_Context *ctx)
+{
+	return ctx->align ? ctx->align : STPK_ALIGN_DEFAULT;
+}
+
+// Get the length of scratch memory taken by util_alloc() for size bytes,
+// including alignment.
+static inline unsigned int util_scratchLen(const stpk_Context *ctx, unsigned int size)
+{
+	return size + util_align(ctx) - 1 + UTIL_BUMP_FOOTER_LEN;
+}
+
+// Get the number of bytes to decode of a destination buffer of ctx->dst.len
+// bytes, which is cut short by the output limit if it is set.
+static inline unsigned int util_limitLen(const stpk_Context *ctx)
+{
+	return ctx->limit && ctx->limit < ctx->dst.len ? ctx->limit : ctx->dst.len;
+}
+
+// Fill len bytes with value using whole 16 (SSE2) or 8 byte stores. Up to 15
+// bytes past the end may be written, which UTIL_DST_PADDING allows for.
+static inline void util_fill(unsigned char *dst, unsigned char value, unsigned int len)
+{
+	unsigned int i;
+#if defined(__SSE2__)
+	__m128i word = _mm_set1_epi8((char)value);
+	const unsigned int wordLen = 16;
+#else
+	uint64_t word = 0x0101010101010101ULL * value;
+	const unsigned int wordLen = 8;
+#endif
+
+	if (len > UTIL_FILL_INLINE_MAX) {
+		memset(dst, value, len);
+		return;
+	}
+
+	for (i = 0; i < len; i += wordLen) {
+#if defined(__SSE2__)
+		_mm_storeu_si128((__m128i*)(dst + i), word);
+#else
+		memcpy(dst + i, &word, wordLen);
+#endif
+	}
+}
+
+// Copy len bytes using whole 16 (SSE2) or 8 byte loads and stores. Up to 15
+// bytes past the end of both buffers may be accessed.
+static inline void util_copy(unsigned char *dst, const unsigned char *src, unsigned int len)
+{
+	unsigned int i;
+#if defined(__SSE2__)
+	const unsigned int wordLen = 16;
+#else
+	uint64_t word;
+	const unsigned int wordLen = 8;
+#endif
+
+	for (i = 0; i < len; i += wordLen) {
+#if defined(__SSE2__)
+		_mm_storeu_si128((__m128i*)(dst + i), _mm_loadu_si128((const __m128i*)(src + i)));
+#else
+		memcpy(&word, src + i, wordLen);
+		memcpy(dst + i, &word, wordLen);
+#endif
+	}
+}
+
+// Fill len bytes with repetitions of a pattern. The pattern is copied once,
+// then the output written so far is copied after itself, doubling it each step.
+static inline void util_copyRepeat(unsigned char *dst, const unsigned char *pattern, unsigned int patternLen, unsigned int len)
+{
+	unsigned int done = UTIL_MIN(patternLen, len), n;
+
+	memcpy(dst, pattern, done);
+
+	while (done < len) {
+		n = UTIL_MIN(done, len - done);
+		memcpy(dst + done, dst, n);
+		done += n;
+	}
+}
+
 #endif
@@ -22,30 +22,105 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <time.h>
 
 #if defined(__WATCOMC__)
+#	include <fcntl.h>
+#	include <io.h>
 #	include <unistd.h>
 #	define stricmp strcasecmp
+#	define SET_BINARY(file) setmode(fileno(file), O_BINARY)
 #else
 #	include <getopt.h>
 #endif
 
+// Standard input and output are text streams on Windows.
+#if defined(_WIN32) && !defined(__WATCOMC__)
+#	include <fcntl.h>
+#	include <io.h>
+#	define SET_BINARY(file) _setmode(_fileno(file), _O_BINARY)
+#elif !defined(__WATCOMC__)
+#	define SET_BINARY(file)
+#endif
+
+// File name of standard input or output.
+#define STDIO_NAME "-"
+
+// Large files are mapped into memory where POSIX mmap() is available.
+#if !defined(__WATCOMC__) && !defined(_WIN32)
+#	include <fcntl.h>
+#	include <sys/mman.h>
+#	include <sys/stat.h>
+#	include <unistd.h>
+#	define MAP_FILES
+#endif
+
 #include <stunpack.h>
 
+#include "batch.h"
+
 #define BANNER STPK_NAME" "STPK_VERSION" - Stunts/4D [Sports] Driving game resource unpacker\n\n"
-#define USAGE  "Usage: %s [OPTIONS]... SOURCE-FILE [DESTINATION-FILE]\n"
+#define USAGE  "Usage: %s [OPTIONS]... SOURCE-FILE [DESTINATION-FILE]\n  or:  %s -o DIR [OPTIONS]... SOURCE...\n  or:  %s -L [OPTIONS]... SOURCE-FILE...\n"
 
-#define MSG(msg, ...) if (verbose) printf(msg, ## __VA_ARGS__)
+#define MSG(msg, ...) if (verbose) fprintf(msgFile, msg, ## __VA_ARGS__)
 #define ERR(msg, ...) if (verbose) fprintf(stderr, "\n" STPK_NAME ": " msg, ## __VA_ARGS__)
-#define VERBOSE(msg, ...)  if (verbose > 1) printf(msg, ## __VA_ARGS__)
+#define VERBOSE(msg, ...)  if (verbose > 1) fprintf(msgFile, msg, ## __VA_ARGS__)
+
+// Allocations are prefixed with their size, padded to keep them aligned.
+#define MEM_HEADER 0x10
+
+// Length of the source read to get the in place buffer length.
+#define HEADER_LEN 0x10
+
+// Length of the chunks read and written when decompressing as a stream.
+#define CHUNK_LEN 0x1000
+
+// Files shorter than this are read and written through stdio, as mapping them
+// gains nothing.
+#define MAP_MIN_LEN 0x10000
+
+// Trace file header and number of events buffered before writing them.
+#define TRACE_MAGIC      "STPT"
+#define TRACE_VERSION    1
+#define TRACE_HEADER_LEN 5
+#define TRACE_EVENTS     0x400
 
 void printHelp(char *progName);
-int decompress(char *srcFileName, char *dstFileName, stpk_Format format, int verbose);
+int decompress(char *srcFileName, char *dstFileName, stpk_Format format, int verbose, int benchRuns, unsigned int windowLen, unsigned int limit, int into, unsigned int arenaLen, unsigned int align, char *traceFileName, int map, char *cacheDir, unsigned long cacheLen);
+int decompressStream(char *srcFileName, char *dstFileName, stpk_Format format, int verbose, unsigned int windowLen, unsigned int limit, char *indexFileName);
+int decompressRange(char *srcFileName, char *dstFileName, char *indexFileName, stpk_Format format, int verbose, unsigned int offset, unsigned int len);
+int listContainer(char *srcFileName, stpk_Format format, int verbose);
+int extractContainer(char *srcFileName, char *dstFileName, stpk_Format format, int verbose, char *ids);
+unsigned char *readFile(char *fileName, unsigned int *len, int verbose);
+FILE *openFile(char *fileName, const char *mode);
+int closeFile(FILE *file);
+int writeIndex(stpk_Index *index, char *fileName, int verbose);
+void writeTrace(void *userData, const stpk_TraceEvent *events, unsigned int len);
+int renderTrace(char *fileName, int verbose);
+int benchmark(stpk_Context *ctx, int runs, unsigned int windowLen, int into, stpk_Arena *arena);
+unsigned int benchmarkStream(stpk_Context *ctx, unsigned int windowLen);
+unsigned int decompressInto(stpk_Context *ctx, unsigned char *dst);
+#ifdef MAP_FILES
+int mapSource(stpk_Context *ctx, FILE *srcFile);
+int mapDestination(const char *dstFileName, mode_t *mode);
+unsigned int decompressMapped(stpk_Context *ctx, char *dstFileName, int verbose);
+#endif
+void *memAlloc(size_t size);
+void memFree(void *ptr);
+
+// Memory allocated through memAlloc(), and the peak since it was reset.
+size_t memUsed = 0, memPeak = 0;
+
+// Messages go to standard error instead when the output is written to
+// standard output.
+FILE *msgFile;
 
 int main(int argc, char **argv)
 {
-	char *srcFileName = NULL, *dstFileName = NULL;
-	int retval = 0, opt, verbose = 1, srcFileNameLen = 0;
+	char *srcFileName = NULL, *dstFileName = NULL, *indexFileName = NULL, *traceFileName = NULL, *outDir = NULL, *ids = NULL, *cacheDir = NULL, *cacheEnd;
+	int retval = 0, opt, verbose = 1, srcFileNameLen = 0, benchRuns = 0, range = 0, into = 0, render = 0, map = 1, list = 0, piped;
+	unsigned int threads = 0, windowLen = 0, limit = 0, rangeOffset = 0, rangeLen = 0, arenaLen = 0, align = 0;
+	unsigned long cacheLen = 0;
 #if defined(__WATCOMC__)
 	const int dstFileNamePostfixLen = 0;
 #else
@@ -53,15 +128,22 @@ int main(int argc, char **argv)
 #endif
 	stpk_FmtDsi dsi = {
 		.version = STPK_FMT_DSI_VER_AUTO,
-		.maxPasses = 0
+		.maxPasses = 0,
+		.multi = STPK_FMT_DSI_MULTI_AUTO,
+		.inPlace = 0,
+		.detected = STPK_FMT_DSI_VER_AUTO
+	};
+	stpk_FmtRpck rpck = {
+		.store = STPK_FMT_RPCK_STORE_SHORT
 	};
 	stpk_Format format;
+	msgFile = stdout;
 	//format.type = STPK_FMT_DSI;
 	format.type = STPK_FMT_AUTO;
 	//format.dsi = dsi;
 
 	// Parse options.
-	while ((opt = getopt(argc, argv, "f:s:p:hqv")) != -1) {
+	while ((opt = getopt(argc, argv, "f:s:p:m:ik:b:w:l:na:x:r:t:To:j:SLe:C:hqv")) != -1) {
 		switch (opt) {
 			// Primary options
 			case 'f':
@@ -77,6 +159,7 @@ int main(int argc, char **argv)
 				}
 				else if (strcasecmp(optarg, stpk_fmtTypeStr(STPK_FMT_RPCK)) == 0) {
 					format.type = STPK_FMT_RPCK;
+					format.rpck = rpck;
 				}
 				else {
 					fprintf(stderr, "Invalid format type \"%s\".\n", optarg);
@@ -115,8 +198,132 @@ int main(int argc, char **argv)
 				}
 				format.dsi.maxPasses = atoi(optarg);
 				break;
+			case 'm':
+				if (format.type != STPK_FMT_DSI) {
+					fprintf(stderr, "Format type must be \"%s\" for -m, got \"%s\"\n",
+						stpk_fmtTypeStr(STPK_FMT_DSI),
+						stpk_fmtTypeStr(format.type));
+					return 1;
+				}
+				if (strcasecmp(optarg, stpk_fmtDsiMultiStr(STPK_FMT_DSI_MULTI_AUTO)) == 0) {
+					format.dsi.multi = STPK_FMT_DSI_MULTI_AUTO;
+				}
+				else if (strcasecmp(optarg, stpk_fmtDsiMultiStr(STPK_FMT_DSI_MULTI_OFF)) == 0) {
+					format.dsi.multi = STPK_FMT_DSI_MULTI_OFF;
+				}
+				else if (strcasecmp(optarg, stpk_fmtDsiMultiStr(STPK_FMT_DSI_MULTI_ON)) == 0) {
+					format.dsi.multi = STPK_FMT_DSI_MULTI_ON;
+				}
+				else {
+					fprintf(stderr, "Invalid multi-symbol Huffman table mode \"%s\".\n", optarg);
+					return 1;
+				}
+				break;
+			case 'i':
+				if (format.type != STPK_FMT_DSI) {
+					fprintf(stderr, "Format type must be \"%s\" for -i, got \"%s\"\n",
+						stpk_fmtTypeStr(STPK_FMT_DSI),
+						stpk_fmtTypeStr(format.type));
+					return 1;
+				}
+				format.dsi.inPlace = 1;
+				break;
+
+			// RPck format options
+			case 'k':
+				if (format.type != STPK_FMT_RPCK) {
+					fprintf(stderr, "Format type must be \"%s\" for -k, got \"%s\"\n",
+						stpk_fmtTypeStr(STPK_FMT_RPCK),
+						stpk_fmtTypeStr(format.type));
+					return 1;
+				}
+				if (strcasecmp(optarg, stpk_fmtRpckStoreStr(STPK_FMT_RPCK_STORE_SHORT)) == 0) {
+					format.rpck.store = STPK_FMT_RPCK_STORE_SHORT;
+				}
+				else if (strcasecmp(optarg, stpk_fmtRpckStoreStr(STPK_FMT_RPCK_STORE_BLOCK)) == 0) {
+					format.rpck.store = STPK_FMT_RPCK_STORE_BLOCK;
+				}
+				else {
+					fprintf(stderr, "Invalid RPck block store mode \"%s\".\n", optarg);
+					return 1;
+				}
+				break;
 
 			// General options
+			case 'b':
+				if ((benchRuns = atoi(optarg)) < 1) {
+					fprintf(stderr, "Invalid number of benchmark runs \"%s\".\n", optarg);
+					return 1;
+				}
+				break;
+			case 'w':
+				if (atoi(optarg) < 1) {
+					fprintf(stderr, "Invalid stream window length \"%s\".\n", optarg);
+					return 1;
+				}
+				windowLen = atoi(optarg);
+				break;
+			case 'l':
+				if (atoi(optarg) < 1) {
+					fprintf(stderr, "Invalid output limit \"%s\".\n", optarg);
+					return 1;
+				}
+				limit = atoi(optarg);
+				break;
+			case 'n':
+				into = 1;
+				break;
+			case 'a':
+				if (sscanf(optarg, "%u,%u", &arenaLen, &align) < 1 || !arenaLen || (align & (align - 1))) {
+					fprintf(stderr, "Invalid arena \"%s\", expected LEN or LEN,ALIGN with ALIGN a power of two.\n", optarg);
+					return 1;
+				}
+				break;
+			case 'x':
+				indexFileName = optarg;
+				break;
+			case 'r':
+				if (sscanf(optarg, "%u,%u", &rangeOffset, &rangeLen) != 2) {
+					fprintf(stderr, "Invalid output range \"%s\", expected OFFSET,LEN.\n", optarg);
+					return 1;
+				}
+				range = 1;
+				break;
+			case 't':
+				traceFileName = optarg;
+				break;
+			case 'T':
+				render = 1;
+				break;
+			case 'o':
+				outDir = optarg;
+				break;
+			case 'j':
+				if (atoi(optarg) < 1) {
+					fprintf(stderr, "Invalid number of threads \"%s\".\n", optarg);
+					return 1;
+				}
+				threads = atoi(optarg);
+				break;
+			case 'S':
+				map = 0;
+				break;
+			case 'L':
+				list = 1;
+				break;
+			case 'e':
+				ids = optarg;
+				break;
+			case 'C':
+				cacheDir = optarg;
+				if ((cacheEnd = strrchr(optarg, ',')) != NULL) {
+					if (!cacheEnd[1] || strspn(cacheEnd + 1, "0123456789") != strlen(cacheEnd + 1) || !(cacheLen = strtoul(cacheEnd + 1, NULL, 10))) {
+						fprintf(stderr, "Invalid cache \"%s\", expected DIR or DIR,MAXLEN.\n", optarg);
+						return 1;
+					}
+					*cacheEnd = '\0';
+				}
+				break;
 			case 'h':
 				printHelp(argv[0]);
 				return 0;
@@ -131,14 +338,78 @@ int main(int argc, char **argv)
 		}
 	}
 
-	if ((argc == optind) | (argc - optind > 2) | retval) {
-		fprintf(stderr, USAGE, argv[0]);
+	if (range && indexFileName == NULL) {
+		fprintf(stderr, "An index must be given with -x for -r.\n");
+		return 1;
+	}
+
+	if (traceFileName != NULL && (benchRuns || windowLen || indexFileName != NULL)) {
+		fprintf(stderr, "A trace can not be recorded with -b, -w or -x.\n");
+		return 1;
+	}
+
+	if (outDir != NULL && (benchRuns || windowLen || limit || into || arenaLen || indexFileName != NULL || traceFileName != NULL || render)) {
+		fprintf(stderr, "Batch mode (-o) can not be used with -b, -w, -l, -n, -a, -x, -t or -T.\n");
+		return 1;
+	}
+
+	if ((list || ids != NULL) && (benchRuns || windowLen || limit || into || arenaLen || indexFileName != NULL || range || traceFileName != NULL || render || outDir != NULL)) {
+		fprintf(stderr, "Resource containers (-L, -e) can not be used with -b, -w, -l, -n, -a, -x, -r, -t, -T or -o.\n");
+		return 1;
+	}
+
+	if (cacheDir != NULL && (benchRuns || windowLen || into || arenaLen || indexFileName != NULL || range || traceFileName != NULL || render || list || ids != NULL)) {
+		fprintf(stderr, "The cache (-C) can not be used with -b, -w, -n, -a, -x, -r, -t, -T, -L or -e.\n");
+		return 1;
+	}
+
+	if ((argc == optind) | (argc - optind > 2 && outDir == NULL && !list) | retval) {
+		fprintf(stderr, USAGE, argv[0], argv[0], argv[0]);
 		fprintf(stderr, "Try \"%s -h\" for help.\n", argv[0]);
 		return 1;
 	}
 
+	// Print a trace file as text instead of decompressing.
+	if (render) {
+		return renderTrace(argv[optind], verbose);
+	}
+
+	// List the entries of each file instead of decompressing.
+	if (list) {
+		for (; optind < argc; optind++) {
+			retval |= listContainer(argv[optind], format, verbose);
+		}
+		return retval;
+	}
+
+	// Use standard input or output as "-", or standard output for the
+	// destination of standard input if omitted.
+	piped = strcmp(argv[optind], STDIO_NAME) == 0 || (argc - optind > 1 && strcmp(argv[optind + 1], STDIO_NAME) == 0);
+	if (piped && outDir == NULL) {
+		if (benchRuns || range) {
+			fprintf(stderr, "Standard input and output (%s) can not be used with -b or -r.\n", STDIO_NAME);
+			return 1;
+		}
+		if (cacheDir != NULL) {
+			fprintf(stderr, "Standard input and output (%s) can not be used with -C.\n", STDIO_NAME);
+			return 1;
+		}
+		if (ids != NULL && strcmp(argv[optind], STDIO_NAME) == 0) {
+			fprintf(stderr, "Entries (-e) can not be extracted from standard input (%s).\n", STDIO_NAME);
+			return 1;
+		}
+		if (argc - optind == 1 || strcmp(argv[optind + 1], STDIO_NAME) == 0) {
+			msgFile = stderr;
+		}
+	}
+
 	MSG(BANNER);
 
+	// Decompress all files given into the output directory.
+	if (outDir != NULL) {
+		return batch_run(argv + optind, argc - optind, outDir, format, threads, cacheDir, cacheLen, verbose);
+	}
+
 	// Max two additional params (file names).
 	for (; optind < argc; optind++) {
 		if (srcFileName == NULL) {
@@ -149,6 +420,15 @@ int main(int argc, char **argv)
 		}
 	}
 
+	if (dstFileName == NULL && strcmp(srcFileName, STDIO_NAME) == 0) {
+		dstFileName = STDIO_NAME;
+	}
+
+	// Name the files of entries after the source if omitted.
+	if (dstFileName == NULL && ids != NULL) {
+		dstFileName = srcFileName;
+	}
+
 	// Generate destination file name if omitted.
 	if (dstFileName == NULL) {
 		srcFileNameLen = strlen(srcFileName);
@@ -164,7 +444,20 @@ int main(int argc, char **argv)
 #endif
 	}
 
-	retval = decompress(srcFileName, dstFileName, format, verbose);
+	if (ids != NULL) {
+		retval = extractContainer(srcFileName, dstFileName, format, verbose, ids);
+	}
+	else if (range) {
+		retval = decompressRange(srcFileName, dstFileName, indexFileName, format, verbose, rangeOffset, rangeLen);
+	}
+	// Pipes are decompressed as a stream, as they can not be sized up front and
+	// the output is passed on as it is decoded.
+	else if ((windowLen || indexFileName != NULL || piped) && !benchRuns) {
+		retval = decompressStream(srcFileName, dstFileName, format, verbose, windowLen, limit, indexFileName);
+	}
+	else {
+		retval = decompress(srcFileName, dstFileName, format, verbose, benchRuns, windowLen, limit, into, arenaLen, align, traceFileName, map, cacheDir, cacheLen);
+	}
 
 	// Clean up.
 	if (dstFileName != NULL && srcFileNameLen) {
@@ -178,7 +471,7 @@ void printHelp(char *progName)
 {
 	printf(BANNER);
 
-	printf(USAGE, progName);
+	printf(USAGE, progName, progName, progName);
 
 	printf("\n  Primary options\n");
 	//printf("    -c       compress\n");
@@ -200,11 +493,37 @@ void printHelp(char *progName)
 		stpk_fmtDsiVerStr(STPK_FMT_DSI_VER_AUTO),
 		stpk_fmtDsiVerStr(STPK_FMT_DSI_VER_1),
 		stpk_fmtDsiVerStr(STPK_FMT_DSI_VER_2));
-	printf("    -p NUM   limit to NUM decompression passes\n\n");
+	printf("    -p NUM   limit to NUM decompression passes\n");
+	printf("    -m MODE  multi-symbol Huffman tables: \"%s\" (default), \"%s\", \"%s\"\n",
+		stpk_fmtDsiMultiStr(STPK_FMT_DSI_MULTI_AUTO),
+		stpk_fmtDsiMultiStr(STPK_FMT_DSI_MULTI_OFF),
+		stpk_fmtDsiMultiStr(STPK_FMT_DSI_MULTI_ON));
+	printf("    -i       decompress all passes in place in a single buffer\n\n");
+
+	printf("  RPck format options\n");
+	printf("    -k MODE  block stores: \"%s\" (default), \"%s\", the latter to compare\n             the throughput of whole word stores of short blocks with -b\n\n",
+		stpk_fmtRpckStoreStr(STPK_FMT_RPCK_STORE_SHORT),
+		stpk_fmtRpckStoreStr(STPK_FMT_RPCK_STORE_BLOCK));
 
 	printf("  General options\n");
-	printf("    -v       verbose output\n");
-	printf("    -vv      very verbose output\n");
+	printf("    -b NUM   benchmark NUM decompression runs without writing output\n");
+	printf("    -w LEN   decompress as a stream through windows of LEN bytes, reading\n             and writing the files a chunk at a time\n");
+	printf("    -l LEN   stop after the first LEN bytes of output\n");
+	printf("    -n       decompress into buffers allocated up front from the header\n             lengths, without allocating while decoding, with %d bytes of\n             padding past the output\n", STPK_DST_PADDING);
+	printf("    -a LEN[,ALIGN]\n             allocate while decoding from an arena of LEN bytes, reset between\n             benchmark runs, aligning buffers to ALIGN bytes\n");
+	printf("    -S       read and write files through stdio instead of mapping large files\n             into memory\n");
+	printf("    -x FILE  decompress as a stream and save a checkpoint index of the output\n             to FILE, or read it from FILE with -r\n");
+	printf("    -r OFFSET,LEN\n             decompress LEN bytes of output at OFFSET, resuming from the\n             nearest checkpoint of the index given with -x\n");
+	printf("    -t FILE  record the decoding steps to FILE in binary, like the text of -vv\n");
+	printf("    -T       print the steps recorded in the trace file SOURCE-FILE as text\n");
+	printf("    -o DIR   batch mode, decompressing each SOURCE file, the files of each SOURCE\n             directory and the sources listed in each @FILE to the same names\n             under DIR\n");
+	printf("    -j NUM   decompress NUM files at once in batch mode (default: CPU count)\n");
+	printf("    -C DIR[,MAXLEN]\n             read the output from a cache in DIR if it holds it, or store it\n             there, keeping at most MAXLEN bytes\n");
+	printf("    -L       list the entries of the resource container each SOURCE-FILE unpacks\n             to, decoding only its header\n");
+	printf("    -e ID[,ID]...\n             extract the entries with these IDs of the resource container\n             SOURCE-FILE unpacks to, each to DESTINATION-FILE.ID, decoding no\n             further than the last one\n");
+	printf("    -        as SOURCE-FILE or DESTINATION-FILE, read standard input or write\n             standard output, decompressing as a stream\n");
+	printf("    -v       verbose output, including peak memory use\n");
+	printf("    -vv      very verbose output, tracing each decoding step\n");
 	printf("    -q       no output\n");
 	printf("    -h       print this text and exit\n\n");
 
@@ -227,25 +546,83 @@ void logCallback(stpk_LogType type, const char *msg, ...)
 			break;
 		case STPK_LOG_INFO:
 		default:
-			vprintf(msg, args);
+			vfprintf(msgFile, msg, args);
 			break;
 	}
 
 	va_end(args);
 }
 
-int decompress(char *srcFileName, char *dstFileName, stpk_Format format, int verbose)
+// Allocate memory and keep track of the peak use.
+void *memAlloc(size_t size)
 {
-	unsigned int retval = 1;
-	FILE *srcFile, *dstFile;
+	unsigned char *ptr;
+
+	if ((ptr = (unsigned char*)malloc(size + MEM_HEADER)) == NULL) {
+		return NULL;
+	}
+
+	*(size_t*)ptr = size;
+	memUsed += size;
+	if (memUsed > memPeak) {
+		memPeak = memUsed;
+	}
 
-	stpk_Context ctx = stpk_init(format, verbose, logCallback, malloc, free);
+	return ptr + MEM_HEADER;
+}
+
+void memFree(void *ptr)
+{
+	if (ptr != NULL) {
+		ptr = (unsigned char*)ptr - MEM_HEADER;
+		memUsed -= *(size_t*)ptr;
+		free(ptr);
+	}
+}
+
+int decompress(char *srcFileName, char *dstFileName, stpk_Format format, int verbose, int benchRuns, unsigned int windowLen, unsigned int limit, int into, unsigned int arenaLen, unsigned int align, char *traceFileName, int map, char *cacheDir, unsigned long cacheLen)
+{
+	unsigned int retval = 1, fileLen;
+	int mapped = 0;
+	unsigned char header[HEADER_LEN];
+	FILE *srcFile, *dstFile, *traceFile = NULL;
+
+	stpk_Cache *cache = NULL;
+	stpk_Arena *arena = NULL;
+	stpk_TraceEvent traceEvents[TRACE_EVENTS];
+	stpk_Trace trace;
+
+	stpk_Context ctx = stpk_init(format, verbose, logCallback, memAlloc, memFree);
+	ctx.limit = limit;
 
 	if ((srcFile = fopen(srcFileName, "rb")) == NULL) {
 		ERR("Error opening source file \"%s\" for reading. (%s)\n", srcFileName, strerror(errno));
 		return 1;
 	}
 
+	if (arenaLen) {
+		if ((arena = stpk_arena_init(&ctx, arenaLen)) == NULL) {
+			goto closeSrcFile;
+		}
+
+		ctx.allocator = stpk_arena_allocator(arena);
+		ctx.align = align;
+	}
+
+	if (traceFileName != NULL) {
+		if ((traceFile = fopen(traceFileName, "wb")) == NULL || fwrite(TRACE_MAGIC, 1, 4, traceFile) != 4 || fputc(TRACE_VERSION, traceFile) == EOF) {
+			ERR("Error opening trace file \"%s\" for writing. (%s)\n", traceFileName, strerror(errno));
+			goto closeSrcFile;
+		}
+
+		trace.events = traceEvents;
+		trace.size = TRACE_EVENTS;
+		trace.len = trace.next = 0;
+		trace.flush = writeTrace;
+		trace.userData = traceFile;
+		ctx.trace = &trace;
+	}
+
 	MSG("Reading file \"%s\"...\n", srcFileName);
 
 	if (fseek(srcFile, 0, SEEK_END) != 0) {
@@ -253,7 +630,7 @@ int decompress(char *srcFileName, char *dstFileName, stpk_Format format, int ver
 		goto closeSrcFile;
 	}
 
-	if ((ctx.src.len = ftell(srcFile)) == -1) {
+	if ((ctx.src.len = fileLen = ftell(srcFile)) == -1) {
 		ERR("Error getting EOF position in source file \"%s\". (%s)\n", srcFileName, strerror(errno));
 		goto closeSrcFile;
 	}
@@ -268,21 +645,77 @@ int decompress(char *srcFileName, char *dstFileName, stpk_Format format, int ver
 		goto closeSrcFile;
 	}
 
-	if ((ctx.src.data = (unsigned char*)malloc(sizeof(unsigned char) * ctx.src.len)) == NULL) {
+#ifdef MAP_FILES
+	// Map a large source and decode it into the mapped destination file. The
+	// source is neither freed nor written by stpk_decompressInto(), unless it is
+	// decompressed in place.
+	if (map && !benchRuns && cacheDir == NULL && fileLen >= MAP_MIN_LEN && !(format.type == STPK_FMT_DSI && format.dsi.inPlace)
+		&& mapDestination(dstFileName, NULL)
+	) {
+		mapped = mapSource(&ctx, srcFile);
+	}
+#endif
+
+	// Read the source into the end of a buffer long enough to decompress it in
+	// place, so it does not have to be moved there.
+	if (format.type == STPK_FMT_DSI && format.dsi.inPlace && fileLen >= HEADER_LEN) {
+		if (fread(header, sizeof(unsigned char), HEADER_LEN, srcFile) != HEADER_LEN || fseek(srcFile, 0, SEEK_SET) != 0) {
+			ERR("Error reading source file \"%s\" header. (%s)\n", srcFileName, strerror(errno));
+			goto closeSrcFile;
+		}
+
+		ctx.src.data = header;
+		if (stpk_getInPlaceLen(&ctx) > fileLen) {
+			ctx.src.len = stpk_getInPlaceLen(&ctx);
+			ctx.src.offset = ctx.src.len - fileLen;
+		}
+		ctx.src.data = NULL;
+	}
+
+	if (!mapped && (ctx.src.data = (unsigned char*)memAlloc(sizeof(unsigned char) * ctx.src.len)) == NULL) {
 		ERR("Error allocating memory for source file \"%s\" content. (%s)\n", srcFileName, strerror(errno));
 		goto closeSrcFile;
 	}
 
-	if (fread(ctx.src.data, sizeof(unsigned char), ctx.src.len, srcFile) != ctx.src.len) {
+	if (!mapped && fread(ctx.src.data + ctx.src.offset, sizeof(unsigned char), fileLen, srcFile) != fileLen) {
 		ERR("Error reading source file \"%s\" content. (%s)\n", srcFileName, strerror(errno));
 		goto freeBuffers;
 	}
 
-	retval = stpk_decompress(&ctx);
+	if (benchRuns) {
+		retval = benchmark(&ctx, benchRuns, windowLen, into, arena);
+		goto freeBuffers;
+	}
 
-	// Flush unpacked data to file.
-	if (!retval) {
-		VERBOSE("\n");
+	// Read the output from the cache if it holds it, or store it there.
+	if (cacheDir != NULL) {
+		if ((cache = stpk_cache_init(&ctx, cacheDir, cacheLen)) == NULL) {
+			goto freeBuffers;
+		}
+		retval = stpk_cache_decompress(cache, &ctx);
+	}
+#ifdef MAP_FILES
+	else if (mapped) {
+		retval = decompressMapped(&ctx, dstFileName, verbose);
+	}
+#endif
+	else {
+		if (into) {
+			MSG("Decompressing into %u bytes of output and %u bytes of scratch, with %u bytes of padding past the output...\n",
+				stpk_getDecompressedSize(&ctx), stpk_getScratchLen(&ctx), STPK_DST_PADDING);
+		}
+		retval = into ? decompressInto(&ctx, NULL) : stpk_decompress(&ctx);
+	}
+
+	// Write the events left in the trace, which is emptied each time it fills
+	// up. A failed decompression is traced up to the error.
+	if (traceFile != NULL) {
+		writeTrace(traceFile, trace.events, trace.len);
+	}
+
+	// Flush unpacked data to file, unless it was decoded into the mapped file.
+	if (!retval && !mapped) {
+		VERBOSE("\nPeak memory: %lu bytes\n\n", (unsigned long)memPeak);
 		MSG("Writing file \"%s\"... ", dstFileName);
 
 		if ((dstFile = fopen(dstFileName, "wb")) == NULL) {
@@ -307,9 +740,29 @@ closeDstFile:
 	}
 
 freeBuffers:
+	if (cache != NULL) {
+		stpk_cache_release(cache, &ctx);
+		stpk_cache_deinit(cache);
+	}
+#ifdef MAP_FILES
+	if (mapped) {
+		munmap(ctx.src.data, ctx.src.len);
+		ctx.src.data = NULL;
+	}
+#endif
 	stpk_deinit(&ctx);
 
 closeSrcFile:
+	if (arena != NULL) {
+		VERBOSE("Peak arena use: %u bytes\n\n", stpk_arena_peak(arena));
+		stpk_arena_deinit(arena);
+	}
+
+	if (traceFile != NULL && (ferror(traceFile) | fclose(traceFile))) {
+		ERR("Error writing trace file \"%s\". (%s)\n", traceFileName, strerror(errno));
+		retval = 1;
+	}
+
 	if (fclose(srcFile) != 0) {
 		ERR("Error closing source file \"%s\". (%s)\n", srcFileName, strerror(errno));
 		retval = 1;
@@ -318,3 +771,748 @@ closeSrcFile:
 	return retval;
 }
 
+// Decompress the source file as a stream, feeding it a chunk at a time and
+// writing the output as it is decoded, up to limit bytes if it is set. If an
+// index file name is given, a checkpoint index is built along the way and
+// saved to it.
+int decompressStream(char *srcFileName, char *dstFileName, stpk_Format format, int verbose, unsigned int windowLen, unsigned int limit, char *indexFileName)
+{
+	unsigned int retval = 1, len = 0, fed = 0, read, written = 0;
+	unsigned char src[CHUNK_LEN], dst[CHUNK_LEN];
+	FILE *srcFile, *dstFile;
+	stpk_Stream *stream;
+	stpk_Index *index = NULL;
+
+	stpk_Context ctx = stpk_init(format, verbose, logCallback, memAlloc, memFree);
+
+	if ((srcFile = openFile(srcFileName, "rb")) == NULL) {
+		ERR("Error opening source file \"%s\" for reading. (%s)\n", srcFileName, strerror(errno));
+		return 1;
+	}
+
+	if ((dstFile = openFile(dstFileName, "wb")) == NULL) {
+		ERR("Error opening destination file \"%s\" for writing. (%s)\n", dstFileName, strerror(errno));
+		goto closeSrcFile;
+	}
+
+	if ((stream = stpk_stream_init(&ctx, windowLen)) == NULL) {
+		goto closeDstFile;
+	}
+
+	if (indexFileName != NULL) {
+		if ((index = stpk_index_init(&ctx, 0)) == NULL) {
+			goto deinitStream;
+		}
+		stpk_stream_index(stream, index);
+	}
+
+	MSG("Streaming file \"%s\" to \"%s\"...\n", srcFileName, dstFileName);
+
+	do {
+		// Read the next chunk once all of the last one has been fed.
+		if (fed == len && !feof(srcFile)) {
+			len = fread(src, sizeof(unsigned char), CHUNK_LEN, srcFile);
+			fed = 0;
+
+			if (ferror(srcFile)) {
+				ERR("Error reading source file \"%s\" content. (%s)\n", srcFileName, strerror(errno));
+				retval = 1;
+				goto deinitStream;
+			}
+		}
+
+		fed += stpk_stream_feed(stream, src + fed, len - fed);
+		if (fed == len && feof(srcFile)) {
+			stpk_stream_end(stream);
+		}
+
+		do {
+			retval = stpk_stream_read(stream, dst, limit && limit - written < CHUNK_LEN ? limit - written : CHUNK_LEN, &read);
+			written += read;
+
+			if (fwrite(dst, 1, read, dstFile) != read) {
+				ERR("Error writing destination file \"%s\" content. (%s)\n", dstFileName, strerror(errno));
+				retval = 1;
+				goto deinitStream;
+			}
+
+			if (limit && written == limit) {
+				retval = STPK_RET_OK;
+			}
+		} while (retval == STPK_RET_MORE_OUTPUT);
+	} while (retval == STPK_RET_NEED_INPUT);
+
+	if (!retval) {
+		VERBOSE("\nPeak memory: %lu bytes\n\n", (unsigned long)memPeak);
+		MSG("Done!\n");
+
+		if (index != NULL) {
+			retval = writeIndex(index, indexFileName, verbose);
+		}
+	}
+
+deinitStream:
+	stpk_stream_deinit(stream);
+	if (index != NULL) {
+		stpk_index_deinit(index);
+	}
+
+closeDstFile:
+	if (closeFile(dstFile) != 0) {
+		ERR("Error closing destination file \"%s\". (%s)\n", dstFileName, strerror(errno));
+		retval = 1;
+	}
+
+closeSrcFile:
+	if (closeFile(srcFile) != 0) {
+		ERR("Error closing source file \"%s\". (%s)\n", srcFileName, strerror(errno));
+		retval = 1;
+	}
+
+	return retval;
+}
+
+// Decompress len bytes of the output at offset, resuming from the nearest
+// checkpoint of an index saved by an earlier run with -x.
+int decompressRange(char *srcFileName, char *dstFileName, char *indexFileName, stpk_Format format, int verbose, unsigned int offset, unsigned int len)
+{
+	unsigned int retval = 1, indexLen;
+	unsigned char *indexData;
+	FILE *dstFile;
+	stpk_Index *index;
+
+	stpk_Context ctx = stpk_init(format, verbose, logCallback, memAlloc, memFree);
+
+	MSG("Reading index \"%s\"...\n", indexFileName);
+
+	if ((indexData = readFile(indexFileName, &indexLen, verbose)) == NULL) {
+		return 1;
+	}
+
+	index = stpk_index_load(&ctx, indexData, indexLen);
+	memFree(indexData);
+	if (index == NULL) {
+		return 1;
+	}
+
+	MSG("Reading file \"%s\"...\n", srcFileName);
+
+	if ((ctx.src.data = readFile(srcFileName, &ctx.src.len, verbose)) == NULL) {
+		goto deinitIndex;
+	}
+
+	retval = stpk_decompressRange(&ctx, index, offset, len);
+
+	// Flush unpacked data to file.
+	if (!retval) {
+		VERBOSE("\nPeak memory: %lu bytes\n\n", (unsigned long)memPeak);
+		MSG("Writing file \"%s\"... ", dstFileName);
+
+		if ((dstFile = fopen(dstFileName, "wb")) == NULL) {
+			ERR("Error opening destination file \"%s\" for writing. (%s)\n", dstFileName, strerror(errno));
+			retval = 1;
+			goto freeBuffers;
+		}
+
+		if (fwrite(ctx.dst.data, 1, ctx.dst.len, dstFile) != ctx.dst.len) {
+			ERR("Error writing destination file \"%s\" content. (%s)\n", dstFileName, strerror(errno));
+			retval = 1;
+		}
+		else {
+			MSG("Done!\n");
+		}
+
+		if (fclose(dstFile) != 0) {
+			ERR("Error closing destination file \"%s\". (%s)\n", dstFileName, strerror(errno));
+			retval = 1;
+		}
+	}
+
+freeBuffers:
+	stpk_deinit(&ctx);
+
+deinitIndex:
+	stpk_index_deinit(index);
+
+	return retval;
+}
+
+// Print the entries of the resource container a file unpacks to, decoding only
+// its header.
+int listContainer(char *srcFileName, stpk_Format format, int verbose)
+{
+	unsigned int i;
+	const stpk_Resource *resource;
+	stpk_Container *container;
+
+	stpk_Context ctx = stpk_init(format, verbose, logCallback, memAlloc, memFree);
+
+	if ((ctx.src.data = readFile(srcFileName, &ctx.src.len, verbose)) == NULL) {
+		return 1;
+	}
+
+	if ((container = stpk_container_init(&ctx)) == NULL) {
+		ERR("Error reading resource container of \"%s\".\n", srcFileName);
+		stpk_deinit(&ctx);
+		return 1;
+	}
+
+	printf("%s: %u entries\n", srcFileName, stpk_container_len(container));
+	for (i = 0; (resource = stpk_container_get(container, i)) != NULL; i++) {
+		printf("  %-4s %10u %10u\n", resource->id, resource->offset, resource->len);
+	}
+
+	stpk_container_deinit(container);
+	stpk_deinit(&ctx);
+
+	return 0;
+}
+
+static int compareResources(const void *a, const void *b)
+{
+	unsigned int x = (*(const stpk_Resource**)a)->offset, y = (*(const stpk_Resource**)b)->offset;
+
+	return (x > y) - (x < y);
+}
+
+// Extract the comma separated entries in ids of the resource container a file
+// unpacks to, each into a file named after dstFileName and the entry's ID, or
+// one after the other to standard output. The source is decoded up to the end
+// of the last entry, taking the entries by offset.
+int extractContainer(char *srcFileName, char *dstFileName, stpk_Format format, int verbose, char *ids)
+{
+	int retval = 1;
+	unsigned int len = 1, i, j;
+	char *id, *name = NULL;
+	unsigned char **data = NULL;
+	const stpk_Resource **resources = NULL, **sorted = NULL;
+	stpk_Container *container;
+	FILE *dstFile;
+
+	stpk_Context ctx = stpk_init(format, verbose, logCallback, memAlloc, memFree);
+
+	for (id = ids; *id; id++) {
+		len += *id == ',';
+	}
+
+	MSG("Reading file \"%s\"...\n", srcFileName);
+
+	if ((ctx.src.data = readFile(srcFileName, &ctx.src.len, verbose)) == NULL) {
+		return 1;
+	}
+
+	if ((container = stpk_container_init(&ctx)) == NULL) {
+		ERR("Error reading resource container of \"%s\".\n", srcFileName);
+		goto freeBuffers;
+	}
+
+	if ((resources = (const stpk_Resource**)memAlloc(sizeof(stpk_Resource*) * len)) == NULL
+		|| (sorted = (const stpk_Resource**)memAlloc(sizeof(stpk_Resource*) * len)) == NULL
+		|| (data = (unsigned char**)memAlloc(sizeof(unsigned char*) * len)) == NULL
+		|| (name = (char*)memAlloc(sizeof(char) * (strlen(dstFileName) + 6))) == NULL
+	) {
+		ERR("Error allocating memory for entries. (%s)\n", strerror(errno));
+		goto deinitContainer;
+	}
+
+	for (i = 0, id = strtok(ids, ","); i < len; i++, id = strtok(NULL, ",")) {
+		data[i] = NULL;
+		if (id == NULL || (resources[i] = stpk_container_find(container, id)) == NULL) {
+			ERR("No entry \"%s\" in \"%s\".\n", id != NULL ? id : "", srcFileName);
+			len = i;
+			goto freeEntries;
+		}
+		sorted[i] = resources[i];
+	}
+
+	// Decode in a single pass by taking the entries in the order they are stored.
+	qsort(sorted, len, sizeof(stpk_Resource*), compareResources);
+	for (i = 0; i < len; i++) {
+		if (i && sorted[i] == sorted[i - 1]) {
+			continue;
+		}
+		if ((data[i] = (unsigned char*)memAlloc(sizeof(unsigned char) * (sorted[i]->len + 1))) == NULL) {
+			ERR("Error allocating memory for entry \"%s\". (%s)\n", sorted[i]->id, strerror(errno));
+			len = i + 1;
+			goto freeEntries;
+		}
+		if (stpk_container_read(container, sorted[i], data[i]) != STPK_RET_OK) {
+			len = i + 1;
+			goto freeEntries;
+		}
+	}
+
+	VERBOSE("\nPeak memory: %lu bytes\n\n", (unsigned long)memPeak);
+
+	// Write the entries in the order asked for.
+	for (i = 0; i < len; i++) {
+		for (j = 0; sorted[j] != resources[i]; j++);
+
+		if (strcmp(dstFileName, STDIO_NAME) == 0) {
+			strcpy(name, STDIO_NAME);
+		}
+		else {
+			sprintf(name, "%s.%s", dstFileName, resources[i]->id);
+		}
+
+		MSG("Writing entry \"%s\" to \"%s\"... ", resources[i]->id, name);
+
+		if ((dstFile = openFile(name, "wb")) == NULL) {
+			ERR("Error opening destination file \"%s\" for writing. (%s)\n", name, strerror(errno));
+			goto freeEntries;
+		}
+
+		if (fwrite(data[j], 1, resources[i]->len, dstFile) != resources[i]->len) {
+			ERR("Error writing destination file \"%s\" content. (%s)\n", name, strerror(errno));
+			closeFile(dstFile);
+			goto freeEntries;
+		}
+
+		if (closeFile(dstFile) != 0) {
+			ERR("Error closing destination file \"%s\". (%s)\n", name, strerror(errno));
+			goto freeEntries;
+		}
+
+		MSG("Done!\n");
+	}
+
+	retval = 0;
+
+freeEntries:
+	for (i = 0; i < len; i++) {
+		if (data[i] != NULL) {
+			memFree(data[i]);
+		}
+	}
+
+deinitContainer:
+	if (name != NULL) {
+		memFree(name);
+	}
+	if (data != NULL) {
+		memFree(data);
+	}
+	if (sorted != NULL) {
+		memFree(sorted);
+	}
+	if (resources != NULL) {
+		memFree(resources);
+	}
+	stpk_container_deinit(container);
+
+freeBuffers:
+	stpk_deinit(&ctx);
+
+	return retval;
+}
+
+// Read a whole file into a buffer from memAlloc(). Returns NULL on failure.
+unsigned char *readFile(char *fileName, unsigned int *len, int verbose)
+{
+	unsigned char *data = NULL;
+	long fileLen;
+	FILE *file;
+
+	if ((file = fopen(fileName, "rb")) == NULL) {
+		ERR("Error opening file \"%s\" for reading. (%s)\n", fileName, strerror(errno));
+		return NULL;
+	}
+
+	if (fseek(file, 0, SEEK_END) != 0 || (fileLen = ftell(file)) == -1 || fseek(file, 0, SEEK_SET) != 0) {
+		ERR("Error seeking in file \"%s\". (%s)\n", fileName, strerror(errno));
+		goto closeFile;
+	}
+
+	if ((data = (unsigned char*)memAlloc(sizeof(unsigned char) * fileLen)) == NULL) {
+		ERR("Error allocating memory for file \"%s\" content. (%s)\n", fileName, strerror(errno));
+		goto closeFile;
+	}
+
+	if (fread(data, sizeof(unsigned char), fileLen, file) != (size_t)fileLen) {
+		ERR("Error reading file \"%s\" content. (%s)\n", fileName, strerror(errno));
+		memFree(data);
+		data = NULL;
+		goto closeFile;
+	}
+
+	*len = fileLen;
+
+closeFile:
+	fclose(file);
+
+	return data;
+}
+
+// Open a file, or standard input or output in binary mode if named "-".
+FILE *openFile(char *fileName, const char *mode)
+{
+	FILE *file;
+
+	if (strcmp(fileName, STDIO_NAME) != 0) {
+		return fopen(fileName, mode);
+	}
+
+	file = mode[0] == 'r' ? stdin : stdout;
+	SET_BINARY(file);
+
+	return file;
+}
+
+// Close a file opened by openFile(), only checking standard input and
+// flushing standard output.
+int closeFile(FILE *file)
+{
+	if (file == stdin) {
+		return ferror(file);
+	}
+
+	if (file == stdout) {
+		return fflush(file) != 0 || ferror(file);
+	}
+
+	return fclose(file);
+}
+
+// Save a checkpoint index to a sidecar file.
+int writeIndex(stpk_Index *index, char *fileName, int verbose)
+{
+	unsigned int len = stpk_index_save(index, NULL);
+	unsigned char *data;
+	int retval = 1;
+	FILE *file;
+
+	if ((data = (unsigned char*)memAlloc(sizeof(unsigned char) * len)) == NULL) {
+		ERR("Error allocating memory for index. (%s)\n", strerror(errno));
+		return 1;
+	}
+	stpk_index_save(index, data);
+
+	MSG("Writing index \"%s\"... ", fileName);
+
+	if ((file = fopen(fileName, "wb")) == NULL) {
+		ERR("Error opening index file \"%s\" for writing. (%s)\n", fileName, strerror(errno));
+		goto freeData;
+	}
+
+	if (fwrite(data, 1, len, file) != len) {
+		ERR("Error writing index file \"%s\" content. (%s)\n", fileName, strerror(errno));
+	}
+	else {
+		MSG("Done!\n");
+		retval = 0;
+	}
+
+	if (fclose(file) != 0) {
+		ERR("Error closing index file \"%s\". (%s)\n", fileName, strerror(errno));
+		retval = 1;
+	}
+
+freeData:
+	memFree(data);
+
+	return retval;
+}
+
+// Append the events of a full trace buffer to the trace file passed as user
+// data. Write errors are checked when the file is closed.
+void writeTrace(void *userData, const stpk_TraceEvent *events, unsigned int len)
+{
+	unsigned char data[TRACE_EVENTS * STPK_TRACE_EVENT_LEN];
+
+	stpk_trace_pack(events, len, data);
+	fwrite(data, STPK_TRACE_EVENT_LEN, len, (FILE*)userData);
+}
+
+// Print the events of a trace file as the text tables of -vv.
+int renderTrace(char *fileName, int verbose)
+{
+	unsigned int len, offset, count;
+	unsigned char *data;
+	char str[0x80];
+	const char *header = NULL;
+	stpk_TraceEvent events[TRACE_EVENTS];
+
+	if ((data = readFile(fileName, &len, verbose)) == NULL) {
+		return 1;
+	}
+
+	if (len < TRACE_HEADER_LEN || memcmp(data, TRACE_MAGIC, 4) != 0 || data[4] != TRACE_VERSION) {
+		ERR("File \"%s\" is not a trace of version %d.\n", fileName, TRACE_VERSION);
+		memFree(data);
+		return 1;
+	}
+
+	for (offset = TRACE_HEADER_LEN; offset + STPK_TRACE_EVENT_LEN <= len; offset += count * STPK_TRACE_EVENT_LEN) {
+		count = (len - offset) / STPK_TRACE_EVENT_LEN;
+		count = count < TRACE_EVENTS ? count : TRACE_EVENTS;
+		stpk_trace_unpack(data + offset, count, events);
+
+		for (unsigned int i = 0; i < count; i++) {
+			// Start a new table where the events of another decoder begin.
+			if (stpk_trace_header(events[i].type) != header) {
+				header = stpk_trace_header(events[i].type);
+				printf("\n%s", header);
+			}
+
+			stpk_trace_format(&events[i], str, sizeof(str));
+			printf("%s\n", str);
+		}
+	}
+
+	memFree(data);
+
+	return 0;
+}
+
+// Decompress a copy of the source buffer repeatedly and report throughput.
+int benchmark(stpk_Context *ctx, int runs, unsigned int windowLen, int into, stpk_Arena *arena)
+{
+	unsigned int retval = 0;
+	int i;
+	clock_t start, total = 0;
+	double seconds, bytes = 0;
+	size_t peak = 0;
+	stpk_Context run;
+
+	for (i = 0; i < runs; i++) {
+		run = stpk_init(ctx->format, 0, ctx->logCallback, ctx->allocCallback, ctx->deallocCallback);
+		run.limit = ctx->limit;
+		run.allocator = ctx->allocator;
+		run.align = ctx->align;
+		run.src.len = ctx->src.len;
+		run.src.offset = ctx->src.offset;
+
+		// Only count memory used by the run.
+		memPeak = memUsed;
+
+		// Passes free their source buffer, so every run needs its own copy.
+		if ((run.src.data = (unsigned char*)memAlloc(sizeof(unsigned char) * run.src.len)) == NULL) {
+			fprintf(stderr, "Error allocating memory for benchmark source buffer. (%s)\n", strerror(errno));
+			return 1;
+		}
+		memcpy(run.src.data, ctx->src.data, run.src.len);
+
+		start = clock();
+		retval = windowLen ? benchmarkStream(&run, windowLen) : into ? decompressInto(&run, NULL) : stpk_decompress(&run);
+		total += clock() - start;
+
+		bytes += run.dst.len;
+		stpk_deinit(&run);
+		if (arena != NULL) {
+			stpk_arena_reset(arena);
+		}
+		if (memPeak - memUsed > peak) {
+			peak = memPeak - memUsed;
+		}
+
+		if (retval) {
+			fprintf(stderr, "Benchmark run %d failed with error code %d.\n", i + 1, retval);
+			return retval;
+		}
+	}
+
+	seconds = (double)total / CLOCKS_PER_SEC;
+	printf("Benchmark: %d run(s), %.0f bytes in %.3f s", runs, bytes, seconds);
+	if (seconds > 0) {
+		printf(", %.2f MB/s", bytes / seconds / (1024 * 1024));
+	}
+	printf(", peak memory %lu bytes", (unsigned long)peak);
+	if (arena != NULL) {
+		printf(", peak arena use %u bytes", stpk_arena_peak(arena));
+	}
+	printf("\n");
+
+	return 0;
+}
+
+// Decompress the source buffer as a stream fed a chunk at a time, discarding
+// the output after the limit if it is set. The output length is returned in
+// dst.len.
+unsigned int benchmarkStream(stpk_Context *ctx, unsigned int windowLen)
+{
+	unsigned char dst[CHUNK_LEN];
+	unsigned int retval, offset = ctx->src.offset, len, read;
+	stpk_Stream *stream;
+
+	if ((stream = stpk_stream_init(ctx, windowLen)) == NULL) {
+		return 1;
+	}
+
+	do {
+		len = ctx->src.len - offset < CHUNK_LEN ? ctx->src.len - offset : CHUNK_LEN;
+		offset += stpk_stream_feed(stream, ctx->src.data + offset, len);
+		if (offset == ctx->src.len) {
+			stpk_stream_end(stream);
+		}
+
+		do {
+			retval = stpk_stream_read(stream, dst, ctx->limit && ctx->limit - ctx->dst.len < CHUNK_LEN ? ctx->limit - ctx->dst.len : CHUNK_LEN, &read);
+			ctx->dst.len += read;
+
+			if (ctx->limit && ctx->dst.len == ctx->limit) {
+				retval = STPK_RET_OK;
+			}
+		} while (retval == STPK_RET_MORE_OUTPUT);
+	} while (retval == STPK_RET_NEED_INPUT);
+
+	stpk_stream_deinit(stream);
+
+	return retval;
+}
+
+// Decompress into buffers allocated up front for the output and scratch
+// lengths read from the headers. The output buffer is handed to the context
+// like one the library allocated, unless given as dst with room for
+// stpk_getDecompressedSize() bytes and STPK_DST_PADDING to spare.
+unsigned int decompressInto(stpk_Context *ctx, unsigned char *dst)
+{
+	unsigned int retval, len = stpk_getDecompressedSize(ctx), scratchLen = stpk_getScratchLen(ctx);
+	unsigned char *scratch = NULL;
+	int own = dst == NULL;
+
+	if (own && (dst = (unsigned char*)ctx->allocCallback(sizeof(unsigned char) * (len + STPK_DST_PADDING))) == NULL) {
+		fprintf(stderr, "Error allocating memory for destination buffer. (%s)\n", strerror(errno));
+		return 1;
+	}
+
+	if (scratchLen && (scratch = (unsigned char*)ctx->allocCallback(sizeof(unsigned char) * scratchLen)) == NULL) {
+		fprintf(stderr, "Error allocating memory for scratch buffer. (%s)\n", strerror(errno));
+		if (own) {
+			ctx->deallocCallback(dst);
+		}
+		return 1;
+	}
+
+	retval = stpk_decompressInto(ctx, dst, len, scratch, scratchLen);
+	if (own) {
+		ctx->dst.data = dst;
+	}
+
+	if (scratch != NULL) {
+		ctx->deallocCallback(scratch);
+	}
+
+	return retval;
+}
+
+#ifdef MAP_FILES
+// Map the source file read-only as the source buffer. Returns 0, leaving the
+// source to be read, if it can not be mapped or the output length is unknown.
+int mapSource(stpk_Context *ctx, FILE *srcFile)
+{
+	void *data = mmap(NULL, ctx->src.len, PROT_READ, MAP_PRIVATE, fileno(srcFile), 0);
+
+	if (data == MAP_FAILED) {
+		return 0;
+	}
+
+	ctx->src.data = (unsigned char*)data;
+	if (!stpk_getDecompressedSize(ctx)) {
+		munmap(data, ctx->src.len);
+		ctx->src.data = NULL;
+		return 0;
+	}
+
+	posix_madvise(data, ctx->src.len, POSIX_MADV_SEQUENTIAL);
+
+	return 1;
+}
+
+// Check that the destination file can be replaced by a decompressed temporary
+// file, which is the case if it is missing or a regular file rather than a
+// link or device, which are written through with stdio. Gets the mode a
+// new file is given, or that of the file it replaces.
+int mapDestination(const char *dstFileName, mode_t *mode)
+{
+	struct stat st;
+	mode_t mask;
+
+	if (lstat(dstFileName, &st) == 0) {
+		if (mode != NULL) {
+			*mode = st.st_mode & 07777;
+		}
+		return S_ISREG(st.st_mode);
+	}
+
+	if (mode != NULL) {
+		mask = umask(0);
+		umask(mask);
+		*mode = 0666 & ~mask;
+	}
+
+	return errno == ENOENT;
+}
+
+// Decompress a mapped source into a temporary file mapped into memory next to
+// the destination, so the output is decoded straight into the page cache
+// instead of written after. The file is sized for the padding decoders may
+// write past the output while mapped, and cut to the length decompressed
+// after. It replaces the destination on success, which leaves the destination
+// untouched on failure and lets the source be decompressed onto itself.
+unsigned int decompressMapped(stpk_Context *ctx, char *dstFileName, int verbose)
+{
+	unsigned int retval = 1;
+	size_t len = (size_t)stpk_getDecompressedSize(ctx) + STPK_DST_PADDING;
+	void *dst;
+	char *tmpFileName;
+	mode_t mode;
+	int fd;
+
+	if (!mapDestination(dstFileName, &mode)) {
+		ERR("Error opening destination file \"%s\" for writing. (%s)\n", dstFileName, strerror(errno));
+		return 1;
+	}
+
+	if ((tmpFileName = (char*)malloc(strlen(dstFileName) + 8)) == NULL) {
+		ERR("Error allocating memory for temporary file name. (%s)\n", strerror(errno));
+		return 1;
+	}
+
+	sprintf(tmpFileName, "%s.XXXXXX", dstFileName);
+	if ((fd = mkstemp(tmpFileName)) == -1) {
+		ERR("Error creating temporary file \"%s\". (%s)\n", tmpFileName, strerror(errno));
+		free(tmpFileName);
+		return 1;
+	}
+
+	if (fchmod(fd, mode) != 0 || ftruncate(fd, (off_t)len) != 0 || (dst = mmap(NULL, len, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0)) == MAP_FAILED) {
+		ERR("Error mapping temporary file \"%s\". (%s)\n", tmpFileName, strerror(errno));
+		goto closeDstFile;
+	}
+
+	posix_madvise(dst, len, POSIX_MADV_SEQUENTIAL);
+
+	retval = decompressInto(ctx, (unsigned char*)dst);
+
+	if (!retval) {
+		VERBOSE("\nPeak memory: %lu bytes\n\n", (unsigned long)memPeak);
+		MSG("Writing file \"%s\"... ", dstFileName);
+	}
+
+	if ((munmap(dst, len) != 0) | (ftruncate(fd, retval ? 0 : (off_t)ctx->dst.len) != 0)) {
+		ERR("Error writing temporary file \"%s\" content. (%s)\n", tmpFileName, strerror(errno));
+		retval = 1;
+	}
+
+closeDstFile:
+	if (close(fd) != 0) {
+		ERR("Error closing temporary file \"%s\". (%s)\n", tmpFileName, strerror(errno));
+		retval = 1;
+	}
+
+	if (!retval && rename(tmpFileName, dstFileName) != 0) {
+		ERR("Error replacing destination file \"%s\". (%s)\n", dstFileName, strerror(errno));
+		retval = 1;
+	}
+	else if (!retval) {
+		MSG("Done!\n");
+	}
+
+	if (retval) {
+		remove(tmpFileName);
+	}
+	free(tmpFileName);
+
+	return retval;
+}
+#endif
@@ -0,0 +1,158 @@
+/*
+ * stunpack - Stunts/4D [Sports] Driving game resource unpacker
+ * Copyright (C) 2008-2024 Daniel Stien <daniel@stien.org>
+ *  
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ * 
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ * 
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software 
+ * Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA 02111-1307, USA.
+ */
+
+// Test of picking the DSI version of Huffman passes. Samples of both versions,
+// some with trailing bytes after the bit stream, are decoded as whole files and
+// as streams fed a chunk at a time. No errors may be logged, as a pass decoded
+// with the wrong version first logs one before it is retried.
+
+#include <stdarg.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <stunpack.h>
+
+#include "sample.h"
+
+#define DETECT_CHUNK_LEN  0x3E8
+#define DETECT_WINDOW_LEN 0x400
+
+typedef struct {
+	unsigned int   len;
+	stpk_FmtDsiVer version;
+	unsigned int   trailing;
+} detect_Case;
+
+static const detect_Case cases[] = {
+	{ 0x100,  STPK_FMT_DSI_VER_1, 0 },
+	{ 0x100,  STPK_FMT_DSI_VER_1, 5 },
+	{ 0x100,  STPK_FMT_DSI_VER_2, 0 },
+	{ 0x800,  STPK_FMT_DSI_VER_1, 3 },
+	{ 0x800,  STPK_FMT_DSI_VER_2, 0 },
+	{ 0x3000, STPK_FMT_DSI_VER_1, 0 },
+	{ 0x3000, STPK_FMT_DSI_VER_1, 9 },
+	{ 0x3000, STPK_FMT_DSI_VER_2, 0 }
+};
+
+// Errors logged by the current decode.
+static unsigned int errors;
+
+static void detect_log(void *userData, stpk_LogType type, const char *msg, va_list args)
+{
+	(void)userData;
+
+	if (type == STPK_LOG_ERR) {
+		errors++;
+		fprintf(stderr, "detect: ");
+		vfprintf(stderr, msg, args);
+	}
+}
+
+// Decode a sample as a stream fed a chunk at a time into dst.
+static unsigned int detect_stream(stpk_Context *ctx, const unsigned char *src, unsigned int srcLen, unsigned char *dst, unsigned int dstLen, unsigned int *len)
+{
+	unsigned int retval, fed = 0, read;
+	stpk_Stream *stream;
+
+	*len = 0;
+
+	if ((stream = stpk_stream_init(ctx, DETECT_WINDOW_LEN)) == NULL) {
+		return STPK_RET_ERR;
+	}
+
+	do {
+		fed += stpk_stream_feed(stream, src + fed, srcLen - fed < DETECT_CHUNK_LEN ? srcLen - fed : DETECT_CHUNK_LEN);
+		if (fed == srcLen) {
+			stpk_stream_end(stream);
+		}
+		retval = stpk_stream_read(stream, dst + *len, dstLen - *len, &read);
+		*len += read;
+	} while (retval == STPK_RET_NEED_INPUT || retval == STPK_RET_MORE_OUTPUT);
+
+	stpk_stream_deinit(stream);
+
+	return retval;
+}
+
+int main(void)
+{
+	unsigned int i, retval, len, srcLen, failures = 0, count = sizeof(cases) / sizeof(cases[0]);
+	unsigned char *ref, *src, *dst;
+	stpk_Format format;
+	stpk_Context ctx;
+	const detect_Case *c;
+
+	memset(&format, 0, sizeof(format));
+	format.type = STPK_FMT_AUTO;
+
+	for (i = 0; i < count; i++) {
+		c = &cases[i];
+
+		if ((ref = (unsigned char*)malloc(c->len)) == NULL || (dst = (unsigned char*)malloc(c->len)) == NULL) {
+			fprintf(stderr, "detect: Error allocating memory\n");
+			return 1;
+		}
+
+		sample_genData(ref, c->len, 0xD5170000 + i);
+		if ((src = sample_encodeHuff(ref, c->len, c->version, c->trailing, &srcLen)) == NULL) {
+			fprintf(stderr, "detect: Error generating sample %u\n", i);
+			return 1;
+		}
+
+		ctx = stpk_init(format, 0, NULL, malloc, free);
+		ctx.logSink = detect_log;
+
+		errors = 0;
+		ctx.src.data = src;
+		ctx.src.len = srcLen;
+		ctx.src.offset = 0;
+		retval = stpk_decompress(&ctx);
+		if (retval != STPK_RET_OK || ctx.dst.len != c->len || memcmp(ctx.dst.data, ref, c->len) != 0 || errors) {
+			fprintf(stderr, "detect: %s sample %u of %u bytes with %u trailing bytes does not decode whole (%u, %u errors)\n",
+				stpk_fmtDsiVerStr(c->version), i, c->len, c->trailing, retval, errors);
+			failures++;
+		}
+		else if (ctx.format.dsi.detected != c->version) {
+			fprintf(stderr, "detect: %s sample %u was detected as %s\n",
+				stpk_fmtDsiVerStr(c->version), i, stpk_fmtDsiVerStr(ctx.format.dsi.detected));
+			failures++;
+		}
+		free(ctx.dst.data);
+		ctx.dst.data = NULL;
+
+		errors = 0;
+		retval = detect_stream(&ctx, src, srcLen, dst, c->len, &len);
+		if (retval != STPK_RET_OK || len != c->len || memcmp(dst, ref, len) != 0 || errors) {
+			fprintf(stderr, "detect: %s sample %u of %u bytes with %u trailing bytes does not decode as a stream (%u, %u errors)\n",
+				stpk_fmtDsiVerStr(c->version), i, c->len, c->trailing, retval, errors);
+			failures++;
+		}
+
+		ctx.src.data = NULL;
+		stpk_deinit(&ctx);
+		free(src);
+		free(dst);
+		free(ref);
+	}
+
+	printf("detect: %u samples, %u failed\n", count, failures);
+
+	return failures ? 1 : 0;
+}
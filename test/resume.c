@@ -0,0 +1,307 @@
+/*
+ * stunpack - Stunts/4D [Sports] Driving game resource unpacker
+ * Copyright (C) 2008-2024 Daniel Stien <daniel@stien.org>
+ *  
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ * 
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ * 
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software 
+ * Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA 02111-1307, USA.
+ */
+
+// Test of resuming from checkpoint indexes. Samples of each streamed pass type
+// are indexed while decoded as a stream, and ranges of their output decoded
+// again from the index after it is saved and loaded. Indexes with their
+// checkpoints corrupted must be rejected, or decode without reading or writing
+// out of bounds, which builds with sanitizers check.
+
+#include <stdarg.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <stunpack.h>
+
+#include "sample.h"
+
+#define RESUME_SAMPLE_LEN 0x10000
+#define RESUME_INTERVAL   0x1000
+#define RESUME_RANGE_LEN  0x180
+#define RESUME_CHUNK_LEN  0x3E8
+
+// Result of decoding a range when the index is rejected.
+#define RESUME_REJECTED 2
+
+// Layout of the sidecar file as saved by stpk_index_save(): the type of a
+// run-length stage, the length of the header, of the fixed part of each
+// checkpoint and of the state of each stage type, and the fields of the state
+// corrupted here.
+#define RESUME_TYPE_RLE         0x01
+#define RESUME_FILE_HEADER_LEN  15
+#define RESUME_CHECKPOINT_LEN   9
+#define RESUME_STATE_RLE_LEN    27
+#define RESUME_STATE_RPCK_LEN   13
+#define RESUME_STATE_OFFSET     0
+#define RESUME_STATE_SEQLEN     4
+#define RESUME_STATE_SEQREP     12
+
+typedef struct {
+	const char    *name;
+	unsigned char *data;
+	unsigned int  len;
+} resume_Sample;
+
+static stpk_Format format;
+
+static void resume_log(void *userData, stpk_LogType type, const char *msg, va_list args)
+{
+	(void)userData;
+	(void)type;
+	(void)msg;
+	(void)args;
+}
+
+static stpk_Context resume_init(const resume_Sample *sample)
+{
+	stpk_Context ctx = stpk_init(format, 0, NULL, malloc, free);
+
+	ctx.logSink = resume_log;
+	ctx.src.data = sample->data;
+	ctx.src.len = sample->len;
+	ctx.src.offset = 0;
+
+	return ctx;
+}
+
+static void resume_deinit(stpk_Context *ctx)
+{
+	ctx->src.data = NULL;
+	stpk_deinit(ctx);
+}
+
+// Decode a sample as a stream fed a chunk at a time, and save the index built
+// along the way. Returns NULL on failure.
+static unsigned char *resume_index(const resume_Sample *sample, unsigned char *dst, unsigned int *len)
+{
+	stpk_Context ctx = resume_init(sample);
+	stpk_Stream *stream;
+	stpk_Index *index;
+	unsigned char *data = NULL;
+	unsigned int retval, fed = 0, read, dstLen = 0;
+
+	if ((stream = stpk_stream_init(&ctx, 0)) == NULL || (index = stpk_index_init(&ctx, RESUME_INTERVAL)) == NULL) {
+		return NULL;
+	}
+	stpk_stream_index(stream, index);
+
+	do {
+		fed += stpk_stream_feed(stream, sample->data + fed, sample->len - fed < RESUME_CHUNK_LEN ? sample->len - fed : RESUME_CHUNK_LEN);
+		if (fed == sample->len) {
+			stpk_stream_end(stream);
+		}
+		retval = stpk_stream_read(stream, dst + dstLen, RESUME_SAMPLE_LEN - dstLen, &read);
+		dstLen += read;
+	} while (retval == STPK_RET_NEED_INPUT || retval == STPK_RET_MORE_OUTPUT);
+
+	if (retval == STPK_RET_OK && dstLen == RESUME_SAMPLE_LEN && (data = (unsigned char*)malloc(stpk_index_save(index, NULL))) != NULL) {
+		*len = stpk_index_save(index, data);
+	}
+
+	stpk_index_deinit(index);
+	stpk_stream_deinit(stream);
+	resume_deinit(&ctx);
+
+	return data;
+}
+
+// Decode a range of the output of a sample from a saved index, and compare it
+// to ref if given. Returns RESUME_REJECTED if the index is rejected, 1 if the
+// range does not match or 0 otherwise.
+static unsigned int resume_range(const resume_Sample *sample, const unsigned char *data, unsigned int len, unsigned int offset, const unsigned char *ref)
+{
+	stpk_Context ctx = resume_init(sample);
+	stpk_Index *index;
+	unsigned int retval, expected = RESUME_SAMPLE_LEN - offset < RESUME_RANGE_LEN ? RESUME_SAMPLE_LEN - offset : RESUME_RANGE_LEN;
+
+	if ((index = stpk_index_load(&ctx, data, len)) == NULL) {
+		resume_deinit(&ctx);
+		return RESUME_REJECTED;
+	}
+
+	if ((retval = stpk_decompressRange(&ctx, index, offset, RESUME_RANGE_LEN)) != STPK_RET_OK) {
+		retval = RESUME_REJECTED;
+	}
+	else {
+		retval = ctx.dst.len > RESUME_RANGE_LEN || (ref != NULL && (ctx.dst.len != expected || memcmp(ctx.dst.data, ref + offset, expected) != 0));
+	}
+
+	stpk_index_deinit(index);
+	resume_deinit(&ctx);
+
+	return retval;
+}
+
+static unsigned int resume_get32(const unsigned char *src)
+{
+	return src[0] | src[1] << 8 | src[2] << 16 | (unsigned int)src[3] << 24;
+}
+
+// Decode ranges from an index and from copies of it corrupted in each byte of
+// its checkpoints, and in the fields of the state of the last stage that bound
+// where it reads and writes. Returns the number of failures.
+static unsigned int resume_test(const resume_Sample *sample, const unsigned char *data, unsigned int len, const unsigned char *ref, unsigned int *corrupted, unsigned int *rejected)
+{
+	unsigned char *bad;
+	unsigned int failures = 0, retval, count = resume_get32(data + 11), start = RESUME_FILE_HEADER_LEN, checkpointLen, stateLen, p, i, j;
+	unsigned char last = 0;
+
+	for (i = 0; i < data[6]; i++) {
+		last = data[start];
+		start += 3 + data[start + 2];
+	}
+	checkpointLen = count ? (len - start) / count : 0;
+	stateLen = last == RESUME_TYPE_RLE ? RESUME_STATE_RLE_LEN : RESUME_STATE_RPCK_LEN;
+
+	if (count < 2) {
+		fprintf(stderr, "resume: %s sample has %u checkpoint(s)\n", sample->name, count);
+		return 1;
+	}
+
+	for (p = start; p < len; p += checkpointLen) {
+		if (resume_range(sample, data, len, resume_get32(data + p) + 1, ref)) {
+			fprintf(stderr, "resume: %s sample does not decode from checkpoint at %u\n", sample->name, resume_get32(data + p));
+			failures++;
+		}
+	}
+	if (resume_range(sample, data, len, 0, ref) || resume_range(sample, data, len, RESUME_SAMPLE_LEN - RESUME_RANGE_LEN / 2, ref)) {
+		fprintf(stderr, "resume: %s sample does not decode at its ends\n", sample->name);
+		failures++;
+	}
+
+	if ((bad = (unsigned char*)malloc(len)) == NULL) {
+		fprintf(stderr, "resume: Error allocating memory\n");
+		return failures + 1;
+	}
+
+	for (i = start; i < len; i++) {
+		p = start + (i - start) / checkpointLen * checkpointLen;
+
+		for (j = 0; j < 2; j++) {
+			memcpy(bad, data, len);
+			bad[i] = j ? data[i] ^ 0x01 : 0xFF;
+			retval = resume_range(sample, bad, len, resume_get32(data + p), NULL);
+			failures += retval == 1;
+			*rejected += retval == RESUME_REJECTED;
+			(*corrupted)++;
+		}
+	}
+
+	for (p = start; p < len; p += checkpointLen) {
+		// A sequence run longer than the pass, or the source after the
+		// checkpoint.
+		if (last == RESUME_TYPE_RLE) {
+			memcpy(bad, data, len);
+			bad[p + checkpointLen - stateLen + RESUME_STATE_SEQLEN + 3] = 0xFF;
+			bad[p + checkpointLen - stateLen + RESUME_STATE_SEQREP + 2] = 0xFF;
+			if (resume_range(sample, bad, len, resume_get32(data + p), NULL) != RESUME_REJECTED) {
+				fprintf(stderr, "resume: %s sample index with a sequence run past its pass is not rejected\n", sample->name);
+				failures++;
+			}
+			else {
+				(*rejected)++;
+			}
+			(*corrupted)++;
+		}
+
+		// More output decoded than the pass holds.
+		memcpy(bad, data, len);
+		bad[p + checkpointLen - stateLen + RESUME_STATE_OFFSET + 3] = 0xFF;
+		if (resume_range(sample, bad, len, resume_get32(data + p), NULL) != RESUME_REJECTED) {
+			fprintf(stderr, "resume: %s sample index with an offset past its pass is not rejected\n", sample->name);
+			failures++;
+		}
+		else {
+			(*rejected)++;
+		}
+		(*corrupted)++;
+	}
+
+	free(bad);
+
+	return failures;
+}
+
+int main(void)
+{
+	resume_Sample samples[3];
+	unsigned char *ref, *dst, *rle, *pass, *data;
+	unsigned int failures = 0, corrupted = 0, rejected = 0, rleLen, len, i;
+
+	memset(&format, 0, sizeof(format));
+	format.type = STPK_FMT_AUTO;
+
+	if ((ref = (unsigned char*)malloc(RESUME_SAMPLE_LEN)) == NULL || (dst = (unsigned char*)malloc(RESUME_SAMPLE_LEN)) == NULL) {
+		fprintf(stderr, "resume: Error allocating memory\n");
+		return 1;
+	}
+
+	// Sequence runs are only encoded when the output does not hold their
+	// escape code.
+	sample_genData(ref, RESUME_SAMPLE_LEN, 0x5E5E0000);
+	for (i = 0; i < RESUME_SAMPLE_LEN; i++) {
+		ref[i] &= 0x7F;
+	}
+
+	if ((rle = sample_encodeRle(ref, RESUME_SAMPLE_LEN, 1, &rleLen)) == NULL) {
+		fprintf(stderr, "resume: Error generating samples\n");
+		return 1;
+	}
+
+	samples[0].name = "run-length";
+	samples[0].data = rle;
+	samples[0].len = rleLen;
+
+	pass = sample_encodeHuff(rle, rleLen, STPK_FMT_DSI_VER_2, 0, &len);
+	samples[1].name = "Huffman and run-length";
+	samples[1].data = sample_wrapPasses(pass, len, 2, RESUME_SAMPLE_LEN, &samples[1].len);
+
+	samples[2].name = "RPck";
+	samples[2].data = sample_encodeRpck(ref, RESUME_SAMPLE_LEN, &samples[2].len);
+
+	for (i = 0; i < 3; i++) {
+		if (samples[i].data == NULL) {
+			fprintf(stderr, "resume: Error generating samples\n");
+			return 1;
+		}
+	}
+
+	for (i = 0; i < 3; i++) {
+		memset(dst, 0, RESUME_SAMPLE_LEN);
+
+		if ((data = resume_index(&samples[i], dst, &len)) == NULL || memcmp(dst, ref, RESUME_SAMPLE_LEN) != 0) {
+			fprintf(stderr, "resume: %s sample does not decode as a stream\n", samples[i].name);
+			failures++;
+		}
+		else {
+			failures += resume_test(&samples[i], data, len, ref, &corrupted, &rejected);
+		}
+
+		free(data);
+		free(samples[i].data);
+	}
+
+	printf("resume: 3 samples, %u of %u corrupted indexes rejected, %u failed\n", rejected, corrupted, failures);
+
+	free(dst);
+	free(ref);
+
+	return failures ? 1 : 0;
+}
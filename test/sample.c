@@ -0,0 +1,356 @@
+/*
+ * stunpack - Stunts/4D [Sports] Driving game resource unpacker
+ * Copyright (C) 2008-2024 Daniel Stien <daniel@stien.org>
+ *  
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ * 
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ * 
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software 
+ * Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA 02111-1307, USA.
+ */
+
+// Samples of each format encoded from generated output, shared by the tests.
+
+#include <stdlib.h>
+#include <string.h>
+
+#include "sample.h"
+
+// Longest pattern of a generated sequence run.
+#define SAMPLE_SEQ_MAX 8
+
+// Deterministic generator, so failures can be reproduced.
+uint32_t sample_rand(uint32_t *state)
+{
+	*state ^= *state << 13;
+	*state ^= *state >> 17;
+	*state ^= *state << 5;
+	return *state;
+}
+
+static void sample_put24(unsigned char *dst, unsigned int value)
+{
+	dst[0] = value & 0xFF;
+	dst[1] = (value >> 8) & 0xFF;
+	dst[2] = (value >> 16) & 0xFF;
+}
+
+static void sample_put32be(unsigned char *dst, unsigned int value)
+{
+	dst[0] = (value >> 24) & 0xFF;
+	dst[1] = (value >> 16) & 0xFF;
+	dst[2] = (value >> 8) & 0xFF;
+	dst[3] = value & 0xFF;
+}
+
+// Generate output with a skewed alphabet, runs and repeated patterns, like the
+// game's resources.
+void sample_genData(unsigned char *dst, unsigned int len, uint32_t seed)
+{
+	uint32_t state = seed;
+	unsigned int i = 0, run, pattern, j;
+	unsigned char value;
+
+	while (i < len) {
+		value = sample_rand(&state) % 4 ? sample_rand(&state) % 0x10 : sample_rand(&state) % 0x100;
+		run = sample_rand(&state) % 8 ? 1 : 1 + sample_rand(&state) % 0x40;
+
+		// Repeat the bytes just written now and then.
+		if (i > SAMPLE_SEQ_MAX && !(sample_rand(&state) % 0x20)) {
+			pattern = 2 + sample_rand(&state) % (SAMPLE_SEQ_MAX - 1);
+			for (j = pattern * (2 + sample_rand(&state) % 0x10); j && i < len; j--, i++) {
+				dst[i] = dst[i - pattern];
+			}
+			continue;
+		}
+
+		for (; run && i < len; run--) {
+			dst[i++] = value;
+		}
+	}
+}
+
+static int sample_isEsc(unsigned char value)
+{
+	return value == SAMPLE_RLE_RUN || value == SAMPLE_RLE_SEQ || value == SAMPLE_RLE_LONGRUN;
+}
+
+// Find a pattern of escape-free bytes at src that repeats at least three times.
+// Returns the number of repeats, or 0 if there is none.
+static unsigned int sample_findSeq(const unsigned char *src, unsigned int len, unsigned int *patternLen)
+{
+	unsigned int m, rep, i, j;
+
+	for (m = 2; m <= SAMPLE_SEQ_MAX && m * 3 <= len; m++) {
+		// Runs of a single byte are left to single-byte runs.
+		for (i = 0; i < m && !sample_isEsc(src[i]); i++);
+		for (j = 1; j < m && src[j] == src[0]; j++);
+		if (i < m || j == m) {
+			continue;
+		}
+
+		for (rep = 1; (rep + 1) * m <= len && rep < 0xFF && memcmp(src, src + rep * m, m) == 0; rep++);
+		rep -= rep == SAMPLE_RLE_SEQ;
+
+		if (rep >= 3) {
+			*patternLen = m;
+			return rep;
+		}
+	}
+
+	return 0;
+}
+
+// Encode a run-length pass with escape codes for runs of a one-byte count and,
+// if seq is set, for sequence runs of repeated patterns. Sequence runs are found
+// by scanning for their escape code, so the output must not hold it then, nor
+// may counts. Returns NULL if src holds it.
+unsigned char *sample_encodeRle(const unsigned char *src, unsigned int len, int seq, unsigned int *dstLen)
+{
+	unsigned char *dst, *body;
+	unsigned int headerLen = seq ? 12 : 10, i = 0, run, rep, m;
+
+	if (seq && memchr(src, SAMPLE_RLE_SEQ, len) != NULL) {
+		return NULL;
+	}
+
+	if ((dst = (unsigned char*)malloc(len * 3 + headerLen)) == NULL) {
+		return NULL;
+	}
+
+	body = dst + headerLen;
+
+	while (i < len) {
+		if (seq && (rep = sample_findSeq(src + i, len - i, &m))) {
+			*body++ = SAMPLE_RLE_SEQ;
+			memcpy(body, src + i, m);
+			body += m;
+			*body++ = SAMPLE_RLE_SEQ;
+			*body++ = rep;
+			i += m * rep;
+			continue;
+		}
+
+		for (run = 1; i + run < len && src[i + run] == src[i] && run < 0xFF; run++);
+		run -= seq && run == SAMPLE_RLE_SEQ;
+
+		if (run >= 4 || sample_isEsc(src[i])) {
+			*body++ = SAMPLE_RLE_RUN;
+			*body++ = run;
+			*body++ = src[i];
+		}
+		else {
+			memset(body, src[i], run);
+			body += run;
+		}
+
+		i += run;
+	}
+
+	*dstLen = (unsigned int)(body - dst);
+
+	dst[0] = 0x01;
+	sample_put24(dst + 1, len);
+	sample_put24(dst + 4, *dstLen - 10);
+	dst[7] = 0;
+	if (seq) {
+		dst[8] = 3;
+		dst[9] = SAMPLE_RLE_RUN;
+		dst[10] = SAMPLE_RLE_SEQ;
+		dst[11] = SAMPLE_RLE_LONGRUN;
+	}
+	else {
+		dst[8] = 1 | 0x80;
+		dst[9] = SAMPLE_RLE_RUN;
+	}
+
+	return dst;
+}
+
+// Get the Huffman code width of each byte value from its frequency, or 0 for
+// values not used. Returns the widest code.
+static unsigned int sample_huffWidths(const unsigned char *src, unsigned int len, unsigned int *widths)
+{
+	unsigned int weight[0x200], parent[0x200], nodes = 0, i, j, a, b, active, widest = 0;
+	int used[0x200];
+
+	memset(weight, 0, sizeof(weight));
+	for (i = 0; i < len; i++) {
+		weight[src[i]]++;
+	}
+
+	for (i = 0; i < 0x100; i++) {
+		used[i] = weight[i] > 0;
+	}
+	nodes = 0x100;
+
+	for (;;) {
+		a = b = 0x200;
+		for (i = 0, active = 0; i < nodes; i++) {
+			if (!used[i]) {
+				continue;
+			}
+			active++;
+			if (a == 0x200 || weight[i] < weight[a]) {
+				b = a;
+				a = i;
+			}
+			else if (b == 0x200 || weight[i] < weight[b]) {
+				b = i;
+			}
+		}
+
+		if (active < 2) {
+			break;
+		}
+
+		weight[nodes] = weight[a] + weight[b];
+		used[nodes] = 1;
+		used[a] = used[b] = 0;
+		parent[a] = parent[b] = nodes;
+		nodes++;
+	}
+
+	for (i = 0; i < 0x100; i++) {
+		widths[i] = 0;
+		if (weight[i]) {
+			for (j = i; j != nodes - 1; j = parent[j]) {
+				widths[i]++;
+			}
+			widest = widths[i] > widest ? widths[i] : widest;
+		}
+	}
+
+	return widest;
+}
+
+// Encode a Huffman pass with canonical codes, where the leaves of each level
+// take the lowest codes and the nodes above them lead to the next level,
+// followed by trailing bytes of junk like some game files have. DSI1 bit
+// streams have the bits of each byte reversed.
+unsigned char *sample_encodeHuff(const unsigned char *src, unsigned int len, stpk_FmtDsiVer version, unsigned int trailing, unsigned int *dstLen)
+{
+	unsigned int widths[0x100], codes[0x100], leaves[SAMPLE_LEVELS_MAX], levels, base = 0, bits = 0, need, i, j;
+	unsigned char *dst, *out, rev;
+
+	levels = sample_huffWidths(src, len, widths);
+	if (levels < 2 || levels > SAMPLE_LEVELS_MAX) {
+		return NULL;
+	}
+
+	if ((dst = (unsigned char*)calloc(len * 2 + trailing + 0x200, 1)) == NULL) {
+		return NULL;
+	}
+
+	dst[0] = 0x02;
+	sample_put24(dst + 1, len);
+	dst[4] = levels;
+	out = dst + 5 + levels;
+
+	for (i = 0; i < levels; i++) {
+		leaves[i] = 0;
+		for (j = 0; j < 0x100; j++) {
+			if (widths[j] == i + 1) {
+				codes[j] = base + leaves[i]++;
+				*out++ = j;
+			}
+		}
+		dst[5 + i] = leaves[i];
+		base = (base + leaves[i]) * 2;
+	}
+
+	for (i = 0; i < len; i++) {
+		for (j = widths[src[i]]; j--; bits++) {
+			if ((codes[src[i]] >> j) & 1) {
+				out[bits / 8] |= 0x80 >> (bits % 8);
+			}
+		}
+	}
+
+	// The decoder reads one byte ahead of the last code.
+	need = (bits + 7) / 8 + 1;
+	need = need < 2 ? 2 : need;
+
+	if (version == STPK_FMT_DSI_VER_1) {
+		for (i = 0; i < need; i++) {
+			for (j = 0, rev = 0; j < 8; j++) {
+				rev |= ((out[i] >> j) & 1) << (7 - j);
+			}
+			out[i] = rev;
+		}
+	}
+
+	for (i = 0; i < trailing; i++) {
+		out[need + i] = 0xA5 ^ (i * 0x3B);
+	}
+
+	*dstLen = (unsigned int)(out - dst) + need + trailing;
+
+	return dst;
+}
+
+// Encode an RPck file of runs of up to 128 bytes and literal blocks between
+// them.
+unsigned char *sample_encodeRpck(const unsigned char *src, unsigned int len, unsigned int *dstLen)
+{
+	unsigned char *dst, *out;
+	unsigned int i = 0, run, lit;
+
+	if ((dst = (unsigned char*)malloc(len * 2 + 12)) == NULL) {
+		return NULL;
+	}
+
+	out = dst + 12;
+
+	while (i < len) {
+		for (run = 1; i + run < len && src[i + run] == src[i] && run < 0x80; run++);
+
+		if (run >= 3) {
+			*out++ = run - 1;
+			*out++ = src[i];
+			i += run;
+			continue;
+		}
+
+		for (lit = 1; i + lit < len && lit < 0x80 && !(i + lit + 2 < len && src[i + lit] == src[i + lit + 1] && src[i + lit] == src[i + lit + 2]); lit++);
+		*out++ = (unsigned char)-(int)lit;
+		memcpy(out, src + i, lit);
+		out += lit;
+		i += lit;
+	}
+
+	*dstLen = (unsigned int)(out - dst);
+
+	memcpy(dst, "RPck", 4);
+	sample_put32be(dst + 4, len);
+	sample_put32be(dst + 8, len + 14 - *dstLen);
+
+	return dst;
+}
+
+// Wrap passes in a file header of more than one pass, taking the passes.
+unsigned char *sample_wrapPasses(unsigned char *pass, unsigned int len, unsigned char passes, unsigned int finalLen, unsigned int *dstLen)
+{
+	unsigned char *dst;
+
+	if (pass == NULL || (dst = (unsigned char*)malloc(len + 4)) == NULL) {
+		free(pass);
+		return NULL;
+	}
+
+	dst[0] = 0x80 | passes;
+	sample_put24(dst + 1, finalLen);
+	memcpy(dst + 4, pass, len);
+	free(pass);
+	*dstLen = len + 4;
+
+	return dst;
+}
@@ -0,0 +1,41 @@
+/*
+ * stunpack - Stunts/4D [Sports] Driving game resource unpacker
+ * Copyright (C) 2008-2024 Daniel Stien <daniel@stien.org>
+ *  
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ * 
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ * 
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software 
+ * Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA 02111-1307, USA.
+ */
+
+#ifndef STPK_TEST_SAMPLE_H
+#define STPK_TEST_SAMPLE_H
+
+#include <stdint.h>
+#include <stunpack.h>
+
+// Escape codes of generated run-length passes, for runs with a one-byte count,
+// sequence runs and runs with a two-byte count.
+#define SAMPLE_RLE_RUN     0xF0
+#define SAMPLE_RLE_SEQ     0xF1
+#define SAMPLE_RLE_LONGRUN 0xF2
+
+#define SAMPLE_LEVELS_MAX  0x10
+
+uint32_t sample_rand(uint32_t *state);
+void sample_genData(unsigned char *dst, unsigned int len, uint32_t seed);
+unsigned char *sample_encodeRle(const unsigned char *src, unsigned int len, int seq, unsigned int *dstLen);
+unsigned char *sample_encodeHuff(const unsigned char *src, unsigned int len, stpk_FmtDsiVer version, unsigned int trailing, unsigned int *dstLen);
+unsigned char *sample_encodeRpck(const unsigned char *src, unsigned int len, unsigned int *dstLen);
+unsigned char *sample_wrapPasses(unsigned char *pass, unsigned int len, unsigned char passes, unsigned int finalLen, unsigned int *dstLen);
+
+#endif
@@ -0,0 +1,269 @@
+/*
+ * stunpack - Stunts/4D [Sports] Driving game resource unpacker
+ * Copyright (C) 2008-2024 Daniel Stien <daniel@stien.org>
+ *  
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ * 
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ * 
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software 
+ * Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA 02111-1307, USA.
+ */
+
+// Stress test of decoding on many threads at once. Samples of each format are
+// generated up front, and every thread decodes all of them again and again
+// through the whole-file, caller buffer and stream APIs, each with a context
+// and log sink of its own, checking the output byte for byte.
+
+#include <pthread.h>
+#include <stdarg.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <stunpack.h>
+
+#include "sample.h"
+
+#define STRESS_THREADS 8
+#define STRESS_ROUNDS  16
+
+// Decoded length of the samples, a few times the longest stream window.
+#define STRESS_SAMPLE_LEN 0x30000
+
+// Length of the chunks fed to streams and of their windows, short enough for
+// every stage to be refilled many times.
+#define STRESS_CHUNK_LEN  0x3E8
+#define STRESS_WINDOW_LEN 0x400
+
+typedef struct {
+	const char    *name;
+	unsigned char *data;
+	unsigned int  len;
+} stress_Sample;
+
+typedef struct {
+	pthread_t    thread;
+	unsigned int id;
+	unsigned int decodes;
+	unsigned int failures;
+	unsigned int logs;      // Messages passed to the log sink of the thread's contexts.
+	unsigned int misrouted; // Messages passed to the log sink of another thread.
+} stress_Worker;
+
+static stress_Sample samples[4];
+static unsigned char *ref;
+static unsigned int sampleCount, rounds = STRESS_ROUNDS;
+
+// Worker of the calling thread.
+static pthread_key_t workerKey;
+
+static int stress_genSamples(void)
+{
+	unsigned char *rle, *pass;
+	unsigned int rleLen, len, i;
+
+	if ((ref = (unsigned char*)malloc(STRESS_SAMPLE_LEN)) == NULL) {
+		return 1;
+	}
+
+	sample_genData(ref, STRESS_SAMPLE_LEN, 0x5EED1234);
+
+	if ((rle = sample_encodeRle(ref, STRESS_SAMPLE_LEN, 0, &rleLen)) == NULL) {
+		return 1;
+	}
+
+	samples[0].name = "DSI2 Huffman";
+	samples[0].data = sample_encodeHuff(ref, STRESS_SAMPLE_LEN, STPK_FMT_DSI_VER_2, 0, &samples[0].len);
+	samples[1].name = "DSI1 Huffman and run-length";
+	pass = sample_encodeHuff(rle, rleLen, STPK_FMT_DSI_VER_1, 0, &len);
+	samples[1].data = sample_wrapPasses(pass, len, 2, STRESS_SAMPLE_LEN, &samples[1].len);
+	samples[2].name = "DSI2 Huffman and run-length";
+	pass = sample_encodeHuff(rle, rleLen, STPK_FMT_DSI_VER_2, 0, &len);
+	samples[2].data = sample_wrapPasses(pass, len, 2, STRESS_SAMPLE_LEN, &samples[2].len);
+	samples[3].name = "RPck";
+	samples[3].data = sample_encodeRpck(ref, STRESS_SAMPLE_LEN, &samples[3].len);
+	sampleCount = 4;
+
+	free(rle);
+
+	for (i = 0; i < sampleCount; i++) {
+		if (samples[i].data == NULL) {
+			return 1;
+		}
+	}
+
+	return 0;
+}
+
+// Count the messages of a thread's contexts, which must only ever be passed
+// the thread's own user data.
+static void stress_log(void *userData, stpk_LogType type, const char *msg, va_list args)
+{
+	stress_Worker *worker = (stress_Worker*)userData;
+
+	if (pthread_getspecific(workerKey) != worker) {
+		worker->misrouted++;
+	}
+	worker->logs++;
+
+	if (type == STPK_LOG_ERR) {
+		fprintf(stderr, "stress: thread %u: ", worker->id);
+		vfprintf(stderr, msg, args);
+	}
+}
+
+// Decode a sample through the API picked by mode into dst.
+static unsigned int stress_decode(stpk_Context *ctx, const stress_Sample *sample, unsigned int mode, unsigned char *dst, unsigned int *len)
+{
+	unsigned int retval, scratchLen, fed = 0, read;
+	unsigned char *scratch;
+	stpk_Stream *stream;
+
+	ctx->src.data = sample->data;
+	ctx->src.len = sample->len;
+	ctx->src.offset = 0;
+	*len = 0;
+
+	switch (mode) {
+		case 0:
+			if ((retval = stpk_decompress(ctx)) == STPK_RET_OK) {
+				memcpy(dst, ctx->dst.data, ctx->dst.len);
+				*len = ctx->dst.len;
+			}
+			free(ctx->dst.data);
+			ctx->dst.data = NULL;
+			return retval;
+		case 1:
+			scratchLen = stpk_getScratchLen(ctx);
+			if ((scratch = (unsigned char*)malloc(scratchLen ? scratchLen : 1)) == NULL) {
+				return STPK_RET_ERR;
+			}
+			retval = stpk_decompressInto(ctx, dst, STRESS_SAMPLE_LEN, scratch, scratchLen);
+			*len = ctx->dst.len;
+			free(scratch);
+			return retval;
+		default:
+			if ((stream = stpk_stream_init(ctx, STRESS_WINDOW_LEN)) == NULL) {
+				return STPK_RET_ERR;
+			}
+			do {
+				fed += stpk_stream_feed(stream, sample->data + fed, sample->len - fed < STRESS_CHUNK_LEN ? sample->len - fed : STRESS_CHUNK_LEN);
+				if (fed == sample->len) {
+					stpk_stream_end(stream);
+				}
+				retval = stpk_stream_read(stream, dst + *len, STRESS_SAMPLE_LEN - *len, &read);
+				*len += read;
+			} while (retval == STPK_RET_NEED_INPUT || retval == STPK_RET_MORE_OUTPUT);
+			stpk_stream_deinit(stream);
+			return retval;
+	}
+}
+
+static void *stress_run(void *arg)
+{
+	stress_Worker *worker = (stress_Worker*)arg;
+	stpk_Format format;
+	stpk_Context ctx;
+	unsigned char *dst;
+	unsigned int round, i, mode, len, retval;
+	const stress_Sample *sample;
+
+	pthread_setspecific(workerKey, worker);
+
+	if ((dst = (unsigned char*)malloc(STRESS_SAMPLE_LEN + STPK_DST_PADDING)) == NULL) {
+		worker->failures++;
+		return NULL;
+	}
+
+	memset(&format, 0, sizeof(format));
+	format.type = STPK_FMT_AUTO;
+
+	for (round = 0; round < rounds; round++) {
+		for (i = 0; i < sampleCount; i++) {
+			sample = &samples[(i + worker->id) % sampleCount];
+			mode = (round + i + worker->id) % 3;
+
+			ctx = stpk_init(format, 1, NULL, malloc, free);
+			ctx.logSink = stress_log;
+			ctx.logData = worker;
+
+			retval = stress_decode(&ctx, sample, mode, dst, &len);
+			worker->decodes++;
+
+			if (retval != STPK_RET_OK || len != STRESS_SAMPLE_LEN || memcmp(dst, ref, len) != 0) {
+				fprintf(stderr, "stress: thread %u: %s sample decoded through API %u does not match (%u, %u bytes)\n", worker->id, sample->name, mode, retval, len);
+				worker->failures++;
+			}
+			else if (ctx.format.type != STPK_FMT_AUTO || ctx.format.dsi.version != STPK_FMT_DSI_VER_AUTO) {
+				fprintf(stderr, "stress: thread %u: %s sample decoded through API %u changed the format asked for\n", worker->id, sample->name, mode);
+				worker->failures++;
+			}
+		}
+	}
+
+	free(dst);
+
+	return NULL;
+}
+
+int main(int argc, char **argv)
+{
+	stress_Worker workers[STRESS_THREADS * 4];
+	unsigned int threads = STRESS_THREADS, i, decodes = 0, failures = 0;
+
+	if (argc > 1 && (sscanf(argv[1], "%u", &threads) != 1 || !threads || threads > STRESS_THREADS * 4)) {
+		fprintf(stderr, "Usage: %s [THREADS [ROUNDS]]\n", argv[0]);
+		return 1;
+	}
+	if (argc > 2 && sscanf(argv[2], "%u", &rounds) != 1) {
+		fprintf(stderr, "Usage: %s [THREADS [ROUNDS]]\n", argv[0]);
+		return 1;
+	}
+
+	if (stress_genSamples() || pthread_key_create(&workerKey, NULL) != 0) {
+		fprintf(stderr, "stress: Error generating samples\n");
+		return 1;
+	}
+
+	for (i = 0; i < threads; i++) {
+		workers[i].id = i;
+		workers[i].decodes = workers[i].failures = workers[i].logs = workers[i].misrouted = 0;
+
+		if (pthread_create(&workers[i].thread, NULL, stress_run, &workers[i]) != 0) {
+			fprintf(stderr, "stress: Error creating thread %u\n", i);
+			return 1;
+		}
+	}
+
+	for (i = 0; i < threads; i++) {
+		pthread_join(workers[i].thread, NULL);
+		decodes += workers[i].decodes;
+		failures += workers[i].failures;
+
+		if (workers[i].misrouted) {
+			fprintf(stderr, "stress: thread %u: %u of %u messages logged by other threads\n", i, workers[i].misrouted, workers[i].logs);
+			failures++;
+		}
+		if (!workers[i].logs) {
+			fprintf(stderr, "stress: thread %u: Nothing logged\n", i);
+			failures++;
+		}
+	}
+
+	for (i = 0; i < sampleCount; i++) {
+		free(samples[i].data);
+	}
+	free(ref);
+
+	printf("stress: %u decodes of %u samples on %u threads, %u failed\n", decodes, sampleCount, threads, failures);
+
+	return failures ? 1 : 0;
+}